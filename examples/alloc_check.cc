@@ -0,0 +1,93 @@
+/*  This file is part of h264flow.
+
+    h264flow is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    h264flow is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with h264flow.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* checks that a FrameDecoder reaches a steady state without heap
+ * allocations. every operator new is counted. the clip is decoded once to let
+ * the buffers grow to their largest size, then decoding it again into the
+ * same MvFrame has to leave the count alone, at every parse depth. exits with
+ * failure otherwise.
+ */
+
+#include <cstdlib>
+#include <new>
+#include "../src/decoder/h264.hh"
+#include "../src/util/argparser.hh"
+
+using namespace std;
+
+static uint64_t num_allocations = 0;
+
+void * operator new(size_t size) {
+    num_allocations++;
+    void * ptr = malloc(size ? size : 1);
+    if (!ptr)
+        throw bad_alloc();
+    return ptr;
+}
+
+void operator delete(void * ptr) noexcept { free(ptr); }
+void operator delete(void * ptr, size_t) noexcept { free(ptr); }
+
+/* returns the number of frames that allocated in the second pass */
+static uint64_t check(h264 &decoder, ParseDepth depth, const string &name) {
+    decoder.set_parse_depth(depth);
+    FrameDecoder frame_decoder(decoder);
+    MvFrame frame;
+    uint64_t allocating_frames = 0, allocations = 0, errors = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint64_t frame_num = 0; frame_num < decoder.index_size();
+             frame_num++) {
+            uint64_t before = num_allocations;
+            try {
+                frame_decoder.decode(frame_num, frame);
+            } catch (exception &) {
+                /* the error itself allocates. NotImplemented is a
+                 * logic_error */
+                errors += pass;
+                continue;
+            }
+            if (pass && num_allocations != before) {
+                allocating_frames++;
+                allocations += num_allocations - before;
+            }
+        }
+    }
+    cout << name << ": " << allocations << " allocations in "
+         << allocating_frames << " frames after warm-up";
+    if (errors)
+        cout << ", " << errors << " frames not decoded";
+    cout << endl;
+    return allocating_frames;
+}
+
+int main(int argc, char *argv[]) {
+    ArgParser parser("Check that decoding frames does not allocate once the "
+                     "decoder is warmed up");
+    parser.add_arg("-i", "input", "media file input");
+    if (!parser.parse(argc, argv))
+        return EXIT_FAILURE;
+    auto arg_values = parser.get_args();
+
+    h264 decoder(arg_values["input"]);
+    /* builds the index, which is allowed to allocate */
+    decoder.index_size();
+    uint64_t failures = 0;
+    failures += check(decoder, ParseDepth::Header, "header");
+    failures += check(decoder, ParseDepth::MbType, "mb_type");
+    failures += check(decoder, ParseDepth::MotionVector, "mv");
+    failures += check(decoder, ParseDepth::Full, "full");
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -16,6 +16,7 @@
 
 #include <algorithm>
 #include "../src/query/operator.hh"
+#include "../src/decoder/pipeline.hh"
 #include "../src/util/argparser.hh"
 
 using namespace std;
@@ -24,19 +25,75 @@ int main(int argc, char *argv[]) {
     ArgParser parser("Read motion vectors from a media file "
                              "and visualize them");
     parser.add_arg("-i", "input", "media file input");
+    parser.add_arg("-d", "depth", "parse depth: header, mb_type, mv or full",
+                   false);
+    parser.add_arg("-t", "threads", "decode frames in parallel on that many "
+                           "threads, 0 for every core", false);
+    parser.add_arg("-s", "stream", "stream frames in order through a pipeline "
+                           "with that many workers, 0 for every core", false);
+    parser.add_arg("-p", "slices", "parse the slices of a picture on that "
+                           "many threads, 0 for every core", false);
     if (!parser.parse(argc, argv))
         return EXIT_FAILURE;
     auto arg_values = parser.get_args();
 
     string filename = arg_values["input"];
+    string depth = arg_values["depth"];
+    string threads = arg_values["threads"];
+    string stream = arg_values["stream"];
+    string slices = arg_values["slices"];
 
     /* open decoder */
     unique_ptr<h264> decoder = make_unique<h264>(filename);
+    if (depth == "header")
+        decoder->set_parse_depth(ParseDepth::Header);
+    else if (depth == "mb_type")
+        decoder->set_parse_depth(ParseDepth::MbType);
+    else if (depth == "mv")
+        decoder->set_parse_depth(ParseDepth::MotionVector);
+    else if (!depth.empty() && depth != "full")
+        throw runtime_error("unknown parse depth " + depth);
+    if (!slices.empty())
+        decoder->set_slice_threads(static_cast<uint32_t>(stoul(slices)));
 
+    if (!threads.empty()) {
+        /* every thread decodes into its own frame. unlike the loop below,
+         * the first broken frame stops the run */
+        try {
+            decoder->visit_frames(0, decoder->index_size(),
+                                  [](uint64_t, const MvFrame &, bool) {},
+                                  static_cast<uint32_t>(stoul(threads)));
+        } catch (std::runtime_error &ex) {
+            cerr << "unable to decode: " << ex.what() << endl;
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    if (!stream.empty()) {
+        FramePipeline pipeline(*decoder, 0, decoder->index_size(),
+                               static_cast<uint32_t>(stoul(stream)));
+        uint64_t frame_num = 0;
+        MvFrame frame;
+        bool p_frame;
+        while (true) {
+            try {
+                if (!pipeline.next(frame_num, frame, p_frame))
+                    break;
+            } catch (std::runtime_error &ex) {
+                cerr << "unable to decode frame " << frame_num << endl;
+            }
+        }
+        return EXIT_SUCCESS;
+    }
+
+    /* decode into the same frame, so that nothing is allocated per frame */
+    FrameDecoder frame_decoder(*decoder);
+    MvFrame frame;
     for (uint32_t frame_counter = 0; frame_counter < decoder->index_size();
          frame_counter++) {
         try {
-            decoder->load_frame(frame_counter);
+            frame_decoder.decode(frame_counter, frame);
         } catch (std::runtime_error &ex) {
             cerr << "unable to decode frame " << frame_counter << endl;
         }
@@ -0,0 +1,391 @@
+/*  This file is part of h264flow.
+
+    h264flow is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    h264flow is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with h264flow.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* microbenchmark for CAVLC decoding. it encodes random coeff_token,
+ * total_zeros and run_before symbols for every table, then decodes them with
+ * the lookup tables in util.cc and with the linear table searches they
+ * replaced, and checks that both agree. whole chroma DC blocks of 4:2:0 and
+ * 4:2:2 streams are decoded through ResidualBlock::parse as well, which picks
+ * the total_zeros table from the SPS.
+ */
+
+#include <chrono>
+#include <random>
+#include <vector>
+#include "../src/decoder/consts.hh"
+#include "../src/decoder/nal.hh"
+#include "../src/decoder/util.hh"
+#include "../src/util/argparser.hh"
+
+using namespace std;
+
+/* the previous implementations, kept here as the baseline */
+static uint8_t read_coeff_token_linear(int tab, BitReader & br) {
+    int64_t bits_left = br.bits_left();
+    for (int TrailingOnes = 0; TrailingOnes < 4; TrailingOnes++) {
+        for (int TotalCoeff = 0; TotalCoeff < 17; TotalCoeff++) {
+            uint32_t length = coeff_token_length[tab][TrailingOnes][TotalCoeff];
+            uint32_t code   = coeff_token_code[tab][TrailingOnes][TotalCoeff];
+            if ((int)length > (bits_left - 1)) continue;
+            uint64_t next_bits = br.next_bits(length);
+            if (length > 0 && next_bits == code) {
+                br.read_bits(length);
+                return (uint8_t)((TotalCoeff << 2) | (TrailingOnes));
+            }
+        }
+    }
+    throw std::runtime_error("coeff_token not found");
+}
+
+static int code_from_bitstream_2d(BitReader &br, const uint8_t *lentab,
+                                  const uint8_t *codtab, const int tabwidth,
+                                  const int tabheight) {
+    const uint8_t *len = &lentab[0];
+    const uint8_t *cod = &codtab[0];
+    int64_t bits_left = br.bits_left() - 1; /* 1 for stopping bit */
+    for (int j = 0; j < tabheight; j++) {
+        for (int i = 0; i < tabwidth; i++, len++, cod++) {
+            if (*len == 0 || *len > bits_left) continue;
+            if (br.next_bits(*len) == *cod) {
+                br.read_bits(*len);
+                return i;
+            }
+        }
+    }
+    throw std::runtime_error("unable to decode bit stream 2d");
+}
+
+class BitWriter {
+public:
+    void write_bits(uint32_t value, uint32_t bits) {
+        for (uint32_t i = bits; i > 0; i--) {
+            if (bit_pos_ == 0)
+                data_.push_back(0);
+            if ((value >> (i - 1)) & 1)
+                data_.back() |= static_cast<char>(0x80 >> bit_pos_);
+            bit_pos_ = (bit_pos_ + 1) & 7;
+        }
+    }
+    void write_ue(uint32_t value) {
+        uint32_t bits = 0;
+        while ((value + 1) >> (bits + 1))
+            bits++;
+        write_bits(0, bits);
+        write_bits(value + 1, bits + 1);
+    }
+    void write_se(int32_t value) {
+        write_ue(value > 0 ? 2 * value - 1 : -2 * value);
+    }
+    const string & data() const { return data_; }
+private:
+    string data_ {};
+    uint32_t bit_pos_ = 0;
+};
+
+static void print_result(const string &name, double lut, double linear,
+                         uint32_t num) {
+    cout << name << ": lookup table " << lut / num << " ns/symbol, "
+         << "linear search " << linear / num << " ns/symbol, speedup "
+         << linear / lut << "x" << endl;
+}
+
+/* benchmarks one total_zeros/run_before table */
+template <typename Decode>
+static void benchmark_2d(const string &name, const uint8_t *lentab,
+                         const uint8_t *codtab, int tabwidth,
+                         uint32_t num_symbols, mt19937 &gen, Decode decode) {
+    vector<int> values;
+    vector<double> weights;
+    for (int i = 0; i < tabwidth; i++) {
+        if (!lentab[i])
+            continue;
+        values.emplace_back(i);
+        weights.emplace_back(1.0 / (1 << lentab[i]));
+    }
+    discrete_distribution<size_t> dis(weights.begin(), weights.end());
+
+    BitWriter bw;
+    vector<int> expected(num_symbols);
+    for (uint32_t i = 0; i < num_symbols; i++) {
+        int value = values[dis(gen)];
+        bw.write_bits(codtab[value], lentab[value]);
+        expected[i] = value;
+    }
+    bw.write_bits(1, 1); /* stop bit */
+
+    BitReader br_lut(bw.data());
+    BitReader br_linear(bw.data());
+    auto start = chrono::high_resolution_clock::now();
+    for (uint32_t i = 0; i < num_symbols; i++) {
+        if (decode(br_lut) != expected[i])
+            throw runtime_error("lookup table mismatch");
+    }
+    auto mid = chrono::high_resolution_clock::now();
+    for (uint32_t i = 0; i < num_symbols; i++) {
+        if (code_from_bitstream_2d(br_linear, lentab, codtab, tabwidth, 1) !=
+            expected[i])
+            throw runtime_error("linear search mismatch");
+    }
+    auto end = chrono::high_resolution_clock::now();
+    print_result(name, chrono::duration<double, nano>(mid - start).count(),
+                 chrono::duration<double, nano>(end - mid).count(),
+                 num_symbols);
+}
+
+/* a one macroblock SPS and a PPS, for the given chroma_format_idc */
+static string parameter_set(bool sps, uint32_t chroma_format_idc) {
+    BitWriter bw;
+    if (sps) {
+        bw.write_bits(0x67, 8);
+        bw.write_bits(122, 8); /* High 4:2:2 */
+        bw.write_bits(0, 8);
+        bw.write_bits(40, 8);
+        bw.write_ue(0);
+        bw.write_ue(chroma_format_idc);
+        bw.write_ue(0);
+        bw.write_ue(0);
+        bw.write_bits(0, 2);
+        bw.write_ue(0);
+        bw.write_ue(2); /* pic_order_cnt_type */
+        bw.write_ue(1);
+        bw.write_bits(0, 1);
+        bw.write_ue(0);
+        bw.write_ue(0);
+        bw.write_bits(0xC, 4); /* frame_mbs_only, direct_8x8, no cropping,
+                                * no VUI */
+    } else {
+        bw.write_bits(0x68, 8);
+        bw.write_ue(0);
+        bw.write_ue(0);
+        bw.write_bits(0, 2);
+        bw.write_ue(0);
+        bw.write_ue(0);
+        bw.write_ue(0);
+        bw.write_bits(0, 3);
+        bw.write_se(0);
+        bw.write_se(0);
+        bw.write_se(0);
+        bw.write_bits(0x4, 3);
+    }
+    bw.write_bits(1, 1);
+    return bw.data();
+}
+
+/* encodes a chroma DC block after 9.2, the way an encoder would */
+static void write_chroma_dc(BitWriter &bw, const int *coeffs,
+                            int num_coeffs) {
+    int tab = num_coeffs == 4 ? 3 : 4;
+    /* levels from the highest frequency down, and the zeros before each */
+    int levels[8], runs[8];
+    int total = 0, zeros = 0;
+    for (int i = num_coeffs - 1; i >= 0; i--) {
+        if (coeffs[i]) {
+            if (total)
+                runs[total - 1] = zeros;
+            levels[total++] = coeffs[i];
+            zeros = 0;
+        } else if (total) {
+            zeros++;
+        }
+    }
+    int trailing_ones = 0;
+    while (trailing_ones < total && trailing_ones < 3
+           && abs(levels[trailing_ones]) == 1)
+        trailing_ones++;
+    bw.write_bits(coeff_token_code[tab][trailing_ones][total],
+                  coeff_token_length[tab][trailing_ones][total]);
+    if (!total)
+        return;
+
+    int suffix_length = 0;
+    for (int i = 0; i < total; i++) {
+        if (i < trailing_ones) {
+            bw.write_bits(levels[i] < 0, 1);
+            continue;
+        }
+        /* levels are kept small enough to need no escape */
+        int level_code = levels[i] > 0 ? 2 * levels[i] - 2
+                                       : -2 * levels[i] - 1;
+        if (i == trailing_ones && trailing_ones < 3)
+            level_code -= 2;
+        int level_prefix = level_code >> suffix_length;
+        bw.write_bits(1, static_cast<uint32_t>(level_prefix + 1));
+        if (suffix_length)
+            bw.write_bits(static_cast<uint32_t>(level_code),
+                          static_cast<uint32_t>(suffix_length));
+        if (!suffix_length)
+            suffix_length = 1;
+        if (abs(levels[i]) > (3 << (suffix_length - 1)) && suffix_length < 6)
+            suffix_length++;
+    }
+
+    int zeros_left = 0;
+    for (int i = 0; i < total - 1; i++)
+        zeros_left += runs[i];
+    zeros_left += zeros;
+    if (total < num_coeffs) {
+        int chroma = num_coeffs == 4 ? 0 : 1;
+        const uint8_t * codtab = totalzeros_chromadc_codtab[chroma][total - 1];
+        const uint8_t * lentab = totalzeros_chromadc_lentab[chroma][total - 1];
+        bw.write_bits(codtab[zeros_left], lentab[zeros_left]);
+    }
+    for (int i = 0; i < total - 1 && zeros_left > 0; i++) {
+        int vlcnum = min(zeros_left - 1, RUNBEFORE_NUM_M1);
+        bw.write_bits(runbefore_codtab[vlcnum][runs[i]],
+                      runbefore_lentab[vlcnum][runs[i]]);
+        zeros_left -= runs[i];
+    }
+}
+
+/* decodes random chroma DC blocks through ResidualBlock::parse */
+static void benchmark_chroma_dc(uint32_t chroma_format_idc,
+                                uint32_t num_blocks, mt19937 &gen) {
+    const int num_coeffs = chroma_format_idc == 1 ? 4 : 8;
+    SPS_NALUnit sps(parameter_set(true, chroma_format_idc));
+    PPS_NALUnit pps(parameter_set(false, chroma_format_idc));
+    MacroBlockArena arena;
+    arena.resize(1);
+    ParserContext ctx(sps, pps, arena);
+    ctx.mb = &arena[0];
+
+    uniform_int_distribution<int> count_dis(0, num_coeffs);
+    uniform_int_distribution<int> level_dis(-6, 6);
+    BitWriter bw;
+    vector<int> expected(num_blocks * num_coeffs, 0);
+    for (uint32_t i = 0; i < num_blocks; i++) {
+        int * coeffs = &expected[i * num_coeffs];
+        int count = count_dis(gen);
+        for (int j = 0; j < count; j++) {
+            int pos = uniform_int_distribution<int>(0, num_coeffs - 1)(gen);
+            int level = 0;
+            while (!level)
+                level = level_dis(gen);
+            coeffs[pos] = level;
+        }
+        write_chroma_dc(bw, coeffs, num_coeffs);
+    }
+    bw.write_bits(1, 1); /* stop bit */
+
+    BitReader br(bw.data());
+    ResidualBlock block(0, static_cast<uint32_t>(num_coeffs - 1),
+                        static_cast<uint32_t>(num_coeffs),
+                        BlockType::blk_CHROMA_DC_Cb, 0);
+    int coeffs[8];
+    auto start = chrono::high_resolution_clock::now();
+    for (uint32_t i = 0; i < num_blocks; i++) {
+        fill(coeffs, coeffs + 8, 0);
+        block.parse(ctx, coeffs, br);
+        if (!equal(coeffs, coeffs + num_coeffs,
+                   &expected[i * num_coeffs]))
+            throw runtime_error("chroma DC mismatch");
+    }
+    auto end = chrono::high_resolution_clock::now();
+    cout << "residual chroma DC "
+         << (chroma_format_idc == 1 ? "4:2:0" : "4:2:2") << ": "
+         << chrono::duration<double, nano>(end - start).count() / num_blocks
+         << " ns/block" << endl;
+}
+
+int main(int argc, char *argv[]) {
+    ArgParser parser("Benchmark CAVLC symbol decoding");
+    parser.add_arg("-n", "num_tokens", "symbols per table", false);
+    if (!parser.parse(argc, argv))
+        return EXIT_FAILURE;
+    auto arg_values = parser.get_args();
+    uint32_t num_tokens = arg_values["num_tokens"].empty() ?
+                          1000000 : (uint32_t)stoi(arg_values["num_tokens"]);
+
+    /* one representative nC per table in coeff_token_length */
+    const int nCs[5] = {0, 2, 4, -1, -2};
+    mt19937 gen(42);
+
+    for (int tab = 0; tab < 5; tab++) {
+        /* tokens show up with probability 2^-length in an entropy-coded
+         * stream, so short codes dominate */
+        vector<uint8_t> tokens;
+        vector<double> weights;
+        for (uint32_t t1 = 0; t1 < 4; t1++) {
+            for (uint32_t tc = 0; tc < 17; tc++) {
+                uint32_t length = coeff_token_length[tab][t1][tc];
+                if (!length)
+                    continue;
+                tokens.emplace_back(static_cast<uint8_t>(tc << 2 | t1));
+                weights.emplace_back(1.0 / (1 << length));
+            }
+        }
+        discrete_distribution<size_t> dis(weights.begin(), weights.end());
+
+        BitWriter bw;
+        vector<uint8_t> expected(num_tokens);
+        for (uint32_t i = 0; i < num_tokens; i++) {
+            uint8_t token = tokens[dis(gen)];
+            uint32_t t1 = token & 3, tc = token >> 2;
+            bw.write_bits(coeff_token_code[tab][t1][tc],
+                          coeff_token_length[tab][t1][tc]);
+            expected[i] = token;
+        }
+        bw.write_bits(1, 1); /* stop bit */
+
+        BitReader br_lut(bw.data());
+        BitReader br_linear(bw.data());
+        auto start = chrono::high_resolution_clock::now();
+        for (uint32_t i = 0; i < num_tokens; i++) {
+            if (read_coeff_token(nCs[tab], br_lut) != expected[i])
+                throw runtime_error("lookup table mismatch");
+        }
+        auto mid = chrono::high_resolution_clock::now();
+        for (uint32_t i = 0; i < num_tokens; i++) {
+            if (read_coeff_token_linear(tab, br_linear) != expected[i])
+                throw runtime_error("linear search mismatch");
+        }
+        auto end = chrono::high_resolution_clock::now();
+
+        print_result("coeff_token nC = " + to_string(nCs[tab]),
+                     chrono::duration<double, nano>(mid - start).count(),
+                     chrono::duration<double, nano>(end - mid).count(),
+                     num_tokens);
+    }
+
+    for (int vlcnum = 0; vlcnum < TOTRUN_NUM; vlcnum++) {
+        benchmark_2d("total_zeros vlcnum = " + to_string(vlcnum),
+                     totalzeros_lentab[vlcnum], totalzeros_codtab[vlcnum], 16,
+                     num_tokens, gen, [vlcnum](BitReader &br) {
+                    return read_ce_totalzeros(br, vlcnum, 0);
+                });
+    }
+    for (int chroma = 1; chroma <= 2; chroma++) {
+        for (int vlcnum = 0; vlcnum < (chroma == 1 ? 3 : 7); vlcnum++) {
+            benchmark_2d("total_zeros chroma DC " +
+                         string(chroma == 1 ? "4:2:0" : "4:2:2") +
+                         " vlcnum = " + to_string(vlcnum),
+                         totalzeros_chromadc_lentab[chroma - 1][vlcnum],
+                         totalzeros_chromadc_codtab[chroma - 1][vlcnum], 8,
+                         num_tokens, gen, [vlcnum, chroma](BitReader &br) {
+                        return read_ce_totalzeros(br, vlcnum, chroma);
+                    });
+        }
+    }
+    benchmark_chroma_dc(1, num_tokens, gen);
+    benchmark_chroma_dc(2, num_tokens, gen);
+    for (int vlcnum = 0; vlcnum < RUNBEFORE_NUM; vlcnum++) {
+        benchmark_2d("run_before vlcnum = " + to_string(vlcnum),
+                     runbefore_lentab[vlcnum], runbefore_codtab[vlcnum], 16,
+                     num_tokens, gen, [vlcnum](BitReader &br) {
+                    return read_ce_runbefore(br, vlcnum);
+                });
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,106 @@
+/*  This file is part of h264flow.
+
+    h264flow is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    h264flow is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with h264flow.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <chrono>
+#include <cmath>
+#include <thread>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../src/decoder/stream.hh"
+#include "../src/util/argparser.hh"
+
+using namespace std;
+
+static void print_motion(uint64_t frame_num, const MvFrame &frame) {
+    double motion = 0;
+    for (uint32_t y = 0; y < frame.mb_height(); y++) {
+        for (uint32_t x = 0; x < frame.mb_width(); x++) {
+            auto mv = frame.get_mv(x, y);
+            motion += sqrt(mv.mvL0[0] * mv.mvL0[0] + mv.mvL0[1] * mv.mvL0[1]);
+        }
+    }
+    motion /= frame.mb_width() * frame.mb_height();
+    cout << "frame " << frame_num << " motion " << motion << endl;
+}
+
+/* pipes, FIFOs and sockets are read as they come, with no going back */
+static int stream_input(const string &filename) {
+    if (filename == "-")
+        return STDIN_FILENO;
+    struct stat st {};
+    if (stat(filename.c_str(), &st) < 0 || S_ISREG(st.st_mode))
+        return -1;
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw runtime_error("unable to open " + filename);
+    return fd;
+}
+
+int main(int argc, char * argv[]) {
+    ArgParser parser("Follow a raw h264 file as it is being written, or read "
+                     "one from a pipe, and print the motion of every P "
+                     "frame, like tail -f");
+    parser.add_arg("-i", "input", "h264 file input, a FIFO, or - for stdin");
+    parser.add_arg("-n", "interval", "milliseconds between polls of a file",
+                   false);
+    if (!parser.parse(argc, argv))
+        return EXIT_FAILURE;
+    auto arg_values = parser.get_args();
+    string filename = arg_values["input"];
+    string interval = arg_values["interval"];
+    auto poll = chrono::milliseconds(interval.empty() ? 1 : stoi(interval));
+
+    MvFrame frame;
+    int fd = stream_input(filename);
+    if (fd >= 0) {
+        StreamDecoder decoder(fd);
+        uint64_t frame_num = 0;
+        bool p_frame;
+        while (true) {
+            try {
+                if (!decoder.next(frame_num, frame, p_frame))
+                    break;
+            } catch (std::runtime_error &ex) {
+                cerr << "unable to decode frame " << frame_num << endl;
+                continue;
+            }
+            if (p_frame)
+                print_motion(frame_num, frame);
+        }
+        return EXIT_SUCCESS;
+    }
+
+    h264 decoder(filename, false, true);
+    FrameDecoder frame_decoder(decoder);
+    uint64_t frame_num = 0;
+    while (true) {
+        /* takes in what was written since the last poll */
+        uint64_t index_size = decoder.index_size();
+        if (frame_num == index_size) {
+            this_thread::sleep_for(poll);
+            continue;
+        }
+        for (; frame_num < index_size; frame_num++) {
+            try {
+                if (frame_decoder.decode(frame_num, frame))
+                    print_motion(frame_num, frame);
+            } catch (std::runtime_error &ex) {
+                cerr << "unable to decode frame " << frame_num << endl;
+            }
+        }
+    }
+}
@@ -0,0 +1,313 @@
+/*  This file is part of h264flow.
+
+    h264flow is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    h264flow is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with h264flow.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* microbenchmark for luma motion vector prediction. the predictors in mv.hh,
+ * specialised on the partition shape, are checked bit for bit against the
+ * predictor they replaced, which looks the shape up from mb_type at run
+ * time, on random neighbours for every P partition shape and P_Skip. with
+ * -i, the neighbours of every inter macroblock of a clip are checked as
+ * well, and so is the motion vector the decoder stored for it.
+ */
+
+#include <array>
+#include <chrono>
+#include <random>
+#include <vector>
+#include "../src/decoder/consts.hh"
+#include "../src/decoder/h264.hh"
+#include "../src/decoder/mv.hh"
+#include "../src/decoder/util.hh"
+#include "../src/util/argparser.hh"
+
+using namespace std;
+
+/* the previous implementation, kept here as the baseline */
+static void process_luma_mv_reference(uint64_t mb_type, uint32_t mbPartIdx,
+                                      const int (&mvLA)[2],
+                                      const int (&mvLB)[2],
+                                      const int (&mvLC)[2],
+                                      int refIdxLA, int refIdxLB,
+                                      int refIdxLC, int (&mvL)[2]) {
+    uint64_t mbPartWidth = MbPartWidth(mb_type);
+    uint64_t mbPartHeight = MbPartHeight(mb_type);
+    if (mbPartWidth == 16 && mbPartHeight == 8 && mbPartIdx == 0) {
+        mvL[0] = mvLB[0]; mvL[1] = mvLB[1];
+    } else if (mbPartWidth == 16 && mbPartHeight == 8 && mbPartIdx == 1) {
+        mvL[0] = mvLA[0]; mvL[1] = mvLA[1];
+    } else if (mbPartWidth == 8 && mbPartHeight == 16 && mbPartIdx == 0) {
+        mvL[0] = mvLA[0]; mvL[1] = mvLA[1];
+    } else if (mbPartWidth == 8 && mbPartHeight == 16 && mbPartIdx == 1) {
+        mvL[0] = mvLC[0]; mvL[1] = mvLC[1];
+    } else {
+        /* 8.4.1.3.1*/
+        if (refIdxLA != -1 && refIdxLB == -1 && refIdxLC == -1) {
+            mvL[0] = mvLA[0];
+            mvL[1] = mvLA[1];
+        } else if (refIdxLA == -1 && refIdxLB != -1 && refIdxLC == -1) {
+            mvL[0] = mvLB[0];
+            mvL[1] = mvLB[1];
+        } else if (refIdxLA == -1 && refIdxLB == -1 && refIdxLC != -1) {
+            mvL[0] = mvLC[0];
+            mvL[1] = mvLC[1];
+        } else {
+            mvL[0] = std::max(std::min(mvLA[0], mvLB[0]),
+                              std::min(std::max(mvLA[0], mvLB[0]), mvLC[0]));
+            mvL[1] = std::max(std::min(mvLA[1], mvLB[1]),
+                              std::min(std::max(mvLA[1], mvLB[1]), mvLC[1]));
+        }
+    }
+}
+
+/* the P_Skip branch of the previous process_inter_mb */
+static void process_skip_mv_reference(bool available_a, bool available_b,
+                                      const MvNeighbours &n, int (&mvL)[2]) {
+    if (!available_a || !available_b
+        || (n.refIdxLA == 0 && n.mvLA[0] == 0 && n.mvLA[1] == 0)
+        || (n.refIdxLB == 0 && n.mvLB[0] == 0 && n.mvLB[1] == 0)) {
+        mvL[0] = 0;
+        mvL[1] = 0;
+    } else {
+        process_luma_mv_reference(P_Skip, 0, n.mvLA, n.mvLB, n.mvLC,
+                                  n.refIdxLA, n.refIdxLB, n.refIdxLC, mvL);
+    }
+}
+
+/* one prediction: the partition and what the decoder loaded around it */
+struct Input {
+    uint32_t mbPartIdx = 0;
+    bool available_a = false;
+    bool available_b = false;
+    MvNeighbours n {};
+};
+
+static void reference(uint64_t mb_type, const Input &in, int (&mvL)[2]) {
+    if (mb_type == P_Skip)
+        process_skip_mv_reference(in.available_a, in.available_b, in.n, mvL);
+    else
+        process_luma_mv_reference(mb_type, in.mbPartIdx, in.n.mvLA, in.n.mvLB,
+                                  in.n.mvLC, in.n.refIdxLA, in.n.refIdxLB,
+                                  in.n.refIdxLC, mvL);
+}
+
+/* the shape is known outside the loop, as it is inside the handlers */
+template <uint64_t mb_type>
+static void specialised(const Input &in, int (&mvL)[2]) {
+    if constexpr (mb_type == P_Skip)
+        predict_skip_mv(in.available_a, in.available_b, in.n, mvL);
+    else if constexpr (mb_type == P_L0_L0_16x8)
+        predict_luma_mv<16, 8>(in.mbPartIdx, in.n, mvL);
+    else if constexpr (mb_type == P_L0_L0_8x16)
+        predict_luma_mv<8, 16>(in.mbPartIdx, in.n, mvL);
+    else
+        predict_luma_mv<16, 16>(in.mbPartIdx, in.n, mvL);
+}
+
+/* small vectors and zeros are frequent, so that the median sees ties and
+ * the P_Skip zero test is taken */
+static void random_neighbour(mt19937 &gen, bool available, int (&mv)[2],
+                             int &refIdx) {
+    uniform_int_distribution<int> kind(0, 3);
+    uniform_int_distribution<int> small(-4, 4);
+    uniform_int_distribution<int> large(-2048, 2047);
+    uniform_int_distribution<int> ref(-1, 2);
+    if (!available)
+        return;
+    refIdx = ref(gen);
+    if (refIdx == -1)
+        return;
+    for (int & c : mv) {
+        int k = kind(gen);
+        c = k == 0 ? 0 : k == 1 ? small(gen) : large(gen);
+    }
+}
+
+static vector<Input> random_inputs(uint64_t mb_type, uint32_t num,
+                                   mt19937 &gen) {
+    uint32_t num_parts = mb_type == P_Skip ? 1
+                                           : (uint32_t)NumMbPart(mb_type);
+    bernoulli_distribution available(0.8);
+    vector<Input> inputs(num);
+    for (uint32_t i = 0; i < num; i++) {
+        Input & in = inputs[i];
+        in.mbPartIdx = i % num_parts;
+        in.available_a = available(gen);
+        in.available_b = available(gen);
+        random_neighbour(gen, in.available_a, in.n.mvLA, in.n.refIdxLA);
+        random_neighbour(gen, in.available_b, in.n.mvLB, in.n.refIdxLB);
+        random_neighbour(gen, available(gen), in.n.mvLC, in.n.refIdxLC);
+    }
+    return inputs;
+}
+
+/* runs predict over all inputs a few times and returns the fastest pass in
+ * ns, so that the first pass only warms the caches */
+template <typename Predict>
+static double time_passes(const vector<Input> &inputs,
+                          vector<array<int, 2>> &results, Predict predict) {
+    double best = 0;
+    for (int pass = 0; pass < 3; pass++) {
+        auto start = chrono::high_resolution_clock::now();
+        for (uint64_t i = 0; i < inputs.size(); i++) {
+            int mvL[2];
+            predict(inputs[i], mvL);
+            results[i] = {mvL[0], mvL[1]};
+        }
+        auto end = chrono::high_resolution_clock::now();
+        double ns = chrono::duration<double, nano>(end - start).count();
+        if (pass == 0 || ns < best)
+            best = ns;
+    }
+    return best;
+}
+
+/* checks and times one shape. returns the number of mismatches */
+template <uint64_t mb_type>
+static uint64_t benchmark(const string &name, const vector<Input> &inputs) {
+    if (inputs.empty())
+        return 0;
+    vector<array<int, 2>> expected(inputs.size()), actual(inputs.size());
+    double old_ns = time_passes(inputs, expected,
+                                [](const Input &in, int (&mvL)[2]) {
+                                    reference(mb_type, in, mvL);
+                                });
+    double new_ns = time_passes(inputs, actual, specialised<mb_type>);
+
+    uint64_t mismatches = 0;
+    for (uint64_t i = 0; i < inputs.size(); i++)
+        mismatches += expected[i] != actual[i];
+    cout << name << ": " << inputs.size() << " predictions, runtime shape "
+         << old_ns / inputs.size() << " ns, specialised "
+         << new_ns / inputs.size() << " ns, speedup " << old_ns / new_ns
+         << "x, " << mismatches << " mismatches" << endl;
+    return mismatches;
+}
+
+static uint64_t benchmark_all(const string &prefix,
+                              const vector<Input> (&inputs)[4]) {
+    uint64_t mismatches = 0;
+    mismatches += benchmark<P_L0_16x16>(prefix + "16x16", inputs[0]);
+    mismatches += benchmark<P_L0_L0_16x8>(prefix + "16x8", inputs[1]);
+    mismatches += benchmark<P_L0_L0_8x16>(prefix + "8x16", inputs[2]);
+    mismatches += benchmark<P_Skip>(prefix + "P_Skip", inputs[3]);
+    return mismatches;
+}
+
+/* what FrameDecoder loads for list 0, taken from the finished frame. the
+ * neighbours come before the macroblock, so they are final already */
+static void load_neighbour(MacroBlockArena &mbs, int64_t mb_addr,
+                           int64_t mbPartIdx, int (&mvLN)[2], int &refIdxLN) {
+    if (mb_addr == -1)
+        return;
+    const MacroBlock & mb = mbs[mb_addr];
+    if (is_mb_intra(mb.mb_type, mb.slice_type) || !mb.predFlagL[0][mbPartIdx])
+        return;
+    mvLN[0] = mb.mvL[0][mbPartIdx][0][0];
+    mvLN[1] = mb.mvL[0][mbPartIdx][0][1];
+    refIdxLN = mb.refIdxL[0][mbPartIdx];
+}
+
+static int shape_index(uint64_t mb_type) {
+    switch (mb_type) {
+        case P_L0_16x16: return 0;
+        case P_L0_L0_16x8: return 1;
+        case P_L0_L0_8x16: return 2;
+        case P_Skip: return 3;
+        default: return -1;
+    }
+}
+
+/* collects the inputs of every inter partition of the clip, and checks that
+ * the decoder stored the prediction plus mvd. returns the mismatches */
+static uint64_t clip_inputs(const string &filename, vector<Input> (&inputs)[4],
+                            uint64_t &frames) {
+    h264 decoder(filename);
+    decoder.set_parse_depth(ParseDepth::MotionVector);
+    FrameDecoder frame_decoder(decoder);
+    MvFrame frame;
+    uint64_t mismatches = 0;
+    for (uint64_t frame_num = 0; frame_num < decoder.index_size();
+         frame_num++) {
+        try {
+            if (!frame_decoder.decode(frame_num, frame))
+                continue;
+        } catch (exception &) {
+            /* P_8x8 is not implemented */
+            continue;
+        }
+        frames++;
+        MacroBlockArena & mbs = frame_decoder.macroblocks();
+        for (auto & mb : mbs) {
+            int shape = shape_index(mb.mb_type);
+            if (shape < 0 || mb.slice_type % 5 != SliceType::TYPE_P)
+                continue;
+            Input in {};
+            in.available_a = mb.mbAddrA != -1;
+            in.available_b = mb.mbAddrB != -1;
+            load_neighbour(mbs, mb.mbAddrA, mb.mbPartIdxA, in.n.mvLA,
+                           in.n.refIdxLA);
+            load_neighbour(mbs, mb.mbAddrB, mb.mbPartIdxB, in.n.mvLB,
+                           in.n.refIdxLB);
+            load_neighbour(mbs, mb.mbAddrC, mb.mbPartIdxC, in.n.mvLC,
+                           in.n.refIdxLC);
+            uint32_t num_parts = mb.mb_type == P_Skip
+                                 ? 1 : (uint32_t)NumMbPart(mb.mb_type);
+            for (uint32_t i = 0; i < num_parts; i++) {
+                in.mbPartIdx = i;
+                int mvp[2];
+                reference(mb.mb_type, in, mvp);
+                int64_t mvd[2] = {0, 0};
+                if (mb.mb_type != P_Skip) {
+                    mvd[0] = mb.mb_pred.mvd_l0[i][0][0];
+                    mvd[1] = mb.mb_pred.mvd_l0[i][0][1];
+                }
+                if (mb.mvL[0][i][0][0] != mvp[0] + mvd[0]
+                    || mb.mvL[0][i][0][1] != mvp[1] + mvd[1])
+                    mismatches++;
+                inputs[shape].emplace_back(in);
+            }
+        }
+    }
+    return mismatches;
+}
+
+int main(int argc, char *argv[]) {
+    ArgParser parser("Benchmark luma motion vector prediction");
+    parser.add_arg("-n", "num_inputs", "random inputs per shape", false);
+    parser.add_arg("-i", "input", "media file whose neighbours are replayed",
+                   false);
+    if (!parser.parse(argc, argv))
+        return EXIT_FAILURE;
+    auto arg_values = parser.get_args();
+    uint32_t num_inputs = arg_values["num_inputs"].empty() ?
+                          1000000 : (uint32_t)stoi(arg_values["num_inputs"]);
+
+    mt19937 gen(42);
+    vector<Input> inputs[4] = {random_inputs(P_L0_16x16, num_inputs, gen),
+                               random_inputs(P_L0_L0_16x8, num_inputs, gen),
+                               random_inputs(P_L0_L0_8x16, num_inputs, gen),
+                               random_inputs(P_Skip, num_inputs, gen)};
+    uint64_t mismatches = benchmark_all("random ", inputs);
+
+    if (!arg_values["input"].empty()) {
+        vector<Input> clip[4];
+        uint64_t frames = 0;
+        uint64_t stored = clip_inputs(arg_values["input"], clip, frames);
+        cout << frames << " P frames, " << stored
+             << " stored motion vectors differ from the baseline" << endl;
+        mismatches += stored + benchmark_all("clip ", clip);
+    }
+    return mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,75 @@
+/*  This file is part of h264flow.
+
+    h264flow is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    h264flow is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with h264flow.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* decodes every frame of a clip twice, once with runs of P_Skip blocks
+ * predicted in one go and once block by block, and checks that the motion
+ * vector frames are the same. exits with failure otherwise.
+ */
+
+#include <cstdlib>
+#include "../src/decoder/h264.hh"
+#include "../src/util/argparser.hh"
+
+using namespace std;
+
+static bool same_mv(const MotionVector &a, const MotionVector &b) {
+    return a.mvL0[0] == b.mvL0[0] && a.mvL0[1] == b.mvL0[1] && a.x == b.x
+           && a.y == b.y && a.energy == b.energy && a.mb_type == b.mb_type;
+}
+
+int main(int argc, char *argv[]) {
+    ArgParser parser("Check that P_Skip runs decode the same as single "
+                     "macroblocks");
+    parser.add_arg("-i", "input", "media file input");
+    if (!parser.parse(argc, argv))
+        return EXIT_FAILURE;
+    auto arg_values = parser.get_args();
+
+    h264 decoder(arg_values["input"]);
+    FrameDecoder runs(decoder);
+    FrameDecoder blocks(decoder);
+    blocks.set_skip_runs(false);
+    MvFrame run_frame, block_frame;
+    uint64_t p_frames = 0, mismatches = 0, errors = 0;
+    for (uint64_t frame_num = 0; frame_num < decoder.index_size();
+         frame_num++) {
+        bool p_frame;
+        try {
+            p_frame = runs.decode(frame_num, run_frame);
+            blocks.decode(frame_num, block_frame);
+        } catch (exception &) {
+            errors++;
+            continue;
+        }
+        if (!p_frame)
+            continue;
+        p_frames++;
+        auto run_mvs = run_frame.get_mvs();
+        auto block_mvs = block_frame.get_mvs();
+        bool same = run_mvs.size() == block_mvs.size();
+        for (uint64_t i = 0; same && i < run_mvs.size(); i++)
+            same = same_mv(run_mvs[i], block_mvs[i]);
+        if (!same) {
+            mismatches++;
+            cout << "frame " << frame_num << " differs" << endl;
+        }
+    }
+    cout << p_frames << " P frames compared, " << mismatches << " differ";
+    if (errors)
+        cout << ", " << errors << " frames not decoded";
+    cout << endl;
+    return mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
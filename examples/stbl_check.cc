@@ -0,0 +1,245 @@
+/*  This file is part of h264flow.
+
+    h264flow is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    h264flow is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with h264flow.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* checks StscBox::sample_offsets on synthetic stsc, stsz and stco boxes
+ * against a per-sample lookup that finds the chunk of every sample on its
+ * own. the fixtures have several samples per chunk, first_chunk gaps, runs
+ * of zero chunks, chunks without samples, a constant stsz size and co64
+ * offsets. a large table is timed with both afterwards.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+#include "../src/decoder/mp4.hh"
+#include "../src/util/argparser.hh"
+
+using namespace std;
+
+struct Run {
+    uint32_t first_chunk;
+    uint32_t samples_per_chunk;
+};
+
+static void put32(string &s, uint32_t value) {
+    for (int shift = 24; shift >= 0; shift -= 8)
+        s.push_back(static_cast<char>((value >> shift) & 0xFF));
+}
+
+static void put64(string &s, uint64_t value) {
+    put32(s, static_cast<uint32_t>(value >> 32));
+    put32(s, static_cast<uint32_t>(value));
+}
+
+/* a full box with version and flags 0, parsed back the way mp4 files are */
+static shared_ptr<Box> make_box(const string &type, const string &payload) {
+    string data;
+    put32(data, static_cast<uint32_t>(payload.size() + 12));
+    data += type;
+    put32(data, 0);
+    data += payload;
+    BinaryReader br{string_view(data)};
+    return make_shared<Box>(br);
+}
+
+static shared_ptr<Box> make_stsc(const vector<Run> &runs) {
+    string payload;
+    put32(payload, static_cast<uint32_t>(runs.size()));
+    for (const auto &run : runs) {
+        put32(payload, run.first_chunk);
+        put32(payload, run.samples_per_chunk);
+        put32(payload, 1);
+    }
+    return make_box("stsc", payload);
+}
+
+/* sizes are written out unless they are all equal to sample_size */
+static shared_ptr<Box> make_stsz(uint32_t sample_size,
+                                 const vector<uint32_t> &sizes) {
+    string payload;
+    put32(payload, sample_size);
+    put32(payload, static_cast<uint32_t>(sizes.size()));
+    if (!sample_size)
+        for (auto size : sizes)
+            put32(payload, size);
+    return make_box("stsz", payload);
+}
+
+static shared_ptr<Box> make_stco(const vector<uint64_t> &chunks, bool large) {
+    string payload;
+    put32(payload, static_cast<uint32_t>(chunks.size()));
+    for (auto offset : chunks) {
+        if (large)
+            put64(payload, offset);
+        else
+            put32(payload, static_cast<uint32_t>(offset));
+    }
+    return make_box(large ? "co64" : "stco", payload);
+}
+
+/* the per-sample computation: the run of every sample is looked up on its
+ * own, then the sizes of the samples before it in its chunk are added */
+static vector<uint64_t> per_sample_offsets(const vector<Run> &runs,
+                                           const vector<uint32_t> &sizes,
+                                           const vector<uint64_t> &chunks) {
+    /* first sample of every run */
+    vector<uint64_t> run_starts(runs.size());
+    uint64_t count = 0;
+    for (uint64_t i = 0; i < runs.size(); i++) {
+        run_starts[i] = count;
+        uint64_t end_chunk = i + 1 < runs.size() ? runs[i + 1].first_chunk
+                                                 : chunks.size() + 1;
+        count += (end_chunk - runs[i].first_chunk) * runs[i].samples_per_chunk;
+    }
+    vector<uint64_t> offsets(sizes.size());
+    for (uint64_t sample = 0; sample < sizes.size(); sample++) {
+        /* the last run that starts at or before the sample and holds any */
+        uint64_t i = upper_bound(run_starts.begin(), run_starts.end(), sample)
+                     - run_starts.begin() - 1;
+        while (!runs[i].samples_per_chunk)
+            i--;
+        uint64_t in_run = sample - run_starts[i];
+        uint64_t chunk = runs[i].first_chunk
+                         + in_run / runs[i].samples_per_chunk;
+        uint64_t first = sample - in_run % runs[i].samples_per_chunk;
+        uint64_t offset = chunks[chunk - 1];
+        for (uint64_t j = first; j < sample; j++)
+            offset += sizes[j];
+        offsets[sample] = offset;
+    }
+    return offsets;
+}
+
+static bool check(const string &name, const vector<Run> &runs,
+                  uint32_t sample_size, const vector<uint32_t> &sizes,
+                  const vector<uint64_t> &chunks, bool large,
+                  const vector<uint64_t> &expected) {
+    StscBox stsc(make_stsc(runs));
+    StszBox stsz(make_stsz(sample_size, sizes));
+    StcoBox stco(*make_stco(chunks, large));
+    auto offsets = stsc.sample_offsets(stsz, stco);
+    bool ok = offsets == per_sample_offsets(runs, stsz.entries(),
+                                            stco.chunk_offsets());
+    if (!expected.empty())
+        ok &= offsets == expected;
+    cout << name << ": " << offsets.size() << " samples "
+         << (ok ? "ok" : "MISMATCH") << endl;
+    return ok;
+}
+
+/* malformed tables have to be rejected, not read past */
+static bool check_rejected(const string &name, const vector<Run> &runs,
+                           uint64_t num_samples,
+                           const vector<uint64_t> &chunks) {
+    StscBox stsc(make_stsc(runs));
+    StszBox stsz(make_stsz(1, vector<uint32_t>(num_samples, 1)));
+    StcoBox stco(*make_stco(chunks, false));
+    bool ok = false;
+    try {
+        stsc.sample_offsets(stsz, stco);
+    } catch (runtime_error &) {
+        ok = true;
+    }
+    cout << name << ": " << (ok ? "rejected" : "NOT REJECTED") << endl;
+    return ok;
+}
+
+static bool benchmark(uint32_t num_samples, mt19937 &gen) {
+    /* runs of 3, 2 and 1 samples per chunk, each chunk placed somewhere
+     * after the previous one as if other tracks were interleaved */
+    uniform_int_distribution<uint32_t> size_dis(1, 20000);
+    uniform_int_distribution<uint32_t> gap_dis(0, 4096);
+    vector<Run> runs;
+    vector<uint64_t> chunks;
+    vector<uint32_t> sizes(num_samples);
+    uint64_t pos = 48;
+    uint32_t sample = 0;
+    while (sample < num_samples) {
+        uint32_t samples_per_chunk = 3 - chunks.size() % 3;
+        if (runs.empty() || runs.back().samples_per_chunk != samples_per_chunk)
+            runs.push_back({static_cast<uint32_t>(chunks.size() + 1),
+                            samples_per_chunk});
+        pos += gap_dis(gen);
+        chunks.emplace_back(pos);
+        for (uint32_t j = 0; j < samples_per_chunk && sample < num_samples;
+             j++, sample++) {
+            sizes[sample] = size_dis(gen);
+            pos += sizes[sample];
+        }
+    }
+
+    StscBox stsc(make_stsc(runs));
+    StszBox stsz(make_stsz(0, sizes));
+    StcoBox stco(*make_stco(chunks, true));
+
+    auto start = chrono::high_resolution_clock::now();
+    auto offsets = stsc.sample_offsets(stsz, stco);
+    auto mid = chrono::high_resolution_clock::now();
+    auto expected = per_sample_offsets(runs, sizes, chunks);
+    auto end = chrono::high_resolution_clock::now();
+
+    bool ok = offsets == expected;
+    double single = chrono::duration<double, milli>(mid - start).count();
+    double per_sample = chrono::duration<double, milli>(end - mid).count();
+    cout << num_samples << " samples in " << chunks.size() << " chunks, "
+         << runs.size() << " stsc entries: one pass " << single
+         << " ms, per sample " << per_sample << " ms "
+         << (ok ? "ok" : "MISMATCH") << endl;
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    ArgParser parser("Check and benchmark MP4 sample offsets");
+    parser.add_arg("-n", "num_samples", "samples in the large table", false);
+    if (!parser.parse(argc, argv))
+        return EXIT_FAILURE;
+    auto arg_values = parser.get_args();
+    uint32_t num_samples = arg_values["num_samples"].empty() ?
+                           500000 : (uint32_t)stoi(arg_values["num_samples"]);
+
+    bool ok = true;
+    /* chunks 1-2 hold 3 samples, chunk 3 holds 2, the run at chunk 4 is
+     * empty because the next one starts there too, chunk 4 holds 1 and
+     * chunks 5-6 hold 2 */
+    const vector<Run> runs{{1, 3}, {3, 2}, {4, 5}, {4, 1}, {5, 2}};
+    const vector<uint64_t> chunks{100, 1000, 2000, 3000, 4000, 5000};
+    const vector<uint32_t> sizes{10, 20, 30, 40, 50, 60, 70, 80, 90, 100,
+                                 110, 120, 130};
+    ok &= check("varying sizes", runs, 0, sizes, chunks, false,
+                {100, 110, 130, 1000, 1040, 1090, 2000, 2070, 3000, 4000,
+                 4100, 5000, 5120});
+    ok &= check("constant size", runs, 7, vector<uint32_t>(13, 7), chunks,
+                false, {100, 107, 114, 1000, 1007, 1014, 2000, 2007, 3000,
+                        4000, 4007, 5000, 5007});
+    ok &= check("co64", runs, 0, sizes,
+                {1ULL << 33, 1ULL << 34, 1ULL << 35, 1ULL << 36, 1ULL << 37,
+                 1ULL << 38}, true, {});
+    /* the last run ends with the chunks, so trailing chunks may be unused */
+    ok &= check("spare chunks", {{1, 4}}, 0, {1, 2, 3, 4, 5},
+                {10, 20, 30}, false, {10, 11, 13, 16, 20});
+    /* an stsc run may also list chunks that hold no samples */
+    ok &= check("empty chunk", {{1, 2}, {2, 0}, {3, 1}}, 0, {1, 2, 3},
+                {10, 20, 30}, false, {10, 11, 30});
+    ok &= check_rejected("out of order stsc", {{1, 1}, {3, 1}, {2, 1}}, 4,
+                         {0, 10, 20, 30});
+    ok &= check_rejected("first_chunk 0", {{0, 1}}, 2, {0, 10});
+    ok &= check_rejected("too few chunks", {{1, 2}}, 5, {0, 10});
+
+    mt19937 gen(42);
+    ok &= benchmark(num_samples, gen);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -30,10 +30,27 @@ namespace py = pybind11;
 
 
 void init_h264(py::module &m) {
-    py::class_<h264>(m, "h264").def(py::init<const std::string &>())
+    py::enum_<ParseDepth>(m, "ParseDepth")
+        .value("Header", ParseDepth::Header)
+        .value("MbType", ParseDepth::MbType)
+        .value("MotionVector", ParseDepth::MotionVector)
+        .value("Full", ParseDepth::Full);
+    py::class_<h264>(m, "h264")
+        .def(py::init<const std::string &, bool, bool>(), py::arg("filename"),
+             py::arg("sidecar") = false, py::arg("follow") = false)
         .def("load_frame", &h264::load_frame)
+        .def("load_frames", &h264::load_frames, py::arg("begin"),
+             py::arg("end"), py::arg("num_threads") = 0,
+             py::call_guard<py::gil_scoped_release>())
         .def("index_size", &h264::index_size)
-        .def("index_nal", &h264::index_nal);
+        .def("index_nal", &h264::index_nal)
+        .def("set_parse_depth", &h264::set_parse_depth)
+        .def("parse_depth", &h264::parse_depth)
+        .def("set_slice_threads", &h264::set_slice_threads)
+        .def("slice_threads", &h264::slice_threads)
+        .def("time_of", &h264::time_of)
+        .def("frame_at_time", &h264::frame_at_time)
+        .def("sync_samples", &h264::sync_samples);
 }
 
 void init_mv_frame(py::module &m) {
@@ -305,7 +305,7 @@ static const uint8_t codeNum_to_coded_block_pattern_inter[48]= {
 };
 
 
-static const uint8_t coeff_token_length[5][4][17] = {
+static constexpr uint8_t coeff_token_length[5][4][17] = {
     //  0 <= nC < 2
     {{  1,  6,  8,  9, 10, 11, 13, 13, 13, 14, 14, 15, 15, 16, 16, 16, 16 },
      {  0,  2,  6,  8,  9, 10, 11, 13, 13, 14, 14, 15, 15, 15, 16, 16, 16 },
@@ -333,7 +333,7 @@ static const uint8_t coeff_token_length[5][4][17] = {
      {  0,  0,  0,  5,  6,  7,  7, 10, 11,  0,  0,  0,  0,  0,  0,  0,  0 }}
 };
 
-const uint8_t coeff_token_code[5][4][17] = {
+static constexpr uint8_t coeff_token_code[5][4][17] = {
     // 0 <= nC < 2
     {{  1,  5,  7,  7,  7,  7, 15, 11,  8, 15, 11, 15, 11, 15, 11,  7,  4 },
      {  0,  1,  4,  6,  6,  6,  6, 14, 10, 14, 10, 14, 10,  1, 14, 10,  6 },
@@ -361,7 +361,7 @@ const uint8_t coeff_token_code[5][4][17] = {
      {  0,  0,  0,  1,  1,  9,  8,  4,  4,  0,  0,  0,  0,  0,  0,  0,  0 }}
 };
 
-static const uint8_t totalzeros_lentab[TOTRUN_NUM][16] = {
+static constexpr uint8_t totalzeros_lentab[TOTRUN_NUM][16] = {
         {1, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 9},
         {3, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 6, 6, 6, 6},
         {4, 3, 3, 3, 4, 4, 3, 3, 4, 5, 5, 6, 5, 6},
@@ -379,7 +379,7 @@ static const uint8_t totalzeros_lentab[TOTRUN_NUM][16] = {
         {1, 1},
 };
 
-static const uint8_t totalzeros_codtab[TOTRUN_NUM][16] = {
+static constexpr uint8_t totalzeros_codtab[TOTRUN_NUM][16] = {
         {1, 3, 2, 3, 2, 3, 2, 3, 2, 3, 2, 3, 2, 3, 2, 1},
         {7, 6, 5, 4, 3, 5, 4, 3, 2, 3, 2, 3, 2, 1, 0},
         {5, 7, 6, 5, 4, 3, 4, 3, 2, 3, 2, 1, 1, 0},
@@ -397,7 +397,7 @@ static const uint8_t totalzeros_codtab[TOTRUN_NUM][16] = {
         {0, 1},
 };
 
-static const uint8_t totalzeros_chromadc_lentab[2][7][8] = {
+static constexpr uint8_t totalzeros_chromadc_lentab[2][7][8] = {
         { // YUV 420
                 {1, 2, 3, 3},
                 {1, 2, 2},
@@ -414,7 +414,7 @@ static const uint8_t totalzeros_chromadc_lentab[2][7][8] = {
         }
 };
 
-static const uint8_t totalzeros_chromadc_codtab[2][7][8] = {
+static constexpr uint8_t totalzeros_chromadc_codtab[2][7][8] = {
         { // YUV 420
                 {1, 1, 1, 0},
                 {1, 1, 0},
@@ -431,7 +431,7 @@ static const uint8_t totalzeros_chromadc_codtab[2][7][8] = {
         }
 };
 
-static const uint8_t runbefore_lentab[TOTRUN_NUM][16] = {
+static constexpr uint8_t runbefore_lentab[TOTRUN_NUM][16] = {
         {1, 1},
         {1, 2, 2},
         {2, 2, 2, 2},
@@ -441,7 +441,7 @@ static const uint8_t runbefore_lentab[TOTRUN_NUM][16] = {
         {3, 3, 3, 3, 3, 3, 3, 4, 5, 6, 7, 8, 9, 10, 11},
 };
 
-static const uint8_t runbefore_codtab[TOTRUN_NUM][16] = {
+static constexpr uint8_t runbefore_codtab[TOTRUN_NUM][16] = {
         {1, 0},
         {1, 1, 0},
         {3, 2, 1, 0},
@@ -14,8 +14,14 @@
     along with h264flow.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <limits>
 #include <sstream>
+#include <thread>
+#include <atomic>
+#include <mutex>
 #include "h264.hh"
+#include "mv.hh"
 #include "util.hh"
 #include "../util/exception.hh"
 #include "../util/filesystem.hh"
@@ -23,73 +29,175 @@
 using std::shared_ptr;
 using std::runtime_error;
 
-BitStream::BitStream(std::string filename) : stream_(), chunk_offsets_() {
-    if (!file_exists(filename))
-        throw std::runtime_error(filename + " not found");
-    stream_.open(filename);
+/* address space kept for a followed file to grow into */
+static const uint64_t follow_reserve = 1ull << 40;
+/* bytes searched for start codes at a time, so that looking for the next few
+ * NAL units does not walk the rest of the file */
+static const uint64_t scan_step = 1 << 16;
+
+BitStream::BitStream(std::string filename, bool scan, bool follow)
+        : file_(filename, follow ? follow_reserve : 0), chunk_offsets_(),
+          follow_(follow) {
+    if (scan)
+        this->scan();
+}
 
-    /* index chunks */
-    BinaryReader br(stream_);
-    uint32_t tag_size = 3;
-    if (!search_nal(br, true, tag_size))
+void BitStream::scan() {
+    scan_more(std::numeric_limits<uint64_t>::max());
+    if (!in_nal_ && !follow_)
         throw std::runtime_error("no nal unit found");
-    uint64_t pos = br.pos();
-    while (search_nal(br, true, tag_size)) {
-        uint64_t size = br.pos() - pos - tag_size;
-        chunk_offsets_.emplace_back(std::make_pair(pos, size));
-        pos = br.pos();
+}
+
+uint64_t BitStream::scan_more(uint64_t min_chunks) {
+    /* every chunk starts right after a 0x000001 start code and runs up to
+     * the next one */
+    const char * data = file_.data();
+    const uint64_t size = file_.size();
+    uint64_t found = 0;
+    bool at_end = false;
+    while (found < min_chunks && !scanned_) {
+        uint64_t limit = size - search_pos_ > scan_step
+                         ? search_pos_ + scan_step : size;
+        uint64_t start = find_start_code(data, limit, search_pos_);
+        if (start == limit) {
+            /* a start code may straddle the limit, or not be fully written
+             * at the end of the file */
+            if (limit - search_pos_ > 2)
+                search_pos_ = limit - 2;
+            if (limit == size) {
+                at_end = true;
+                break;
+            }
+            continue;
+        }
+        if (in_nal_) {
+            chunk_offsets_.emplace_back(nal_start_, start - nal_start_);
+            found++;
+        }
+        in_nal_ = true;
+        nal_start_ = start + 3;
+        search_pos_ = start + 3;
+    }
+    if (at_end && !follow_) {
+        /* last one */
+        if (in_nal_) {
+            chunk_offsets_.emplace_back(nal_start_, size - nal_start_);
+            found++;
+        }
+        scanned_ = true;
     }
-    /* last one */
-    uint64_t size = br.pos() - pos;
-    chunk_offsets_.emplace_back(std::make_pair(pos, size));
+    return found;
+}
+
+std::string_view BitStream::pending() const {
+    if (!in_nal_ || scanned_)
+        return std::string_view();
+    return file_.span(nal_start_, file_.size() - nal_start_);
 }
 
-std::string BitStream::extract_stream(uint64_t position, uint64_t size) {
-    BinaryReader br(stream_);
-    br.seek(position);
-    return br.read_bytes(size);
+std::string BitStream::extract_stream(uint64_t position,
+                                     uint64_t size) const {
+    return std::string(file_.span(position, size));
 }
 
-h264::h264(const std::string &filename) : chunk_offsets_() {
+/* SampleIndex flags of a sample that starts with nal_unit */
+static uint8_t slice_flags(std::string_view nal_unit) {
+    if (!is_slice(nal_unit))
+        return SampleIndex::no_slice;
+    auto flags = SampleIndex::no_slice;
+    try {
+        /* first_mb_in_slice, then slice_type */
+        BitReader br(nal_unit.substr(1), true);
+        br.read_ue();
+        flags = static_cast<uint8_t>(br.read_ue() % 5);
+    } catch (std::runtime_error &) {
+        /* a broken header counts as no slice */
+        return SampleIndex::no_slice;
+    }
+    if ((static_cast<uint8_t>(nal_unit[0]) & 0x1F) == 5)
+        flags |= SampleIndex::idr_flag;
+    return flags;
+}
+
+h264::h264(const std::string &filename, bool sidecar, bool follow)
+        : index_(), frame_decoder_(), frame_decoder_mutex_(), index_once_(),
+          time_index_(), time_once_(), index_mutex_() {
     auto ext = file_extension(filename);
+    const MappedFile * file;
+    if (follow && ext == ".mp4")
+        throw std::runtime_error("only a raw bitstream can be followed");
+    /* a file that is still growing has no index to keep */
+    if (follow)
+        sidecar = false;
     if (ext == ".mp4") {
         mp4_ = std::make_shared<MP4File>(filename);
-        load_mp4();
+        file = &mp4_->file();
     } else if (ext == ".264" || ext == ".h264") {
-        bit_stream_ = std::make_shared<BitStream>(filename);
-        load_bitstream();
+        /* not scanned yet, the sidecar may have the chunks */
+        bit_stream_ = std::make_shared<BitStream>(filename, false, follow);
+        file = &bit_stream_->file();
     } else {
         throw std::runtime_error("unsupported media file extension");
     }
+    FileKey key;
+    if (sidecar) {
+        key = FileKey::of(filename, *file);
+        if (load_sidecar(filename, key))
+            return;
+    }
+    if (mp4_)
+        load_mp4();
+    else
+        load_bitstream();
+    if (sidecar)
+        save_sidecar(filename, key);
 }
 
-h264::h264(std::shared_ptr<MP4File> mp4) : chunk_offsets_(),
-                                           mp4_(std::move(mp4)) {
+h264::h264(std::shared_ptr<MP4File> mp4)
+        : index_(), mp4_(std::move(mp4)), frame_decoder_(),
+          frame_decoder_mutex_(), index_once_(), time_index_(),
+          time_once_(), index_mutex_() {
     load_mp4();
 }
 
+h264::h264(std::shared_ptr<SPS_NALUnit> sps, std::shared_ptr<PPS_NALUnit> pps)
+        : index_(), sps_(std::move(sps)), pps_(std::move(pps)),
+          frame_decoder_(), frame_decoder_mutex_(), index_once_(),
+          time_index_(), time_once_(), index_mutex_() {
+    if (!sps_ || !pps_)
+        throw std::runtime_error("sps or pps is nullptr");
+}
+
+/* the first track with an avc1 sample entry */
+static std::shared_ptr<Box> video_track(MP4File &mp4) {
+    for (const auto & track : mp4.find_all("trak")) {
+        if (track->find_first("avc1"))
+            return track;
+    }
+    return nullptr;
+}
+
 void h264::load_mp4() {
     if (!mp4_) throw std::runtime_error("mp4 is nullptr");
-    auto tracks = mp4_->find_all("trak");
+    trak_box_ = video_track(*mp4_);
     std::shared_ptr<Box> box = nullptr;
-    for (const auto & track : tracks) {
-        auto b = track->find_first("avc1");
-        if (b) {
-            box = b;
-            trak_box_ = track;
-            break;
-        }
-    }
+    if (trak_box_)
+        box = trak_box_->find_first("avc1");
     shared_ptr<PPS_NALUnit> pps;
     shared_ptr<SPS_NALUnit> sps;
+    index_ = SampleIndex(SampleIndex::Source::MP4);
     if (box) {
         Avc1 avc1 = Avc1(*box.get());
-        auto pps_list = avc1.avcC().pps_units();
-        auto sps_list = avc1.avcC().sps_units();
-        pps = pps_list[0];
-        sps = sps_list[0]; /* use the first one */
-
-        length_size_ = (uint8_t)(avc1.avcC().length_size_minus_one() + 1);
+        AvcC & avcc = avc1.avcC();
+        auto pps_list = avcc.pps_units();
+        auto sps_list = avcc.sps_units();
+        length_size_ = (uint8_t)(avcc.length_size_minus_one() + 1);
+        if (!pps_list.empty() && !sps_list.empty()) {
+            pps = pps_list[0];
+            sps = sps_list[0]; /* use the first one */
+            index_.set_parameter_sets(avcc.sps_data()[0], avcc.pps_data()[0],
+                                      length_size_);
+        }
     }
     if (!pps || !sps)
         throw std::runtime_error("sps or pps not found in mp4 file");
@@ -98,7 +206,18 @@ void h264::load_mp4() {
 }
 
 void h264::index_nal() {
-    if (bit_stream_) return;
+    if (bit_stream_) {
+        std::unique_lock<std::shared_mutex> lock(index_mutex_);
+        locate(std::numeric_limits<uint64_t>::max());
+        return;
+    }
+    /* the sample table does not change, so once is enough */
+    std::call_once(index_once_, &h264::build_index, this);
+}
+
+void h264::build_index() {
+    /* nothing to index without a file */
+    if (!trak_box_) return;
     auto box = trak_box_->find_first("stco");
     if (!box) box = trak_box_->find_first("co64");
     if (!box) throw std::runtime_error("stco/co64 not found");
@@ -110,53 +229,180 @@ void h264::index_nal() {
     if (!box) throw std::runtime_error("stsz not found");
     StszBox stsz = StszBox(box);
 
-    auto sample_entries = stsz.entries();
-    chunk_offsets_ = std::vector<uint64_t>(sample_entries.size());
-    uint32_t chunk_count = 0;
-    uint32_t stsc_index = 0;
-    uint32_t samples_per_chunk = stsc.entries()[stsc_index].samples_per_chunk;
-    uint64_t in_chunk_offset = 0;
-    for (uint32_t i = 0; i < sample_entries.size(); i++) {
-        uint32_t sample_size = sample_entries[i];
-        uint64_t result = stco.chunk_offsets()[chunk_count] + in_chunk_offset;
-        chunk_offsets_[i] = result;
-        in_chunk_offset += sample_size;
-
-        if (!samples_per_chunk) {
-            /* switch chunk */
-            chunk_count++;
-            in_chunk_offset = 0;
-            if (stsc_index + 1 < stsc.entries().size()
-                && stsc.entries()[stsc_index + 1].first_chunk - 1
-                   == chunk_count) {
-                stsc_index++;
-                samples_per_chunk =
-                        stsc.entries()[stsc_index].samples_per_chunk;
+    auto offsets = stsc.sample_offsets(stsz, stco);
+    index_.set_samples(std::move(offsets), stsz.entries());
+}
+
+const TimeIndex & h264::time_index() {
+    if (!mp4_)
+        throw std::runtime_error("only an MP4 file has timestamps");
+    std::call_once(time_once_, &h264::build_time_index, this);
+    return time_index_;
+}
+
+void h264::build_time_index() {
+    /* not looked up when the index came from a sidecar */
+    auto track = trak_box_ ? trak_box_ : video_track(*mp4_);
+    if (!track) throw std::runtime_error("video track not found");
+    auto box = track->find_first("mdhd");
+    if (!box) throw std::runtime_error("mdhd not found");
+    MdhdBox mdhd = MdhdBox(box);
+    box = track->find_first("stts");
+    if (!box) throw std::runtime_error("stts not found");
+    SttsBox stts = SttsBox(box);
+
+    std::vector<TimeIndex::Run> durations, offsets;
+    durations.reserve(stts.entries().size());
+    for (const auto & entry : stts.entries())
+        durations.push_back({entry.sample_count, entry.sample_delta});
+    box = track->find_first("ctts");
+    if (box) {
+        CttsBox ctts = CttsBox(box);
+        offsets.reserve(ctts.entries().size());
+        for (const auto & entry : ctts.entries())
+            offsets.push_back({entry.sample_count, entry.sample_offset});
+    }
+    std::vector<uint32_t> sync_samples;
+    box = track->find_first("stss");
+    if (box)
+        sync_samples = StssBox(box).entries();
+    /* the presentation starts at the media time of the first edit that is
+     * not empty, typically past the delay B frames add */
+    int64_t start = 0;
+    box = track->find_first("elst");
+    if (box) {
+        ElstBox elst = ElstBox(box);
+        for (const auto & edit : elst.entries()) {
+            if (edit.media_time >= 0) {
+                start = edit.media_time;
+                break;
             }
         }
     }
+    time_index_ = TimeIndex(mdhd.timescale(), durations, offsets,
+                            sync_samples, start);
+}
+
+double h264::time_of(uint64_t frame_num) {
+    return time_index().time_of(frame_num);
+}
+
+uint64_t h264::frame_at_time(double seconds) {
+    return time_index().sample_at_time(seconds);
+}
+
+const std::vector<uint32_t> & h264::sync_samples() {
+    return time_index().sync_samples();
 }
 
 h264::h264(std::shared_ptr<BitStream> stream)
-        : chunk_offsets_(), bit_stream_(std::move(stream)) {
+        : index_(), bit_stream_(std::move(stream)), frame_decoder_(),
+          frame_decoder_mutex_(), index_once_(), time_index_(),
+          time_once_(), index_mutex_() {
     load_bitstream();
 }
 
 void h264::load_bitstream() {
-    for (const auto & pair : bit_stream_->chunk_offsets()) {
-        /* linear search. however, since most sps and pps are at the very
-         * beginning, this is actually pretty fast
-         */
-        std::string data = bit_stream_->extract_stream(pair.first, pair.second);
-        NALUnit unit(std::move(data));
-        if (unit.nal_unit_type() == 7) {
-            sps_ = std::make_shared<SPS_NALUnit>(unit);
-        } else if (unit.nal_unit_type() == 8) {
-            pps_ = std::make_shared<PPS_NALUnit>(unit);
+    index_ = SampleIndex(SampleIndex::Source::AnnexB);
+    /* the parameter sets come first, so only the head of the stream is
+     * scanned here */
+    while ((!sps_ || !pps_) && locate_next()) {}
+    if (!sps_ || !pps_)
+        throw std::runtime_error("sps or pps not found in bitstream");
+    std::string_view sps, pps;
+    for (uint64_t i = 0; i < index_.size(); i++) {
+        std::string_view data = bit_stream_->extract_span(
+                index_.offset(i), index_.sample_size(i));
+        uint8_t nal_unit_type = data.empty()
+                                ? 0 : static_cast<uint8_t>(data[0]) & 0x1F;
+        if (nal_unit_type == 7 && sps.empty())
+            sps = data;
+        else if (nal_unit_type == 8 && pps.empty())
+            pps = data;
+    }
+    index_.set_parameter_sets(sps, pps, length_size_);
+}
+
+/* NAL units found per scan of the bitstream */
+static const uint64_t locate_batch = 64;
+
+bool h264::locate_next() {
+    if (indexed_)
+        return false;
+    const auto & chunks = bit_stream_->chunk_offsets();
+    if (index_.size() == chunks.size()
+        && !bit_stream_->scan_more(locate_batch)
+        && !(bit_stream_->refresh() && bit_stream_->scan_more(locate_batch))) {
+        if (bit_stream_->scanned()) {
+            indexed_ = true;
+            ready_ = index_.size();
+        } else if (ends_picture(bit_stream_->pending())) {
+            /* the last picture has ended, even though the NAL unit after it
+             * has not */
+            ready_ = index_.size();
         }
-        if (sps_ && pps_)
-            return;
+        return false;
+    }
+    const auto & chunk = chunks[index_.size()];
+    std::string_view data = bit_stream_->extract_span(chunk.first,
+                                                      chunk.second);
+    uint64_t sample = index_.size();
+    index_.append(chunk.first, static_cast<uint32_t>(chunk.second),
+                  slice_flags(data));
+    if (!is_slice(data)) {
+        ready_ = sample + 1;
+        /* the first ones are used. only parameter sets are copied, as they
+         * outlive the stream */
+        uint8_t nal_unit_type = data.empty()
+                                ? 0 : static_cast<uint8_t>(data[0]) & 0x1F;
+        if (nal_unit_type == 7 && !sps_)
+            sps_ = std::make_shared<SPS_NALUnit>(std::string(data));
+        else if (nal_unit_type == 8 && !pps_)
+            pps_ = std::make_shared<PPS_NALUnit>(std::string(data));
+    } else if (ends_picture(data)) {
+        ready_ = sample;
+    }
+    return true;
+}
+
+void h264::locate(uint64_t frame_num) {
+    while (ready_ <= frame_num && locate_next()) {}
+}
+
+bool h264::load_sidecar(const std::string &filename, const FileKey &key) {
+    auto index = SampleIndex::load(filename, key);
+    auto source = mp4_ ? SampleIndex::Source::MP4
+                       : SampleIndex::Source::AnnexB;
+    if (!index || index->source() != source || !index->has_flags()
+        || index->sps().empty() || index->pps().empty())
+        return false;
+    sps_ = std::make_shared<SPS_NALUnit>(std::string(index->sps()));
+    pps_ = std::make_shared<PPS_NALUnit>(std::string(index->pps()));
+    length_size_ = index->length_size();
+    index_ = std::move(*index);
+    ready_ = index_.size();
+    indexed_ = true;
+    /* the index is complete, there is no sample table to read */
+    std::call_once(index_once_, []() {});
+    return true;
+}
+
+void h264::save_sidecar(const std::string &filename, const FileKey &key) {
+    index_nal();
+    if (!index_.has_flags()) {
+        /* the one pass over the samples that a sidecar saves later on */
+        std::vector<uint8_t> flags(index_.size());
+        std::vector<std::string_view> slices;
+        for (uint64_t i = 0; i < index_.size(); i++) {
+            extract_slices(i, slices);
+            flags[i] = slices.empty() ? SampleIndex::no_slice
+                                      : slice_flags(slices[0]);
+        }
+        index_.set_flags(std::move(flags));
     }
+    /* if the directory is read-only, the next open simply builds the index
+     * again */
+    index_.save(filename, key);
 }
 
 uint64_t h264::read_nal_size(BinaryReader &br) {
@@ -178,313 +424,569 @@ uint64_t h264::read_nal_size(BinaryReader &br) {
 }
 
 uint64_t h264::index_size() {
+    index_nal();
     if (bit_stream_) {
-        return bit_stream_->chunk_offsets().size();
-    } else {
-        if (chunk_offsets_.empty())
-            index_nal();
-        return chunk_offsets_.size();
+        std::shared_lock<std::shared_mutex> lock(index_mutex_);
+        return ready_;
     }
+    return index_.size();
 }
 
+void h264::bitstream_slices(uint64_t frame_num,
+                            std::vector<std::string_view> &slices) {
+    for (uint64_t i = frame_num; i < index_.size(); i++) {
+        std::string_view nal_unit = bit_stream_->extract_span(
+                index_.offset(i), index_.sample_size(i));
+        if (!is_slice(nal_unit))
+            break;
+        /* a picture starts with its first macroblock and goes on until
+         * the next one does */
+        bool first = first_mb_in_slice(nal_unit) == 0;
+        if (first != (i == frame_num))
+            break;
+        slices.emplace_back(nal_unit);
+    }
+}
 
-std::unique_ptr<ParserContext> h264::get_ctx(uint64_t frame_num) {
-    std::string nal_data;
+void h264::extract_slices(uint64_t frame_num,
+                          std::vector<std::string_view> &slices) {
+    slices.clear();
     if (bit_stream_) {
-        uint64_t pos, size;
-        std::tie(pos, size) = bit_stream_->chunk_offsets()[frame_num];
-        nal_data = bit_stream_->extract_stream(pos, size);
-    } else {
-        if (chunk_offsets_.empty())
-            index_nal();
-        uint64_t offset = chunk_offsets_[frame_num];
-        std::string size_string = mp4_->extract_stream(offset, length_size_);
-        std::istringstream stream(size_string);
-        BinaryReader br(stream);
+        {
+            std::shared_lock<std::shared_mutex> lock(index_mutex_);
+            if (frame_num < ready_) {
+                bitstream_slices(frame_num, slices);
+                return;
+            }
+        }
+        /* not located yet */
+        std::unique_lock<std::shared_mutex> lock(index_mutex_);
+        locate(frame_num);
+        if (frame_num >= ready_)
+            throw std::runtime_error("frame_num out of range");
+        bitstream_slices(frame_num, slices);
+        return;
+    }
+    index_nal();
+    if (frame_num >= index_.size())
+        throw std::runtime_error("frame_num out of range");
+    uint64_t offset = index_.offset(frame_num);
+    uint64_t end = offset + index_.sample_size(frame_num);
+    while (offset + length_size_ <= end) {
+        BinaryReader br(mp4_->extract_span(offset, length_size_));
         uint64_t unit_size = read_nal_size(br);
-        nal_data = mp4_->extract_stream(offset + length_size_,
-                                        unit_size);
+        offset += length_size_;
+        if (unit_size > end - offset)
+            throw std::runtime_error("nal unit exceeds the sample");
+        std::string_view nal_unit = mp4_->extract_span(offset, unit_size);
+        if (is_slice(nal_unit))
+            slices.emplace_back(nal_unit);
+        offset += unit_size;
+    }
+}
+
+uint8_t h264::sample_flags(uint64_t frame_num) {
+    if (bit_stream_) {
+        /* a raw bitstream always has them */
+        std::unique_lock<std::shared_mutex> lock(index_mutex_);
+        locate(frame_num);
+        if (frame_num >= ready_)
+            throw std::runtime_error("frame_num out of range");
+        return index_.flags(frame_num);
     }
-    std::unique_ptr<ParserContext> ctx =
-            std::make_unique<ParserContext>(sps_, pps_);
-    /* test the slice type */
-    if (!is_p_slice(static_cast<uint8_t>(nal_data[0]),
-                    static_cast<uint8_t>(nal_data[1])))
-        return nullptr;
-    Slice_NALUnit slice(std::move(nal_data));
-    /* TODO: fix this, although this is fine in memory management */
-    slice.parse(*ctx);
-    return ctx;
+    index_nal();
+    if (frame_num >= index_.size())
+        throw std::runtime_error("frame_num out of range");
+    if (index_.has_flags())
+        return index_.flags(frame_num);
+    std::vector<std::string_view> slices;
+    extract_slices(frame_num, slices);
+    return slices.empty() ? SampleIndex::no_slice : slice_flags(slices[0]);
+}
+
+int h264::slice_type(uint64_t frame_num) {
+    uint8_t type = sample_flags(frame_num) & SampleIndex::slice_type_mask;
+    return type == SampleIndex::no_slice ? -1 : type;
+}
+
+bool h264::is_idr(uint64_t frame_num) {
+    return sample_flags(frame_num) & SampleIndex::idr_flag;
 }
 
 std::pair<MvFrame, bool> h264::load_frame(uint64_t frame_num) {
-    auto ctx = get_ctx(frame_num);
-    if (!ctx) {
-        ParserContext c(sps_, pps_);
-        return std::make_pair(MvFrame(c.Width(), c.Height(),
-                                      c.Width() / MACROBLOCK_SIZE,
-                                      c.Height() / MACROBLOCK_SIZE, false),
-                              false);
+    MvFrame frame;
+    bool p_frame;
+    std::unique_lock<std::mutex> lock(frame_decoder_mutex_, std::try_to_lock);
+    if (lock.owns_lock()) {
+        if (!frame_decoder_)
+            frame_decoder_ = std::make_unique<FrameDecoder>(*this);
+        p_frame = frame_decoder_->decode(frame_num, frame);
+    } else {
+        /* another thread is using the shared one */
+        FrameDecoder frame_decoder(*this);
+        p_frame = frame_decoder.decode(frame_num, frame);
+    }
+    return std::make_pair(frame, p_frame);
+}
+
+/* calls decode(frame_decoder, frame, frame_num) for every frame in
+ * [begin, end) on num_threads threads, the calling one included. every
+ * thread has its own FrameDecoder and scratch MvFrame, and takes the next
+ * frame off a shared counter, so threads that drew cheap frames simply take
+ * more of them. after an error the remaining frames are dropped, and the
+ * error is rethrown once all threads are done */
+typedef std::function<void(FrameDecoder &, MvFrame &, uint64_t)> DecodeTask;
+
+static void decode_parallel(h264 &decoder, uint64_t begin, uint64_t end,
+                            uint32_t num_threads, const DecodeTask &decode) {
+    /* also builds the index, which is read-only from here on */
+    if (begin > end || end > decoder.index_size())
+        throw std::runtime_error("frame range out of bounds");
+    if (num_threads == 0)
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    if (num_threads > end - begin)
+        num_threads = static_cast<uint32_t>(std::max<uint64_t>(1, end - begin));
+
+    std::atomic<uint64_t> next_frame(begin);
+    std::mutex error_mutex;
+    std::exception_ptr error = nullptr;
+    auto worker = [&]() {
+        try {
+            FrameDecoder frame_decoder(decoder);
+            MvFrame frame;
+            uint64_t frame_num;
+            while ((frame_num = next_frame.fetch_add(1)) < end)
+                decode(frame_decoder, frame, frame_num);
+        } catch (...) {
+            std::lock_guard<std::mutex> guard(error_mutex);
+            if (!error)
+                error = std::current_exception();
+            next_frame = end;
+        }
+    };
+    std::vector<std::thread> threads;
+    try {
+        for (uint32_t i = 1; i < num_threads; i++)
+            threads.emplace_back(worker);
+    } catch (...) {
+        /* joinable threads must not be destroyed. the ones started stop
+         * after their current frame */
+        next_frame = end;
+        for (auto & thread : threads)
+            thread.join();
+        throw;
     }
+    worker();
+    for (auto & thread : threads)
+        thread.join();
+    if (error)
+        std::rethrow_exception(error);
+}
+
+std::vector<std::pair<MvFrame, bool>> h264::load_frames(uint64_t begin,
+                                                        uint64_t end,
+                                                        uint32_t num_threads) {
+    std::vector<std::pair<MvFrame, bool>> result(end > begin ? end - begin : 0);
+    decode_parallel(*this, begin, end, num_threads,
+                    [&](FrameDecoder &frame_decoder, MvFrame &,
+                        uint64_t frame_num) {
+        auto & entry = result[frame_num - begin];
+        entry.second = frame_decoder.decode(frame_num, entry.first);
+    });
+    return result;
+}
 
-    process_inter_mb(*ctx);
-    return std::make_pair(MvFrame(*ctx), true);
+void h264::visit_frames(uint64_t begin, uint64_t end,
+                        const FrameVisitor &visitor, uint32_t num_threads) {
+    decode_parallel(*this, begin, end, num_threads,
+                    [&](FrameDecoder &frame_decoder, MvFrame &frame,
+                        uint64_t frame_num) {
+        bool p_frame = frame_decoder.decode(frame_num, frame);
+        visitor(frame_num, frame, p_frame);
+    });
 }
 
 std::vector<std::shared_ptr<MacroBlock>> h264::get_raw_mb(uint64_t frame_num) {
-    auto ctx = get_ctx(frame_num);
-    if (ctx)
-        return ctx->mb_array;
-    else
-        return std::vector<std::shared_ptr<MacroBlock>>();
+    /* the blocks outlive the call, so they cannot come from the recycled
+     * decoder. each one shares ownership of a private decoder instead, which
+     * also keeps the coefficients */
+    auto decoder = std::make_shared<FrameDecoder>(*this, true);
+    std::vector<std::shared_ptr<MacroBlock>> result;
+    if (decoder->parse(frame_num) && parse_depth_ != ParseDepth::Header) {
+        for (auto & mb : decoder->macroblocks())
+            result.emplace_back(std::shared_ptr<MacroBlock>(decoder, &mb));
+    }
+    return result;
 }
 
-/* adapted from py264 */
-void h264::process_inter_mb(ParserContext &ctx) {
-    /* only to work with 4:2:0 */
-    if (ctx.sps->chroma_array_type() != 1)
-        throw NotImplemented("chroma_array_type != 1");
-    /* Section 8.4 */
-    for (const auto & mb : ctx.mb_array) {
-        ctx.mb = mb;
-        uint64_t mb_type = mb->mb_type;
-        uint64_t slice_type = ctx.header()->slice_type;
-        uint64_t numMbPart = NumMbPart(mb_type);
-        /* baseline profile won't have B slice */
-        if (mb->slice_type == SliceType::TYPE_B)
-            throw NotImplemented("B Slice");
-        for (uint32_t mbPartIdx = 0; mbPartIdx < numMbPart; mbPartIdx++) {
-            uint64_t numSubMbParts = 0;
-            if (mb_type != P_8x8 && mb_type != P_8x8ref0) {
-                numSubMbParts = 1;
-            } else if (mb_type == P_8x8 || mb_type == P_8x8ref0) {
-                throw NotImplemented("numSubMbParts");
-            } else {
-                throw NotImplemented("numSubMbParts = 4");
-            }
-            // uint64_t partWidthC = partWidth / ctx.SubWidthC();
-            // uint64_t partHeightC = partHeight / ctx.SubHeightC();
-
-            // uint64_t MvCnt = 0;
-
-            int refIdxL0 = -1;
-            int refIdxL1 = -1;
-
-            for (uint32_t subMbPartIdx = 0; subMbPartIdx < numSubMbParts;
-                 subMbPartIdx++) {
-                bool predFlagL0 = false;
-                bool predFlagL1 = false;
-                int mvL0[2] = {0, 0};
-                int mvL1[2] = {0, 0};
-                /* section 8.4.1.1 */
-                if (mb_type == P_Skip) {
-                    int refIdxLA = -1;
-                    int refIdxLB = -1;
-                    int refIdxLC = -1;
-                    int mvL0A[2];
-                    int mvL0B[2];
-                    int mvL0C[2];
-                    get_mv_neighbor_part(ctx, 0, mvL0A, mvL0B, mvL0C, refIdxLA,
-                                         refIdxLB, refIdxLC);
-                    if (mb->mbAddrA == -1 || mb->mbAddrB == -1
-                        || (refIdxLA == 0 && mvL0A[0] == 0 && mvL0A[1] == 0)
-                        || (refIdxLB == 0 && mvL0B[0] == 0 && mvL0B[1] == 0)) {
-                        mvL0[0] = 0;
-                        mvL0[1] = 0;
-                    } else {
-                        process_luma_mv(ctx, mbPartIdx, mvL0A, mvL0B, mvL0C,
-                                        refIdxLA, refIdxLB, refIdxLC, mvL0);
-                    }
-                    refIdxL0 = 0;
-                    predFlagL0 = true;
-                    predFlagL1 = false;
-                } else {
-                    /* no B slice */
-                    /* num mb part == 1 */
-                    auto mb_pred_mode = MbPartPredMode(mb_type, mbPartIdx,
-                                                       slice_type);
-                    if (mb_pred_mode == Pred_L0 || mb_pred_mode == BiPred) {
-                        refIdxL0 = static_cast<int>(
-                                mb->mb_pred->ref_idx_l0[mbPartIdx]);
-                        predFlagL0 = true;
-                    } else {
-                        refIdxL0 = -1;
-                        predFlagL0 = false;
-                    }
-
-                    if (mb_pred_mode == Pred_L1 || mb_pred_mode == BiPred) {
-                        refIdxL1 = static_cast<int>(
-                                mb->mb_pred->ref_idx_l1[mbPartIdx]);
-                        predFlagL1 = true;
-                    } else {
-                        refIdxL1 = -1;
-                        predFlagL1 = false;
-                    }
-
-                    if (predFlagL0) {
-                        int mvpL0[2] = {0, 0};
-                        process_luma_mv(ctx, mbPartIdx, 0, mvpL0);
-                        mvL0[0] = static_cast<int>(
-                                mvpL0[0] + mb->mb_pred->mvd_l0[mbPartIdx]
-                                           [subMbPartIdx][0]);
-                        mvL0[1] =  static_cast<int>(
-                                mvpL0[1] + mb->mb_pred->mvd_l0[mbPartIdx]
-                                           [subMbPartIdx][1]);
-                    }
-
-                    if (predFlagL1) {
-                        int mvpL1[2] = {0, 0};
-                        process_luma_mv(ctx, mbPartIdx, 1, mvpL1);
-                        mvL1[0] = static_cast<int>(
-                                mvpL1[0] + mb->mb_pred->mvd_l1[mbPartIdx]
-                                           [subMbPartIdx][0]);
-                        mvL1[1] = static_cast<int>(
-                                mvpL1[1] + mb->mb_pred->mvd_l1[mbPartIdx]
-                                           [subMbPartIdx][1]);
-                    }
-                }
-                mb->mvL[0][mbPartIdx][subMbPartIdx][0] = mvL0[0];
-                mb->mvL[0][mbPartIdx][subMbPartIdx][1] = mvL0[1];
-                mb->mvL[1][mbPartIdx][subMbPartIdx][0] = mvL1[1];
-                mb->mvL[1][mbPartIdx][subMbPartIdx][1] = mvL1[1];
-                mb->refIdxL[0][mbPartIdx] = refIdxL0;
-                mb->refIdxL[1][mbPartIdx] = refIdxL1;
-                mb->predFlagL[0][mbPartIdx] = predFlagL0;
-                mb->predFlagL[1][mbPartIdx] = predFlagL1;
-            }
+FrameDecoder::FrameDecoder(h264 &decoder, bool keep_coefficients)
+        : decoder_(decoder), arena_(keep_coefficients), parsers_(),
+          slices_() {
+    parsers_.emplace_back(std::make_unique<SliceParser>(decoder, arena_));
+}
+
+bool FrameDecoder::parse(uint64_t frame_num) {
+    decoder_.extract_slices(frame_num, slices_);
+    return parse(slices_, nullptr);
+}
+
+bool FrameDecoder::parse(const std::vector<std::string_view> &slices,
+                         MacroBlockListener *listener) {
+    /* test the slice type before parsing anything */
+    if (slices.empty() || !is_p_slice(slices[0]))
+        return false;
+    while (parsers_.size() < slices.size())
+        parsers_.emplace_back(std::make_unique<SliceParser>(decoder_, arena_));
+    /* the slices parse straight out of the mapped file. emulation prevention
+     * bytes are skipped by the BitReader, so there is no unescape pass.
+     * every header resizes the shared arena, so they go one at a time */
+    for (uint64_t i = 0; i < slices.size(); i++) {
+        SliceParser & parser = *parsers_[i];
+        parser.ctx.depth = decoder_.parse_depth_;
+        parser.ctx.listener = listener;
+        parser.slice.reset(slices[i], false);
+        parser.slice.parse_header(parser.ctx);
+        if (parser.ctx.PicSizeInMbs() != parsers_[0]->ctx.PicSizeInMbs())
+            throw std::runtime_error("slices of different picture sizes");
+    }
+    if (decoder_.parse_depth_ == ParseDepth::Header)
+        return true;
+
+    /* the slices may come in any order. in the order of the picture, each
+     * one ends where the next one starts, so that no macroblock is written
+     * by two slices, which would race when they are parsed in parallel */
+    auto end = parsers_.begin() + static_cast<int64_t>(slices.size());
+    std::sort(parsers_.begin(), end,
+              [](const std::unique_ptr<SliceParser> &a,
+                 const std::unique_ptr<SliceParser> &b) {
+        return a->ctx.first_mb_addr < b->ctx.first_mb_addr;
+    });
+    for (uint64_t i = 0; i < slices.size(); i++) {
+        ParserContext & ctx = parsers_[i]->ctx;
+        if (i + 1 < slices.size()) {
+            ctx.limit_mb_addr = parsers_[i + 1]->ctx.first_mb_addr;
+            if (ctx.limit_mb_addr == ctx.first_mb_addr)
+                throw std::runtime_error("slices overlap");
         }
+        if (ctx.first_mb_addr >= ctx.limit_mb_addr)
+            throw std::runtime_error("mb_addr out of range");
+    }
+    parse_slice_data(slices.size());
+
+    /* the slices have to cover the picture, each macroblock once */
+    uint64_t mb_addr = 0;
+    for (uint64_t i = 0; i < slices.size(); i++) {
+        if (parsers_[i]->ctx.first_mb_addr != mb_addr)
+            throw std::runtime_error("slice data parsing unfinished");
+        mb_addr = parsers_[i]->ctx.end_mb_addr;
     }
+    if (mb_addr != arena_.size())
+        throw std::runtime_error("slice data parsing unfinished");
+    return true;
 }
 
-void h264::get_mv_neighbor_part(ParserContext &ctx, int listSuffixFlag,
-                                int (&mvLA)[2], int (&mvLB)[2], int (&mvLC)[2],
-                                int &refIdxLA, int &refIdxLB, int &refIdxLC) {
-    int64_t mbAddrA = ctx.mb->mbAddrA;
-    int64_t mbAddrB = ctx.mb->mbAddrB;
-    int64_t mbAddrC = ctx.mb->mbAddrC;
+void FrameDecoder::parse_slice_data(uint64_t num_slices) {
+    uint32_t num_threads = decoder_.slice_threads_;
+    if (num_threads == 0)
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    if (num_threads > num_slices)
+        num_threads = static_cast<uint32_t>(num_slices);
+    if (num_threads <= 1) {
+        for (uint64_t i = 0; i < num_slices; i++)
+            parsers_[i]->slice.parse_data(parsers_[i]->ctx);
+        return;
+    }
 
-    auto mbPartIdxA = ctx.mb->mbPartIdxA;
-    auto mbPartIdxB = ctx.mb->mbPartIdxB;
-    auto mbPartIdxC = ctx.mb->mbPartIdxC;
+    /* every slice only writes its own macroblocks and the motion vectors of
+     * its own part of the frame. as in decode_parallel, the threads take the
+     * next slice off a shared counter and the first error is rethrown */
+    std::atomic<uint64_t> next_slice(0);
+    std::mutex error_mutex;
+    std::exception_ptr error = nullptr;
+    auto worker = [&]() {
+        uint64_t i;
+        while ((i = next_slice.fetch_add(1)) < num_slices) {
+            try {
+                parsers_[i]->slice.parse_data(parsers_[i]->ctx);
+            } catch (...) {
+                std::lock_guard<std::mutex> guard(error_mutex);
+                if (!error)
+                    error = std::current_exception();
+                next_slice = num_slices;
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    try {
+        for (uint32_t i = 1; i < num_threads; i++)
+            threads.emplace_back(worker);
+    } catch (...) {
+        next_slice = num_slices;
+        for (auto & thread : threads)
+            thread.join();
+        throw;
+    }
+    worker();
+    for (auto & thread : threads)
+        thread.join();
+    if (error)
+        std::rethrow_exception(error);
+}
 
-    uint64_t slice_type = ctx.header()->slice_type;
+bool FrameDecoder::decode(uint64_t frame_num, MvFrame &frame) {
+    decoder_.extract_slices(frame_num, slices_);
+    return decode_slices(slices_, frame);
+}
 
-    if (mbAddrA == -1
-        || is_mb_intra(ctx.mb_array[mbAddrA]->mb_type, slice_type)
-        || ctx.mb_array[mbAddrA]->predFlagL[listSuffixFlag][mbPartIdxA] == 0) {
-        mvLA[0] = 0; mvLA[1] = 0;
-        refIdxLA = -1;
-    } else {
-        int *m = ctx.mb_array[mbAddrA]->mvL[listSuffixFlag][mbPartIdxA][0];
-        mvLA[0] = m[0]; mvLA[1] = m[1];
-        refIdxLA = ctx.mb_array[mbAddrA]->refIdxL[listSuffixFlag][mbPartIdxA];
+bool FrameDecoder::decode_slices(const std::vector<std::string_view> &slices,
+                                 MvFrame &frame) {
+    ParserContext & ctx = this->ctx();
+    /* the size only depends on the sps */
+    frame.resize(ctx);
+    frame_ = &frame;
+    if (!parse(slices, this)) {
+        frame.reset(ctx.Width(), ctx.Height(),
+                    ctx.Width() / MACROBLOCK_SIZE,
+                    ctx.Height() / MACROBLOCK_SIZE, false);
+        return false;
+    }
+    if (decoder_.parse_depth_ == ParseDepth::Header) {
+        /* no macroblocks to read from */
+        frame.reset(ctx.Width(), ctx.Height(),
+                    ctx.Width() / MACROBLOCK_SIZE,
+                    ctx.Height() / MACROBLOCK_SIZE, true);
     }
+    return true;
+}
 
-    if (mbAddrB == -1
-        || is_mb_intra(ctx.mb_array[mbAddrB]->mb_type, slice_type)
-        || ctx.mb_array[mbAddrB]->predFlagL[listSuffixFlag][mbPartIdxB] == 0) {
-        mvLB[0] = 0; mvLB[1] = 0;
-        refIdxLB = -1;
-    } else {
-        int *m = ctx.mb_array[mbAddrB]->mvL[listSuffixFlag][mbPartIdxB][0];
-        mvLB[0] = m[0]; mvLB[1] = m[1];
-        refIdxLB = ctx.mb_array[mbAddrB]->refIdxL[listSuffixFlag][mbPartIdxB];
+static inline void load_mv_neighbour(ParserContext &ctx, int64_t mb_addr,
+                                     int64_t mbPartIdx, int listSuffixFlag,
+                                     uint64_t slice_type, int (&mvLN)[2],
+                                     int &refIdxLN) {
+    if (mb_addr == -1)
+        return;
+    const MacroBlock & mb = ctx.mb_array[mb_addr];
+    if (is_mb_intra(mb.mb_type, slice_type)
+        || mb.predFlagL[listSuffixFlag][mbPartIdx] == 0)
+        return;
+    const int *m = mb.mvL[listSuffixFlag][mbPartIdx][0];
+    mvLN[0] = m[0]; mvLN[1] = m[1];
+    refIdxLN = mb.refIdxL[listSuffixFlag][mbPartIdx];
+}
+
+static inline MvNeighbours load_mv_neighbours(ParserContext &ctx,
+                                              const MacroBlock &mb,
+                                              int listSuffixFlag,
+                                              uint64_t slice_type) {
+    MvNeighbours n;
+    load_mv_neighbour(ctx, mb.mbAddrA, mb.mbPartIdxA, listSuffixFlag,
+                      slice_type, n.mvLA, n.refIdxLA);
+    load_mv_neighbour(ctx, mb.mbAddrB, mb.mbPartIdxB, listSuffixFlag,
+                      slice_type, n.mvLB, n.refIdxLB);
+    load_mv_neighbour(ctx, mb.mbAddrC, mb.mbPartIdxC, listSuffixFlag,
+                      slice_type, n.mvLC, n.refIdxLC);
+    return n;
+}
+
+static inline void store_mb_part_mv(MacroBlock &mb, uint32_t mbPartIdx,
+                                    const int (&mvL0)[2],
+                                    const int (&mvL1)[2],
+                                    int refIdxL0, int refIdxL1,
+                                    bool predFlagL0, bool predFlagL1) {
+    mb.mvL[0][mbPartIdx][0][0] = mvL0[0];
+    mb.mvL[0][mbPartIdx][0][1] = mvL0[1];
+    /* py264 stores the vertical component twice */
+    mb.mvL[1][mbPartIdx][0][0] = mvL1[1];
+    mb.mvL[1][mbPartIdx][0][1] = mvL1[1];
+    mb.refIdxL[0][mbPartIdx] = refIdxL0;
+    mb.refIdxL[1][mbPartIdx] = refIdxL1;
+    mb.predFlagL[0][mbPartIdx] = predFlagL0;
+    mb.predFlagL[1][mbPartIdx] = predFlagL1;
+}
+
+/* 8.4.1.1 */
+static void process_skip_mb(ParserContext &ctx, MacroBlock &mb,
+                            uint64_t slice_type) {
+    int mvL0[2];
+    const int mvL1[2] = {0, 0};
+    predict_skip_mv(mb.mbAddrA != -1, mb.mbAddrB != -1,
+                    load_mv_neighbours(ctx, mb, 0, slice_type), mvL0);
+    store_mb_part_mv(mb, 0, mvL0, mvL1, 0, -1, true, false);
+}
+
+template <uint32_t part_width, uint32_t part_height>
+static void process_partitioned_mb(ParserContext &ctx, MacroBlock &mb,
+                                   uint64_t slice_type) {
+    constexpr uint32_t numMbPart = 256 / (part_width * part_height);
+    for (uint32_t mbPartIdx = 0; mbPartIdx < numMbPart; mbPartIdx++) {
+        /* no B slice */
+        int mb_pred_mode = MbPartPredMode(mb.mb_type, mbPartIdx, slice_type);
+        bool predFlagL0 = mb_pred_mode == Pred_L0 || mb_pred_mode == BiPred;
+        bool predFlagL1 = mb_pred_mode == Pred_L1 || mb_pred_mode == BiPred;
+        int refIdxL0 = -1;
+        int refIdxL1 = -1;
+        int mvL0[2] = {0, 0};
+        int mvL1[2] = {0, 0};
+        if (predFlagL0) {
+            refIdxL0 = static_cast<int>(mb.mb_pred.ref_idx_l0[mbPartIdx]);
+            int mvpL0[2];
+            predict_luma_mv<part_width, part_height>(
+                    mbPartIdx, load_mv_neighbours(ctx, mb, 0, slice_type),
+                    mvpL0);
+            mvL0[0] = static_cast<int>(mvpL0[0]
+                                       + mb.mb_pred.mvd_l0[mbPartIdx][0][0]);
+            mvL0[1] = static_cast<int>(mvpL0[1]
+                                       + mb.mb_pred.mvd_l0[mbPartIdx][0][1]);
+        }
+        if (predFlagL1) {
+            refIdxL1 = static_cast<int>(mb.mb_pred.ref_idx_l1[mbPartIdx]);
+            int mvpL1[2];
+            predict_luma_mv<part_width, part_height>(
+                    mbPartIdx, load_mv_neighbours(ctx, mb, 1, slice_type),
+                    mvpL1);
+            mvL1[0] = static_cast<int>(mvpL1[0]
+                                       + mb.mb_pred.mvd_l1[mbPartIdx][0][0]);
+            mvL1[1] = static_cast<int>(mvpL1[1]
+                                       + mb.mb_pred.mvd_l1[mbPartIdx][0][1]);
+        }
+        store_mb_part_mv(mb, mbPartIdx, mvL0, mvL1, refIdxL0, refIdxL1,
+                         predFlagL0, predFlagL1);
     }
+}
 
-    if (mbAddrC == -1
-        || is_mb_intra(ctx.mb_array[mbAddrC]->mb_type, slice_type)
-        || ctx.mb_array[mbAddrC]->predFlagL[listSuffixFlag][mbPartIdxC] == 0) {
-        mvLC[0] = 0; mvLC[1] = 0;
-        refIdxLC = -1;
-    } else {
-        int *m = ctx.mb_array[mbAddrC]->mvL[listSuffixFlag][mbPartIdxC][0];
-        mvLC[0] = m[0]; mvLC[1] = m[1];
-        refIdxLC = ctx.mb_array[mbAddrC]->refIdxL[listSuffixFlag][mbPartIdxC];
-    }
-}
-
-void h264::process_luma_mv(ParserContext &ctx, uint32_t mbPartIdx,
-                           int listSuffixFlag, int (&mvL)[2]) {
-    std::shared_ptr<MacroBlock> mb = ctx.mb;
-    int refIdxLA = -1;
-    int refIdxLB = -1;
-    int refIdxLC = -1;
-    int mvL0A[2];
-    int mvL0B[2];
-    int mvL0C[2];
-    get_mv_neighbor_part(ctx, listSuffixFlag, mvL0A, mvL0B, mvL0C,
-                         refIdxLA, refIdxLB, refIdxLC);
-    process_luma_mv(ctx, mbPartIdx, mvL0A, mvL0B, mvL0C, refIdxLA,
-                    refIdxLB, refIdxLC, mvL);
-}
-
-void h264::process_luma_mv(ParserContext &ctx,  uint32_t mbPartIdx,
-                           int (mvLA)[2], int (mvLB)[2], int (mvLC)[2],
-                           int refIdxLA, int refIdxLB, int refIdxLC,
-                           int (&mvL)[2]) {
-    std::shared_ptr<MacroBlock> mb = ctx.mb;
-    uint64_t mbPartWidth = MbPartWidth(mb->mb_type);
-    uint64_t mbPartHeight = MbPartHeight(mb->mb_type);
-    if (mbPartWidth == 16 && mbPartHeight == 8 && mbPartIdx == 0) {
-        mvL[0] = mvLB[0]; mvL[1] = mvLB[1];
-    } else if (mbPartWidth == 16 && mbPartHeight == 8 && mbPartIdx == 1) {
-        mvL[0] = mvLA[0]; mvL[1] = mvLA[1];
-    } else if (mbPartWidth == 8 && mbPartHeight == 16 && mbPartIdx == 0) {
-        mvL[0] = mvLA[0]; mvL[1] = mvLA[1];
-    } else if (mbPartWidth == 8 && mbPartHeight == 16 && mbPartIdx == 1) {
-        mvL[0] = mvLC[0]; mvL[1] = mvLC[1];
-    } else {
-        /* 8.4.1.3.1*/
-        if (refIdxLA != -1 && refIdxLB == -1 && refIdxLC == -1) {
-            mvL[0] = mvLA[0];
-            mvL[1] = mvLA[1];
-        } else if (refIdxLA == -1 && refIdxLB != -1 && refIdxLC == -1) {
-            mvL[0] = mvLB[0];
-            mvL[1] = mvLB[1];
-        } else if (refIdxLA == -1 && refIdxLB == -1 && refIdxLC != -1) {
-            mvL[0] = mvLC[0];
-            mvL[1] = mvLC[1];
+static void process_sub_mb(ParserContext &, MacroBlock &, uint64_t) {
+    throw NotImplemented("numSubMbParts");
+}
+
+static void process_intra_mb(ParserContext &, MacroBlock &, uint64_t) {}
+
+typedef void (*InterMbHandler)(ParserContext &ctx, MacroBlock &mb,
+                               uint64_t slice_type);
+
+struct InterMbHandlers {
+    InterMbHandler entries[32];
+};
+
+/* one handler per P slice mb_type, so that the partition shape is known at
+ * compile time inside each of them */
+static constexpr InterMbHandlers build_inter_mb_handlers() {
+    InterMbHandlers handlers {};
+    for (auto & handler : handlers.entries)
+        handler = process_intra_mb;
+    handlers.entries[P_L0_16x16] = process_partitioned_mb<16, 16>;
+    handlers.entries[P_L0_L0_16x8] = process_partitioned_mb<16, 8>;
+    handlers.entries[P_L0_L0_8x16] = process_partitioned_mb<8, 16>;
+    handlers.entries[P_8x8] = process_sub_mb;
+    handlers.entries[P_8x8ref0] = process_sub_mb;
+    handlers.entries[P_Skip] = process_skip_mb;
+    return handlers;
+}
+
+static constexpr InterMbHandlers inter_mb_handlers = build_inter_mb_handlers();
+
+/* adapted from py264. Section 8.4 */
+static void predict_inter_mb(ParserContext &ctx, MacroBlock &mb) {
+    /* only to work with 4:2:0 */
+    if (ctx.sps.chroma_array_type() != 1)
+        throw NotImplemented("chroma_array_type != 1");
+    /* baseline profile won't have B slice */
+    if (mb.slice_type == SliceType::TYPE_B)
+        throw NotImplemented("B Slice");
+    if (mb.mb_type >= 32)
+        throw std::runtime_error("invalid mb_type");
+    inter_mb_handlers.entries[mb.mb_type](ctx, mb, ctx.header()->slice_type);
+}
+
+void FrameDecoder::on_macroblock(ParserContext &ctx, MacroBlock &mb) {
+    /* the neighbours A to C come before mb, so their motion vectors are
+     * already final */
+    if (ctx.depth >= ParseDepth::MotionVector)
+        predict_inter_mb(ctx, mb);
+    store_mv(mb);
+}
+
+void FrameDecoder::on_skip_run(ParserContext &ctx, uint64_t first_mb_addr,
+                               uint64_t mb_skip_run) {
+    if (ctx.depth < ParseDepth::MotionVector || !skip_runs_) {
+        MacroBlockListener::on_skip_run(ctx, first_mb_addr, mb_skip_run);
+        return;
+    }
+    if (ctx.sps.chroma_array_type() != 1)
+        throw NotImplemented("chroma_array_type != 1");
+    /* by 8.4.1.1 a skipped block gets a zero motion vector if its left
+     * neighbour is a skipped block with a zero motion vector, and so does
+     * every block in the first row or column. a picture that is a single
+     * skip run is therefore all zero */
+    const bool all_zero = first_mb_addr == 0
+                          && mb_skip_run == ctx.PicSizeInMbs();
+    const int zero_mv[2] = {0, 0};
+    bool left_zero = false;
+    for (uint64_t i = 0; i < mb_skip_run; i++) {
+        MacroBlock & mb = ctx.mb_array[first_mb_addr + i];
+        if (all_zero || mb.mbAddrA == -1 || mb.mbAddrB == -1
+            || (left_zero && i > 0)) {
+            store_mb_part_mv(mb, 0, zero_mv, zero_mv, 0, -1, true, false);
+            left_zero = true;
         } else {
-            mvL[0] = std::max(std::min(mvLA[0], mvLB[0]),
-                              std::min(std::max(mvLA[0], mvLB[0]), mvLC[0]));
-            mvL[1] = std::max(std::min(mvLA[1], mvLB[1]),
-                              std::min(std::max(mvLA[1], mvLB[1]), mvLC[1]));
+            process_skip_mb(ctx, mb, ctx.header()->slice_type);
+            left_zero = mb.mvL[0][0][0][0] == 0 && mb.mvL[0][0][0][1] == 0;
         }
+        store_mv(mb);
     }
 }
 
+void FrameDecoder::store_mv(const MacroBlock &mb) {
+    /* as in MvFrame::reset, the frame only covers PicHeightInMapUnits rows */
+    if (mb.mb_addr < uint64_t(frame_->mb_width()) * frame_->mb_height())
+        frame_->set_mv(mb);
+}
+
 MvFrame::MvFrame(ParserContext &ctx) : mvs_() {
-    height_ = ctx.Height();
-    width_ = ctx.Width();
-    mb_width_ = (uint32_t)ctx.PicWidthInMbs();
-    mb_height_ = (uint32_t)ctx.PicHeightInMapUnits();
-    mvs_ = std::vector<MotionVector>(mb_height_ * mb_width_);
+    reset(ctx);
+}
+
+void MvFrame::reset(ParserContext &ctx) {
+    resize(ctx);
     for (uint32_t i = 0; i < mb_height_; i++) {
         for (uint32_t j = 0; j < mb_width_; j++) {
             /* compute mb_addr */
             uint32_t mb_addr = i * mb_width_ + j;
-            std::shared_ptr<MacroBlock> mb = ctx.mb_array[mb_addr];
+            MacroBlock * mb = &ctx.mb_array[mb_addr];
             if (mb->pos_x() != j || mb->pos_y() != i)
                 throw std::runtime_error("pos does not match");
-            MotionVector mv {
-                    -mb->mvL[0][0][0][0] / 4.0f,
-                    -mb->mvL[0][0][0][1] / 4.0f,
-                    mb->pos_x() * 16,
-                    mb->pos_y() * 16,
-                    0,
-                    static_cast<uint32_t>(mb->mb_type)
-            };
-            mv.energy = uint32_t(mv.mvL0[0] * mv.mvL0[0] +
-                                         mv.mvL0[1] * mv.mvL0[1]);
-            mvs_[mb_addr] = mv;
+            set_mv(*mb);
         }
     }
 }
 
+void MvFrame::resize(ParserContext &ctx) {
+    height_ = ctx.Height();
+    width_ = ctx.Width();
+    mb_width_ = (uint32_t)ctx.PicWidthInMbs();
+    mb_height_ = (uint32_t)ctx.PicHeightInMapUnits();
+    p_frame_ = true;
+    mvs_.resize(mb_height_ * mb_width_);
+}
+
+void MvFrame::set_mv(const MacroBlock &mb) {
+    MotionVector mv {
+            -mb.mvL[0][0][0][0] / 4.0f,
+            -mb.mvL[0][0][0][1] / 4.0f,
+            mb.pos_x() * 16,
+            mb.pos_y() * 16,
+            0,
+            static_cast<uint32_t>(mb.mb_type)
+    };
+    mv.energy = uint32_t(mv.mvL0[0] * mv.mvL0[0] +
+                                 mv.mvL0[1] * mv.mvL0[1]);
+    mvs_[mb.mb_addr] = mv;
+}
+
 MvFrame::MvFrame(const MvFrame &frame) : height_(frame.height_),
                                          width_(frame.width_),
                                          mb_width_(frame.mb_width_),
-                                         mb_height_(frame.mb_height_), mvs_() {
+                                         mb_height_(frame.mb_height_), mvs_(),
+                                         p_frame_(frame.p_frame_) {
     mvs_ = std::vector<MotionVector>(mb_height_ * mb_width_);
 
     for (uint32_t i = 0; i < mb_height_; i++) {
@@ -497,9 +999,18 @@ MvFrame::MvFrame(const MvFrame &frame) : height_(frame.height_),
 
 MvFrame::MvFrame(uint32_t pic_width, uint32_t pic_height, uint32_t mb_width,
                  uint32_t mb_height, bool p_frame)
-        : height_(pic_height), width_(pic_width), mb_width_(mb_width),
-          mb_height_(mb_height), mvs_(), p_frame_(p_frame) {
-    mvs_ = std::vector<MotionVector>(mb_height_ * mb_width_);
+        : mvs_() {
+    reset(pic_width, pic_height, mb_width, mb_height, p_frame);
+}
+
+void MvFrame::reset(uint32_t pic_width, uint32_t pic_height,
+                    uint32_t mb_width, uint32_t mb_height, bool p_frame) {
+    height_ = pic_height;
+    width_ = pic_width;
+    mb_width_ = mb_width;
+    mb_height_ = mb_height;
+    p_frame_ = p_frame;
+    mvs_.resize(mb_height_ * mb_width_);
     for (uint32_t i = 0; i < mb_height_; i++) {
         for (uint32_t j = 0; j < mb_width_; j++) {
             MotionVector mv;
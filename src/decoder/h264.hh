@@ -17,23 +17,63 @@
 #ifndef H264FLOW_H264_HH
 #define H264FLOW_H264_HH
 
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
 #include "mp4.hh"
+#include "index.hh"
 
 #define MACROBLOCK_SIZE 16
 
+/* raw Annex B byte stream, one entry per NAL unit. NAL units are found
+ * incrementally, so that the first ones are there before the whole file has
+ * been read. with follow set, the file may still be growing: refresh() maps
+ * the bytes appended since, and the NAL unit at the end is held back until
+ * the start code after it is written, as it may not be complete yet.
+ * scanning is not synchronized, the extract calls are.
+ */
 class BitStream {
 public:
-    explicit BitStream(std::string filename);
-
-    ~BitStream() { stream_.close(); }
+    /* finds every NAL unit of the file unless scan is false */
+    explicit BitStream(std::string filename, bool scan = true,
+                       bool follow = false);
 
-    std::vector<std::pair<uint64_t, uint64_t>> chunk_offsets()
+    /* finds every NAL unit mapped so far */
+    void scan();
+    /* goes on from where the last scan stopped until at least min_chunks
+     * more NAL units are found, or the mapped bytes run out. returns the
+     * number found */
+    uint64_t scan_more(uint64_t min_chunks);
+    /* every NAL unit of the file has been found. never the case when
+     * following, as more may be written */
+    bool scanned() const { return scanned_; }
+    bool follow() const { return follow_; }
+    /* maps the bytes appended since. returns whether there are any */
+    bool refresh() { return file_.refresh(); }
+    /* the bytes after the last start code found, which are still being
+     * written when following. empty once scanned */
+    std::string_view pending() const;
+    /* grows as the stream is scanned */
+    const std::vector<std::pair<uint64_t, uint64_t>> & chunk_offsets() const
     { return chunk_offsets_; }
+    const MappedFile & file() const { return file_; }
 
-    std::string extract_stream(uint64_t position, uint64_t size);
+    /* both extract calls only read the mapped file, so they are safe to call
+     * from several threads */
+    std::string extract_stream(uint64_t position, uint64_t size) const;
+    /* zero-copy view into the mapped file. valid as long as the BitStream */
+    std::string_view extract_span(uint64_t position, uint64_t size) const
+    { return file_.span(position, size); }
 private:
-    std::ifstream stream_;
+    MappedFile file_;
     std::vector<std::pair<uint64_t, uint64_t>> chunk_offsets_;
+    const bool follow_;
+    bool scanned_ = false;
+    /* where the search for the next start code goes on */
+    uint64_t search_pos_ = 0;
+    /* the NAL unit after the last start code found, if any */
+    bool in_nal_ = false;
+    uint64_t nal_start_ = 0;
 };
 
 
@@ -52,6 +92,15 @@ public:
             uint32_t mb_height, bool p_frame = false);
     MvFrame() : mvs_() {}
     MvFrame(const MvFrame& frame);
+    MvFrame(MvFrame &&) = default;
+    MvFrame &operator=(const MvFrame &) = default;
+    MvFrame &operator=(MvFrame &&) = default;
+    /* refill the frame in place. the storage is kept if the size matches */
+    void reset(ParserContext &ctx);
+    /* sizes the frame for the picture of ctx, without filling it in */
+    void resize(ParserContext &ctx);
+    void reset(uint32_t pic_width, uint32_t pic_height, uint32_t mb_width,
+               uint32_t mb_height, bool p_frame = false);
     inline MotionVector get_mv(uint32_t mb_addr) const { return mvs_[mb_addr]; }
     MotionVector get_mv(uint32_t x, uint32_t y) const
     { return mvs_[y * mb_width_ + x]; }
@@ -59,6 +108,8 @@ public:
     { mvs_[y * mb_width_ + x] = mv; }
     inline void set_mv(uint32_t mb_addr, MotionVector mv)
     { mvs_[mb_addr] = mv; }
+    /* from the motion vector of the first partition of mb */
+    void set_mv(const MacroBlock &mb);
 
     inline uint32_t height() const { return height_; }
     inline uint32_t width() const { return width_; }
@@ -81,43 +132,188 @@ private:
     bool p_frame_ = true;
 };
 
+class FrameDecoder;
+
+/* one h264 object can be shared between threads: load_frame, load_frames,
+ * visit_frames, get_raw_mb, index_nal and index_size are safe to call
+ * concurrently. samples are read from the memory mapped file without a
+ * shared position. the index of an MP4 file is built once, the one of a raw
+ * bitstream grows under a lock as frames are asked for. set_parse_depth is
+ * not synchronized and must not race with decoding.
+ * a raw bitstream is indexed lazily: opening it only looks for the parameter
+ * sets, and decoding a frame scans just far enough to find its slices. a
+ * bitstream that is still being written can be followed like tail -f, in
+ * which case index_size and extract_slices take in the bytes appended since
+ * the last call, and a frame is ready once the NAL unit after it has begun.
+ */
 class h264 {
 public:
-    explicit h264(const std::string &filename);
+    /* with sidecar set, the index is taken from filename.idx if that is up
+     * to date with the file, and (re)built and saved there otherwise. it
+     * then holds the slice type of every sample as well. follow is for a
+     * raw bitstream that is still growing, which has no sidecar */
+    explicit h264(const std::string &filename, bool sidecar = false,
+                  bool follow = false);
     explicit h264(std::shared_ptr<MP4File> mp4);
     explicit h264(std::shared_ptr<BitStream> stream);
+    /* decodes slices that come from elsewhere, such as a StreamDecoder, with
+     * FrameDecoder::decode_slices. it has no samples of its own */
+    h264(std::shared_ptr<SPS_NALUnit> sps, std::shared_ptr<PPS_NALUnit> pps);
 
     void index_nal();
     std::pair<MvFrame, bool> load_frame(uint64_t frame_num);
+    /* load_frame for every frame in [begin, end), decoded on num_threads
+     * threads and returned in order. 0 threads uses every core. the first
+     * error is rethrown once all threads are done */
+    std::vector<std::pair<MvFrame, bool>> load_frames(
+            uint64_t begin, uint64_t end, uint32_t num_threads = 0);
+    /* called from the decoding threads, in no particular order. the frame is
+     * reused once the visitor returns */
+    typedef std::function<void(uint64_t frame_num, const MvFrame &frame,
+                               bool p_frame)> FrameVisitor;
+    void visit_frames(uint64_t begin, uint64_t end,
+                      const FrameVisitor &visitor, uint32_t num_threads = 0);
     std::vector<std::shared_ptr<MacroBlock>> get_raw_mb(uint64_t frame_num);
+    /* the number of frames. when following, the ones ready so far */
     uint64_t index_size();
+    /* zero-copy views of the slices that make up the picture of frame_num,
+     * in stream order, valid as long as the h264 object. other NAL units of
+     * the sample are left out. a raw bitstream has one NAL unit per entry,
+     * so the picture takes the slices of the entries after frame_num too,
+     * and an entry that continues an earlier picture has no slices */
+    void extract_slices(uint64_t frame_num,
+                        std::vector<std::string_view> &slices);
+    /* slice_type % 5 of the first slice of frame_num, -1 if it has none.
+     * from the index when it has them, otherwise from the sample */
+    int slice_type(uint64_t frame_num);
+    bool is_idr(uint64_t frame_num);
+
+    /* presentation time of frame_num in seconds, from the timing tables of
+     * an MP4 file, which are read on first use. a raw bitstream has no
+     * timestamps and throws */
+    double time_of(uint64_t frame_num);
+    /* the frame shown at that time */
+    uint64_t frame_at_time(double seconds);
+    /* the frames decoding can start from, in order */
+    const std::vector<uint32_t> & sync_samples();
+
+    /* defaults to ParseDepth::Full. load_frame only fills in the motion
+     * vectors from ParseDepth::MotionVector on, and the mb_type from
+     * ParseDepth::MbType on */
+    void set_parse_depth(ParseDepth depth) { parse_depth_ = depth; }
+    ParseDepth parse_depth() const { return parse_depth_; }
+    /* the slices of one picture are parsed on up to num_threads threads,
+     * 0 for every core. defaults to 1, which parses them one after another,
+     * as decoding several frames at once already keeps the cores busy. not
+     * synchronized either */
+    void set_slice_threads(uint32_t num_threads)
+    { slice_threads_ = num_threads; }
+    uint32_t slice_threads() const { return slice_threads_; }
 private:
+    friend class FrameDecoder;
+
     uint8_t length_size_ = 4;
-    std::vector<uint64_t> chunk_offsets_;
+    ParseDepth parse_depth_ = ParseDepth::Full;
+    uint32_t slice_threads_ = 1;
+    /* one sample per MP4 sample or per NAL unit of a raw bitstream */
+    SampleIndex index_;
     std::shared_ptr<MP4File> mp4_ = nullptr;
     std::shared_ptr<SPS_NALUnit> sps_ = nullptr;
     std::shared_ptr<PPS_NALUnit> pps_ = nullptr;
     std::shared_ptr<Box> trak_box_ = nullptr;
     std::shared_ptr<BitStream> bit_stream_ = nullptr;
+    /* created on the first load_frame, once sps_ and pps_ are known. a
+     * load_frame that finds it busy uses a decoder of its own instead */
+    std::unique_ptr<FrameDecoder> frame_decoder_;
+    std::mutex frame_decoder_mutex_;
+    std::once_flag index_once_;
+    TimeIndex time_index_;
+    std::once_flag time_once_;
+    /* guards the index of a raw bitstream, which grows as it is scanned.
+     * samples before ready_ belong to pictures whose slices are all in */
+    std::shared_mutex index_mutex_;
+    uint64_t ready_ = 0;
+    /* the whole bitstream is in the index */
+    bool indexed_ = false;
 
+    void build_index();
+    const TimeIndex & time_index();
+    void build_time_index();
     uint64_t read_nal_size(BinaryReader &br);
-
-    void process_inter_mb(ParserContext &ctx);
-    void get_mv_neighbor_part(ParserContext &ctx, int listSuffixFlag, int (&mvLA)[2],
-                              int (&mvLB)[2], int (&mvLC)[2], int &refIdxLA,
-                              int &refIdxLB, int &refIdxLC);
-    void process_luma_mv(ParserContext &ctx,  uint32_t mbPartIdx,
-                         int (mvLA)[2], int (mvLB)[2], int (mvLC)[2],
-                         int refIdxLA, int refIdxLB, int refIdxLC,
-                         int (&mvL)[2]);
-
-    void process_luma_mv(ParserContext &ctx,  uint32_t mbPartIdx,
-                         int listSuffixFlag, int (&mvL)[2]);
+    uint8_t sample_flags(uint64_t frame_num);
+    bool load_sidecar(const std::string &filename, const FileKey &key);
+    void save_sidecar(const std::string &filename, const FileKey &key);
 
     void load_bitstream();
+    /* called with index_mutex_ held, exclusively by the locate ones */
+    bool locate_next();
+    void locate(uint64_t frame_num);
+    void bitstream_slices(uint64_t frame_num,
+                          std::vector<std::string_view> &slices);
     void load_mp4();
+};
+
+/* decodes frames of one h264 stream, reusing the slices, the parser contexts
+ * and the macroblocks from frame to frame. once the buffers have grown to
+ * the largest frame of the stream, decoding into the same MvFrame does not
+ * allocate, which examples/alloc_check.cc checks. the h264 object has to
+ * outlive the decoder, and its parse depth applies.
+ * decode predicts the motion vector of every macroblock and writes it into
+ * the frame right after the macroblock is parsed, in a single pass.
+ * all slices of a picture go into the same macroblocks. prediction does not
+ * cross slice boundaries, so with h264::set_slice_threads the slices are
+ * parsed concurrently, each with a parser context of its own.
+ */
+class FrameDecoder : private MacroBlockListener {
+public:
+    explicit FrameDecoder(h264 & decoder, bool keep_coefficients = false);
+    FrameDecoder(const FrameDecoder &) = delete;
+    FrameDecoder &operator=(const FrameDecoder &) = delete;
+
+    /* returns false and an empty frame if frame_num is not a P frame */
+    bool decode(uint64_t frame_num, MvFrame & frame);
+    /* decode for slices taken with h264::extract_slices beforehand */
+    bool decode_slices(const std::vector<std::string_view> &slices,
+                       MvFrame & frame);
+    /* parses frame_num into the macroblocks without motion vector
+     * prediction. returns false if frame_num is not a P frame */
+    bool parse(uint64_t frame_num);
+
+    /* with false, a run of P_Skip blocks is predicted block by block like
+     * any other macroblock instead of in one go. the result is the same,
+     * which examples/skip_run_check.cc checks */
+    void set_skip_runs(bool enabled) { skip_runs_ = enabled; }
+
+    /* macroblocks of the last parsed frame */
+    MacroBlockArena & macroblocks() { return arena_; }
+    /* context of the first slice */
+    ParserContext & ctx() { return parsers_[0]->ctx; }
+
+private:
+    struct SliceParser {
+        SliceParser(const h264 &decoder, MacroBlockArena &arena)
+                : ctx(*decoder.sps_, *decoder.pps_, arena), slice() {}
+        ParserContext ctx;
+        Slice_NALUnit slice;
+    };
+
+    h264 & decoder_;
+    MacroBlockArena arena_;
+    /* one per slice of the largest picture so far */
+    std::vector<std::unique_ptr<SliceParser>> parsers_;
+    /* slices of the frame being decoded */
+    std::vector<std::string_view> slices_;
+    /* output of the decode in progress */
+    MvFrame * frame_ = nullptr;
+    bool skip_runs_ = true;
 
-    std::unique_ptr<ParserContext> get_ctx(uint64_t frame_num);
+    bool parse(const std::vector<std::string_view> &slices,
+               MacroBlockListener * listener);
+    void parse_slice_data(uint64_t num_slices);
+    void on_macroblock(ParserContext &ctx, MacroBlock &mb) override;
+    void on_skip_run(ParserContext &ctx, uint64_t first_mb_addr,
+                     uint64_t mb_skip_run) override;
+    void store_mv(const MacroBlock &mb);
 };
 
 
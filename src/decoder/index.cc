@@ -0,0 +1,357 @@
+/*  This file is part of h264flow.
+
+    h264flow is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    h264flow is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with h264flow.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "index.hh"
+
+static const char sidecar_magic[8] = {'H', '2', '6', '4', 'I', 'D', 'X', 0};
+/* bump whenever the layout changes */
+static const uint32_t sidecar_version = 1;
+/* reads back differently on a machine of the other byte order */
+static const uint32_t sidecar_byte_order = 0x01020304;
+
+struct SidecarHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t source;
+    uint64_t file_size;
+    int64_t file_mtime_ns;
+    uint64_t file_hash;
+    uint64_t num_samples;
+    uint32_t sps_size;
+    uint32_t pps_size;
+    uint32_t byte_order;
+    uint8_t length_size;
+    uint8_t has_flags;
+    uint8_t reserved[2];
+};
+static_assert(sizeof(SidecarHeader) == 64, "sidecar header is not packed");
+
+/* where the arrays of a sidecar start */
+struct SidecarLayout {
+    uint64_t offsets;
+    uint64_t sizes;
+    uint64_t flags;
+    uint64_t end;
+};
+
+static uint64_t align8(uint64_t pos) {
+    return (pos + 7) & ~(uint64_t)7;
+}
+
+static SidecarLayout sidecar_layout(const SidecarHeader &header) {
+    SidecarLayout layout {};
+    uint64_t n = header.num_samples;
+    layout.offsets = align8(sizeof(SidecarHeader) + header.sps_size
+                            + header.pps_size);
+    layout.sizes = layout.offsets + n * sizeof(uint64_t);
+    layout.flags = align8(layout.sizes + n * sizeof(uint32_t));
+    layout.end = layout.flags + (header.has_flags ? n : 0);
+    return layout;
+}
+
+/* FNV-1a */
+static uint64_t hash_bytes(const char *data, uint64_t size, uint64_t hash) {
+    for (uint64_t i = 0; i < size; i++) {
+        hash ^= static_cast<uint8_t>(data[i]);
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+FileKey FileKey::of(const std::string &filename, const MappedFile &file) {
+    FileKey key;
+    struct stat st {};
+    if (stat(filename.c_str(), &st) < 0)
+        throw std::runtime_error("unable to stat " + filename);
+    key.size = file.size();
+    key.mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000
+                   + st.st_mtim.tv_nsec;
+    const uint64_t page = 4096;
+    uint64_t head = std::min(page, key.size);
+    uint64_t tail = std::min(page, key.size - head);
+    key.hash = hash_bytes(file.data(), head, 0xcbf29ce484222325);
+    key.hash = hash_bytes(file.data() + key.size - tail, tail, key.hash);
+    return key;
+}
+
+void SampleIndex::set_samples(std::vector<uint64_t> offsets,
+                              std::vector<uint32_t> sizes) {
+    if (offsets.size() != sizes.size())
+        throw std::runtime_error("sample offsets and sizes do not match");
+    num_samples_ = offsets.size();
+    offsets_ = std::move(offsets);
+    sizes_ = std::move(sizes);
+    offsets_ptr_ = offsets_.data();
+    sizes_ptr_ = sizes_.data();
+    /* they described the old samples */
+    flags_.clear();
+    flags_ptr_ = nullptr;
+    has_flags_ = false;
+}
+
+void SampleIndex::append(uint64_t offset, uint32_t size, uint8_t flags) {
+    if (sidecar_ || (num_samples_ && !has_flags_))
+        throw std::runtime_error("sample index cannot be appended to");
+    offsets_.push_back(offset);
+    sizes_.push_back(size);
+    flags_.push_back(flags);
+    offsets_ptr_ = offsets_.data();
+    sizes_ptr_ = sizes_.data();
+    flags_ptr_ = flags_.data();
+    has_flags_ = true;
+    num_samples_++;
+}
+
+void SampleIndex::set_flags(std::vector<uint8_t> flags) {
+    if (flags.size() != num_samples_)
+        throw std::runtime_error("sample flags do not match");
+    flags_ = std::move(flags);
+    flags_ptr_ = flags_.data();
+    has_flags_ = true;
+}
+
+void SampleIndex::set_parameter_sets(std::string_view sps,
+                                     std::string_view pps,
+                                     uint8_t length_size) {
+    parameter_sets_.assign(sps.begin(), sps.end());
+    parameter_sets_.insert(parameter_sets_.end(), pps.begin(), pps.end());
+    sps_view_ = std::string_view(parameter_sets_.data(), sps.size());
+    pps_view_ = std::string_view(parameter_sets_.data() + sps.size(),
+                                 pps.size());
+    length_size_ = length_size;
+}
+
+std::unique_ptr<SampleIndex> SampleIndex::load(const std::string &filename,
+                                               const FileKey &key) {
+    std::unique_ptr<MappedFile> sidecar;
+    try {
+        sidecar = std::make_unique<MappedFile>(sidecar_name(filename));
+    } catch (std::runtime_error &) {
+        /* not there, or not readable */
+        return nullptr;
+    }
+    if (sidecar->size() < sizeof(SidecarHeader))
+        return nullptr;
+    SidecarHeader header {};
+    memcpy(&header, sidecar->data(), sizeof(header));
+    if (memcmp(header.magic, sidecar_magic, sizeof(sidecar_magic)) != 0
+        || header.version != sidecar_version
+        || header.byte_order != sidecar_byte_order
+        || header.source > static_cast<uint32_t>(Source::AnnexB))
+        return nullptr;
+    if (header.file_size != key.size || header.file_mtime_ns != key.mtime_ns
+        || header.file_hash != key.hash)
+        return nullptr;
+    /* a count this large cannot be real, and would overflow the layout */
+    if (header.num_samples > sidecar->size())
+        return nullptr;
+    SidecarLayout layout = sidecar_layout(header);
+    if (layout.end != sidecar->size())
+        return nullptr;
+
+    auto index = std::make_unique<SampleIndex>();
+    const char * data = sidecar->data();
+    index->source_ = static_cast<Source>(header.source);
+    index->num_samples_ = header.num_samples;
+    index->length_size_ = header.length_size;
+    index->offsets_ptr_ = reinterpret_cast<const uint64_t *>(
+            data + layout.offsets);
+    index->sizes_ptr_ = reinterpret_cast<const uint32_t *>(
+            data + layout.sizes);
+    if (header.has_flags) {
+        index->flags_ptr_ = reinterpret_cast<const uint8_t *>(
+                data + layout.flags);
+        index->has_flags_ = true;
+    }
+    index->sps_view_ = std::string_view(data + sizeof(SidecarHeader),
+                                        header.sps_size);
+    index->pps_view_ = std::string_view(data + sizeof(SidecarHeader)
+                                        + header.sps_size, header.pps_size);
+    index->sidecar_ = std::move(sidecar);
+    return index;
+}
+
+bool SampleIndex::save(const std::string &filename, const FileKey &key) const {
+    SidecarHeader header {};
+    memcpy(header.magic, sidecar_magic, sizeof(sidecar_magic));
+    header.version = sidecar_version;
+    header.source = static_cast<uint32_t>(source_);
+    header.file_size = key.size;
+    header.file_mtime_ns = key.mtime_ns;
+    header.file_hash = key.hash;
+    header.num_samples = num_samples_;
+    header.sps_size = static_cast<uint32_t>(sps_view_.size());
+    header.pps_size = static_cast<uint32_t>(pps_view_.size());
+    header.byte_order = sidecar_byte_order;
+    header.length_size = length_size_;
+    header.has_flags = has_flags_;
+    SidecarLayout layout = sidecar_layout(header);
+
+    /* written under a temporary name and renamed into place, which is
+     * atomic, so that concurrent openers see either no sidecar or all of it */
+    std::string name = sidecar_name(filename);
+    std::string tmp_name = name + ".tmp" + std::to_string(getpid());
+    {
+        std::ofstream stream(tmp_name, std::ios::binary | std::ios::trunc);
+        if (!stream)
+            return false;
+        const char padding[8] = {0};
+        auto write = [&](const void * data, uint64_t size) {
+            stream.write(static_cast<const char *>(data),
+                         static_cast<std::streamsize>(size));
+        };
+        auto pad_to = [&](uint64_t pos) {
+            write(padding, pos - static_cast<uint64_t>(stream.tellp()));
+        };
+        write(&header, sizeof(header));
+        write(sps_view_.data(), sps_view_.size());
+        write(pps_view_.data(), pps_view_.size());
+        pad_to(layout.offsets);
+        write(offsets_ptr_, num_samples_ * sizeof(uint64_t));
+        write(sizes_ptr_, num_samples_ * sizeof(uint32_t));
+        pad_to(layout.flags);
+        if (has_flags_)
+            write(flags_ptr_, num_samples_);
+        stream.flush();
+        if (!stream) {
+            stream.close();
+            std::remove(tmp_name.c_str());
+            return false;
+        }
+    }
+    if (std::rename(tmp_name.c_str(), name.c_str()) != 0) {
+        std::remove(tmp_name.c_str());
+        return false;
+    }
+    return true;
+}
+
+TimeIndex::TimeIndex(uint32_t timescale, const std::vector<Run> &durations,
+                     const std::vector<Run> &offsets,
+                     const std::vector<uint32_t> &sync_samples, int64_t start)
+        : timescale_(timescale), start_(start), dts_samples_(),
+          dts_times_(), dts_deltas_(), cts_samples_(), cts_offsets_(),
+          presentation_order_(), sync_samples_() {
+    if (!timescale)
+        throw std::runtime_error("timescale is 0");
+    int64_t time = 0;
+    for (const auto & run : durations) {
+        if (!run.count)
+            continue;
+        dts_samples_.emplace_back(num_samples_);
+        dts_times_.emplace_back(time);
+        dts_deltas_.emplace_back(static_cast<uint32_t>(run.value));
+        num_samples_ += run.count;
+        time += run.count * run.value;
+    }
+    uint64_t sample = 0;
+    for (const auto & run : offsets) {
+        if (!run.count || sample >= num_samples_)
+            continue;
+        cts_samples_.emplace_back(sample);
+        cts_offsets_.emplace_back(static_cast<int32_t>(run.value));
+        sample += run.count;
+    }
+
+    /* with B frames, samples are presented out of decoding order */
+    bool in_order = true;
+    for (uint64_t i = 1; i < num_samples_ && in_order; i++)
+        in_order = presentation_time(i - 1) <= presentation_time(i);
+    if (!in_order) {
+        presentation_order_.resize(num_samples_);
+        for (uint64_t i = 0; i < num_samples_; i++)
+            presentation_order_[i] = static_cast<uint32_t>(i);
+        std::stable_sort(presentation_order_.begin(),
+                         presentation_order_.end(),
+                         [this](uint32_t a, uint32_t b) {
+            return presentation_time(a) < presentation_time(b);
+        });
+    }
+
+    if (sync_samples.empty()) {
+        sync_samples_.resize(num_samples_);
+        for (uint64_t i = 0; i < num_samples_; i++)
+            sync_samples_[i] = static_cast<uint32_t>(i);
+    } else {
+        for (auto number : sync_samples) {
+            if (number && number <= num_samples_)
+                sync_samples_.emplace_back(number - 1);
+        }
+        std::sort(sync_samples_.begin(), sync_samples_.end());
+    }
+}
+
+/* index of the run that sample falls into */
+static uint64_t find_run(const std::vector<uint64_t> &firsts, uint64_t sample) {
+    auto it = std::upper_bound(firsts.begin(), firsts.end(), sample);
+    return static_cast<uint64_t>(it - firsts.begin()) - 1;
+}
+
+int64_t TimeIndex::decode_time(uint64_t sample) const {
+    if (sample >= num_samples_)
+        throw std::runtime_error("sample out of range");
+    uint64_t run = find_run(dts_samples_, sample);
+    return dts_times_[run]
+           + static_cast<int64_t>((sample - dts_samples_[run])
+                                  * dts_deltas_[run]);
+}
+
+int64_t TimeIndex::presentation_time(uint64_t sample) const {
+    int64_t time = decode_time(sample) - start_;
+    if (!cts_samples_.empty() && sample >= cts_samples_[0])
+        time += cts_offsets_[find_run(cts_samples_, sample)];
+    return time;
+}
+
+double TimeIndex::time_of(uint64_t sample) const {
+    return static_cast<double>(presentation_time(sample)) / timescale_;
+}
+
+uint64_t TimeIndex::sample_at_time(double seconds) const {
+    if (!num_samples_)
+        throw std::runtime_error("no samples");
+    /* rounded down, but not past a time given by time_of */
+    auto time = static_cast<int64_t>(std::floor(seconds * timescale_ + 1e-6));
+    auto nth = [this](uint64_t i) -> uint64_t {
+        return presentation_order_.empty() ? i : presentation_order_[i];
+    };
+    /* the first position presented after time */
+    uint64_t low = 0, high = num_samples_;
+    while (low < high) {
+        uint64_t mid = low + (high - low) / 2;
+        if (presentation_time(nth(mid)) <= time)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return nth(low ? low - 1 : 0);
+}
+
+uint64_t TimeIndex::sync_sample_before(uint64_t sample) const {
+    if (sample >= num_samples_)
+        throw std::runtime_error("sample out of range");
+    auto it = std::upper_bound(sync_samples_.begin(), sync_samples_.end(),
+                               sample);
+    /* nothing before the first one can be decoded on its own either */
+    if (it == sync_samples_.begin())
+        return sync_samples_.empty() ? 0 : sync_samples_[0];
+    return *(it - 1);
+}
@@ -0,0 +1,180 @@
+/*  This file is part of h264flow.
+
+    h264flow is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    h264flow is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with h264flow.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef H264FLOW_INDEX_HH
+#define H264FLOW_INDEX_HH
+
+#include <vector>
+#include "io.hh"
+
+/* tells whether a media file is still the one an index was built from,
+ * without reading all of it: size, modification time and a hash of the
+ * first and the last page */
+struct FileKey {
+    uint64_t size = 0;
+    int64_t mtime_ns = 0;
+    uint64_t hash = 0;
+
+    static FileKey of(const std::string &filename, const MappedFile &file);
+    bool operator==(const FileKey &key) const
+    { return size == key.size && mtime_ns == key.mtime_ns
+             && hash == key.hash; }
+};
+
+/* where the samples of a stream are, and what they start with. for an MP4
+ * file a sample is an access unit, for a raw bitstream it is a NAL unit.
+ * an index is either built in memory or mapped from a sidecar file saved by
+ * an earlier run, in which case opening it does not depend on the number of
+ * samples. the sidecar stores the arrays as they are laid out in memory:
+ *  - a fixed size header: magic, version, source type, the FileKey of the
+ *    media file, the sample count and the NAL length size
+ *  - the SPS and PPS NAL units, as found in the stream
+ *  - the sample offsets (uint64), sizes (uint32) and flags (uint8)
+ * every array starts 8-byte aligned. a sidecar that does not match its media
+ * file or this version is ignored, and rebuilt by the caller.
+ */
+class SampleIndex {
+public:
+    enum class Source : uint32_t {
+        MP4    = 0,
+        AnnexB = 1
+    };
+    /* flags of a sample: slice_type % 5 of its first slice in the low
+     * nibble, or no_slice, and whether it is an IDR picture */
+    static constexpr uint8_t slice_type_mask = 0x0F;
+    static constexpr uint8_t no_slice = 0x0F;
+    static constexpr uint8_t idr_flag = 0x10;
+
+    explicit SampleIndex(Source source = Source::MP4)
+            : source_(source), offsets_(), sizes_(), flags_(),
+              parameter_sets_(), sidecar_() {}
+    SampleIndex(const SampleIndex &) = delete;
+    SampleIndex &operator=(const SampleIndex &) = delete;
+    /* the arrays point into vectors or a mapping that move along */
+    SampleIndex(SampleIndex &&) = default;
+    SampleIndex &operator=(SampleIndex &&) = default;
+
+    /* the index saved for filename, if it matches key. nullptr otherwise */
+    static std::unique_ptr<SampleIndex> load(const std::string &filename,
+                                             const FileKey &key);
+    /* writes the sidecar for filename atomically, so that readers never see
+     * half of it. returns false if it could not be written */
+    bool save(const std::string &filename, const FileKey &key) const;
+    static std::string sidecar_name(const std::string &filename)
+    { return filename + ".idx"; }
+
+    Source source() const { return source_; }
+    void set_samples(std::vector<uint64_t> offsets,
+                     std::vector<uint32_t> sizes);
+    /* adds a sample to an index built in memory, which then has flags */
+    void append(uint64_t offset, uint32_t size, uint8_t flags);
+    uint64_t size() const { return num_samples_; }
+    uint64_t offset(uint64_t sample) const { return offsets_ptr_[sample]; }
+    uint32_t sample_size(uint64_t sample) const
+    { return sizes_ptr_[sample]; }
+
+    /* flags are optional, as they take a look at every sample */
+    bool has_flags() const { return has_flags_; }
+    uint8_t flags(uint64_t sample) const { return flags_ptr_[sample]; }
+    void set_flags(std::vector<uint8_t> flags);
+
+    /* parameter sets and NAL length size of the stream, kept with the index
+     * so that a sidecar is all it takes to open the file again */
+    void set_parameter_sets(std::string_view sps, std::string_view pps,
+                            uint8_t length_size);
+    std::string_view sps() const { return sps_view_; }
+    std::string_view pps() const { return pps_view_; }
+    uint8_t length_size() const { return length_size_; }
+
+private:
+    Source source_;
+    uint64_t num_samples_ = 0;
+    uint8_t length_size_ = 4;
+    bool has_flags_ = false;
+    const uint64_t * offsets_ptr_ = nullptr;
+    const uint32_t * sizes_ptr_ = nullptr;
+    const uint8_t * flags_ptr_ = nullptr;
+    std::string_view sps_view_ {};
+    std::string_view pps_view_ {};
+
+    /* storage of an index built in memory */
+    std::vector<uint64_t> offsets_;
+    std::vector<uint32_t> sizes_;
+    std::vector<uint8_t> flags_;
+    /* the sps followed by the pps. not a string, whose move would leave the
+     * views behind when it is short */
+    std::vector<char> parameter_sets_;
+    /* storage of a loaded one */
+    std::unique_ptr<MappedFile> sidecar_;
+};
+
+/* presentation times of the samples of a track, kept as the run-length
+ * tables of its sample table, so that it takes space per run rather than per
+ * sample. a time is found with a binary search over the runs. times are in
+ * the timescale of the track, and start where the edit list starts the
+ * presentation.
+ */
+class TimeIndex {
+public:
+    /* count samples that share a duration or a composition offset */
+    struct Run {
+        uint32_t count;
+        int64_t value;
+    };
+
+    TimeIndex() : dts_samples_(), dts_times_(), dts_deltas_(),
+                  cts_samples_(), cts_offsets_(), presentation_order_(),
+                  sync_samples_() {}
+    /* without offsets, samples are presented in decoding order. without
+     * sync samples, every sample is one */
+    TimeIndex(uint32_t timescale, const std::vector<Run> &durations,
+              const std::vector<Run> &offsets,
+              const std::vector<uint32_t> &sync_samples, int64_t start = 0);
+
+    uint64_t size() const { return num_samples_; }
+    uint32_t timescale() const { return timescale_; }
+    /* in the timescale */
+    int64_t decode_time(uint64_t sample) const;
+    int64_t presentation_time(uint64_t sample) const;
+    /* in seconds */
+    double time_of(uint64_t sample) const;
+    /* the sample being shown at time: the last one presented at or before
+     * it, or the first one before the presentation starts */
+    uint64_t sample_at_time(double seconds) const;
+    /* numbered from 0, in order */
+    const std::vector<uint32_t> & sync_samples() const
+    { return sync_samples_; }
+    /* the last sync sample at or before sample, where decoding it can
+     * start from */
+    uint64_t sync_sample_before(uint64_t sample) const;
+
+private:
+    uint32_t timescale_ = 1;
+    uint64_t num_samples_ = 0;
+    int64_t start_ = 0;
+    /* first sample, its decoding time and the duration of every run */
+    std::vector<uint64_t> dts_samples_;
+    std::vector<int64_t> dts_times_;
+    std::vector<uint32_t> dts_deltas_;
+    /* first sample and composition offset of every run */
+    std::vector<uint64_t> cts_samples_;
+    std::vector<int32_t> cts_offsets_;
+    /* samples by presentation time. empty when that is decoding order */
+    std::vector<uint32_t> presentation_order_;
+    std::vector<uint32_t> sync_samples_;
+};
+
+#endif //H264FLOW_INDEX_HH
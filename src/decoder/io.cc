@@ -15,32 +15,65 @@
  */
 
 #include "io.hh"
+#include <algorithm>
 #include <cmath>
 #include <experimental/filesystem>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define H264FLOW_X86
+#endif
 
 namespace fs = std::experimental::filesystem;
 using std::runtime_error;
 using std::string;
 
-BinaryReader::BinaryReader(std::istream &stream) : _stream(stream) {
+BinaryReader::BinaryReader(std::istream &stream) : _stream(&stream) {
 }
 
-string BinaryReader::read_bytes(uint64_t num) {
+BinaryReader::BinaryReader(std::string_view data) : _data(data.data()),
+                                                    _size(data.size()) {
+}
+
+void BinaryReader::read_raw_bytes(char *dst, uint64_t num) {
     if (pos() + num > size())
         throw std::runtime_error("stream eof");
-    std::vector<char> result(num);  // Because vector is guaranteed to be contiguous in C++03
-    _stream.read(&result[0], num);
+    if (_data) {
+        memcpy(dst, _data + _pos, num);
+        _pos += num;
+    } else {
+        _stream->read(dst, num);
+    }
+}
 
-    return std::string(&result[0], &result[num]);
+string BinaryReader::read_bytes(uint64_t num) {
+    if (_data)
+        return string(read_span(num));
+    string result(num, '\0');
+    read_raw_bytes(&result[0], num);
+    return result;
+}
+
+std::string_view BinaryReader::read_span(uint64_t num) {
+    if (!_data)
+        throw std::runtime_error("byte span requires a memory-backed reader");
+    if (_pos + num > _size)
+        throw std::runtime_error("stream eof");
+    std::string_view result(_data + _pos, num);
+    _pos += num;
+    return result;
 }
 
 uint64_t BinaryReader::size() {
-    if (_size) {
+    if (_size || _data) {
         return _size;
     }
-    uint32_t pos = this->pos();
-    _stream.seekg(0, std::iostream::end);
-    auto size = static_cast<uint32_t>(_stream.tellg());
+    uint64_t pos = this->pos();
+    _stream->seekg(0, std::iostream::end);
+    auto size = static_cast<uint64_t>(_stream->tellg());
     seek(pos);
     _size = size;
     return size;
@@ -73,6 +106,17 @@ int64_t BinaryReader::read_se() {
 }
 
 uint8_t BinaryReader::read_bit() {
+    if (_data) {
+        if (_pos >= _size)
+            throw std::runtime_error("stream eof");
+        auto tmp = static_cast<uint8_t>(
+                ((uint8_t)_data[_pos] >> (7 - _bit_pos)) & 1);
+        if (++_bit_pos == 8) {
+            _bit_pos = 0;
+            _pos++;
+        }
+        return tmp;
+    }
     /*
     if (_stream.eof())
         throw std::runtime_error("stream eof");
@@ -96,7 +140,7 @@ uint8_t BinaryReader::read_bit() {
         _bit_pos = 0;
     } else {
         _bit_pos++;
-        _stream.seekg(_pos);
+        _stream->seekg(_pos);
     }
     return tmp;
 }
@@ -127,7 +171,7 @@ uint64_t BinaryReader::next_bits(uint64_t bits) {
     uint8_t bit_pos = _bit_pos;
     // uint8_t last_byte = _last_byte;
     uint64_t result = read_bits(bits);
-    _stream.seekg(_pos); /* this one will reset _bit_pos to 0 */
+    seek(_pos); /* this one will reset _bit_pos to 0 */
     _bit_pos = bit_pos;
     //_last_byte = last_byte;
     return result;
@@ -137,6 +181,128 @@ int64_t BinaryReader::bits_left() {
     return (size() - pos()) * 8 - _bit_pos;
 }
 
+void BitReader::refill_escaped() {
+    uint64_t start = index_ & ~(uint64_t)7;
+    uint64_t byte_pos = start >> 3;
+    if (!rbsp_pos_ || byte_pos < (cache_start_ >> 3)) {
+        /* the mapping between raw and RBSP offsets is only known going
+         * forward, so start over */
+        raw_pos_ = 0;
+        rbsp_pos_ = 0;
+        zero_count_ = 0;
+    }
+    while (rbsp_pos_ + 8 < byte_pos)
+        load_escaped(8);
+    if (rbsp_pos_ < byte_pos)
+        load_escaped(static_cast<uint32_t>(byte_pos - rbsp_pos_));
+    /* bytes that are already in the cache are kept */
+    auto keep = static_cast<uint32_t>(rbsp_pos_ - byte_pos);
+    if (keep == 0)
+        cache_ = load_escaped(8);
+    else if (keep < 8)
+        cache_ = cache_ << (8 * (8 - keep)) | load_escaped(8 - keep);
+    cache_start_ = start;
+}
+
+/* returns the next num_bytes RBSP bytes in the low bits */
+uint64_t BitReader::load_escaped(uint32_t num_bytes) {
+    const auto *src = reinterpret_cast<const uint8_t *>(data_.data());
+    rbsp_pos_ += num_bytes;
+    if (raw_pos_ + 8 <= size_) {
+        uint64_t word;
+        memcpy(&word, src + raw_pos_, sizeof(word));
+        uint32_t shift = 64 - 8 * num_bytes;
+        word = __builtin_bswap64(word) >> shift;
+        /* only a 0x03 byte can be an emulation prevention byte. flag it with
+         * the usual has-zero-byte trick, ignoring the unused high bytes */
+        uint64_t x = word ^ (0x0303030303030303ull >> shift);
+        if (num_bytes < 8)
+            x |= ~0ull << (8 * num_bytes);
+        if (!((x - 0x0101010101010101ull) & ~x & 0x8080808080808080ull)) {
+            raw_pos_ += num_bytes;
+            zero_count_ = word ? (uint32_t)__builtin_ctzll(word) / 8
+                               : zero_count_ + num_bytes;
+            return word;
+        }
+    }
+    uint64_t result = 0;
+    for (uint32_t i = 0; i < num_bytes; i++) {
+        uint8_t byte = 0;
+        while (raw_pos_ < size_) {
+            byte = src[raw_pos_++];
+            if (zero_count_ < 2 || byte != 0x03)
+                break;
+            /* 0x000003: drop the 0x03 */
+            zero_count_ = 0;
+            byte = 0;
+        }
+        zero_count_ = byte ? 0 : zero_count_ + 1;
+        result = result << 8 | byte;
+    }
+    return result;
+}
+
+MappedFile::MappedFile(const std::string &filename, uint64_t reserve)
+        : filename_(filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw runtime_error(filename + " not found");
+    struct stat st {};
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        throw runtime_error("unable to stat " + filename);
+    }
+    uint64_t size = static_cast<uint64_t>(st.st_size);
+    size_ = size;
+    mapped_ = std::max(size, reserve);
+    if (mapped_) {
+        /* pages past the end of the file cannot be read until it grows. a
+         * shared mapping sees the bytes as they are written */
+        void *addr = mmap(nullptr, mapped_, PROT_READ,
+                          reserve ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED) {
+            close(fd);
+            throw runtime_error("unable to map " + filename);
+        }
+        madvise(addr, size, MADV_WILLNEED);
+        data_ = static_cast<const char *>(addr);
+    }
+    /* the mapping stays valid after the descriptor is closed */
+    if (reserve)
+        fd_ = fd;
+    else
+        close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (data_)
+        munmap(const_cast<char *>(data_), mapped_);
+    if (fd_ >= 0)
+        close(fd_);
+}
+
+bool MappedFile::refresh() {
+    if (fd_ < 0)
+        return false;
+    struct stat st {};
+    if (fstat(fd_, &st) < 0)
+        throw runtime_error("unable to stat " + filename_);
+    uint64_t size = static_cast<uint64_t>(st.st_size);
+    if (size > mapped_)
+        throw runtime_error(filename_ + " outgrew its mapping");
+    if (size <= size_.load(std::memory_order_relaxed))
+        return false;
+    size_.store(size, std::memory_order_release);
+    return true;
+}
+
+std::string_view MappedFile::span(uint64_t position, uint64_t size) const {
+    uint64_t file_size = this->size();
+    if (position > file_size || size > file_size - position)
+        throw runtime_error("stream eof");
+    return std::string_view(data_ + position, size);
+}
+
 void BinaryWriter::write_uint8(uint8_t value) {
     auto buf = reinterpret_cast<char *>(&value);
     stream_.write(buf, sizeof(value));
@@ -147,41 +313,6 @@ void BinaryWriter::write_uint32(uint32_t value) {
     stream_.write(buf, sizeof(value));
 }
 
-int64_t BitReader::read_se() {
-    uint64_t value = read_ue();
-    auto result = static_cast<int64_t>(std::ceil(value / 2.0));
-    return value % 2 ? result : -result;
-}
-
-void unescape_rbsp(BinaryReader &br, BinaryWriter &bw, uint64_t size) {
-    uint8_t zero_count = 0;
-    uint64_t stop_pos = size ? br.pos() + size : br.size();
-    while (br.pos() < stop_pos) {
-        uint8_t tmp = br.read_uint8();
-        if (tmp) {
-            bw.write_uint8(tmp);
-            zero_count = 0;
-        } else {
-            if (zero_count < 1) {
-                bw.write_uint8(tmp);
-                zero_count++;
-            } else if (zero_count == 1) {
-                /* write the 0 first */
-                bw.write_uint8(tmp);
-                /* escape the 0x03 */
-                tmp = br.read_uint8();
-                zero_count = 0;
-                if (tmp != 0x03)
-                    bw.write_uint8(tmp);
-                else if (!tmp)
-                    throw std::runtime_error("no emulation prevention found");
-            } else {
-                throw std::runtime_error("incorrect state in unescape");
-            }
-        }
-    }
-}
-
 bool search_nal(BinaryReader &br, bool skip_tag, uint32_t & tag_size) {
     if (br.pos() + 4 > br.size())
         return false;
@@ -205,4 +336,116 @@ bool search_nal(BinaryReader &br, bool skip_tag, uint32_t & tag_size) {
         }
     }
     return false;
-}
\ No newline at end of file
+}
+
+/* all scanners below look for the three-byte pattern 0x00 0x00 tail, where
+ * tail is non-zero: 0x01 for start codes, 0x03 for emulation prevention */
+static uint64_t find_prefix_scalar(const uint8_t * data, uint64_t size,
+                                   uint64_t pos, uint8_t tail) {
+    for (; pos + 2 < size; pos++) {
+        /* skip ahead two bytes when the third one can't end a pattern */
+        if (data[pos + 2] && data[pos + 2] != tail) {
+            pos += 2;
+        } else if (!data[pos] && !data[pos + 1] && data[pos + 2] == tail) {
+            return pos;
+        }
+    }
+    return size;
+}
+
+#ifdef H264FLOW_X86
+/* compares three overlapping loads so that bit i of the mask is set when
+ * the pattern starts at pos + i */
+__attribute__((target("sse2")))
+static uint64_t find_prefix_sse2(const uint8_t * data, uint64_t size,
+                                 uint64_t pos, uint8_t tail) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i last = _mm_set1_epi8(static_cast<char>(tail));
+    for (; pos + 16 + 2 <= size; pos += 16) {
+        auto *p = reinterpret_cast<const __m128i *>(data + pos);
+        __m128i b0 = _mm_loadu_si128(p);
+        __m128i b1 = _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(data + pos + 1));
+        __m128i b2 = _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(data + pos + 2));
+        __m128i hit = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(b0, zero),
+                                                  _mm_cmpeq_epi8(b1, zero)),
+                                    _mm_cmpeq_epi8(b2, last));
+        auto mask = (uint32_t)_mm_movemask_epi8(hit);
+        if (mask)
+            return pos + __builtin_ctz(mask);
+    }
+    return find_prefix_scalar(data, size, pos, tail);
+}
+
+__attribute__((target("avx2")))
+static uint64_t find_prefix_avx2(const uint8_t * data, uint64_t size,
+                                 uint64_t pos, uint8_t tail) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i last = _mm256_set1_epi8(static_cast<char>(tail));
+    for (; pos + 32 + 2 <= size; pos += 32) {
+        __m256i b0 = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i *>(data + pos));
+        __m256i b1 = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i *>(data + pos + 1));
+        __m256i b2 = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i *>(data + pos + 2));
+        __m256i hit = _mm256_and_si256(
+                _mm256_and_si256(_mm256_cmpeq_epi8(b0, zero),
+                                 _mm256_cmpeq_epi8(b1, zero)),
+                _mm256_cmpeq_epi8(b2, last));
+        auto mask = (uint32_t)_mm256_movemask_epi8(hit);
+        if (mask)
+            return pos + __builtin_ctz(mask);
+    }
+    return find_prefix_sse2(data, size, pos, tail);
+}
+#endif
+
+static uint64_t find_prefix(const char * data, uint64_t size, uint64_t pos,
+                            uint8_t tail) {
+    auto * src = reinterpret_cast<const uint8_t *>(data);
+#ifdef H264FLOW_X86
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    if (has_avx2)
+        return find_prefix_avx2(src, size, pos, tail);
+    return find_prefix_sse2(src, size, pos, tail);
+#else
+    return find_prefix_scalar(src, size, pos, tail);
+#endif
+}
+
+uint64_t find_start_code(const char * data, uint64_t size, uint64_t pos) {
+    return find_prefix(data, size, pos, 0x01);
+}
+
+uint64_t find_emulation_prevention(const char * data, uint64_t size,
+                                   uint64_t pos) {
+    return find_prefix(data, size, pos, 0x03);
+}
+
+void unescape_rbsp(const char * data, uint64_t size, std::string & out) {
+    /* the output never grows, so size it once and copy whole runs between
+     * emulation prevention bytes */
+    out.resize(size);
+    char * dst = &out[0];
+    uint64_t pos = 0;
+    while (pos < size) {
+        uint64_t escape = find_emulation_prevention(data, size, pos);
+        uint64_t end = escape == size ? size : escape + 2;
+        memcpy(dst, data + pos, end - pos);
+        dst += end - pos;
+        pos = escape == size ? size : escape + 3;
+    }
+    out.resize(static_cast<uint64_t>(dst - out.data()));
+}
+
+uint64_t unescaped_size(const char * data, uint64_t size) {
+    uint64_t pos = 0;
+    uint64_t result = size;
+    while ((pos = find_emulation_prevention(data, size, pos)) != size) {
+        result--;
+        pos += 3;
+    }
+    return result;
+}
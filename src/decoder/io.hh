@@ -17,15 +17,20 @@
 #ifndef H264FLOW_IO_HH
 #define H264FLOW_IO_HH
 
+#include <atomic>
 #include <string>
+#include <string_view>
 #include <iostream>
 #include <fstream>
 #include <memory>
 #include <cstring>
+#include <stdexcept>
 
 class BinaryReader {
 public:
     explicit BinaryReader(std::istream & stream);
+    /* memory-backed reader. the data has to outlive the reader */
+    explicit BinaryReader(std::string_view data);
 
     /* read values */
     uint8_t read_uint8() { return read_raw<uint8_t>(false); }
@@ -47,6 +52,8 @@ public:
     int64_t read_int64() { return read_raw<int64_t>(_little_endian); }
 
     std::string read_bytes(uint64_t num);
+    /* zero-copy read. only available on memory-backed readers */
+    std::string_view read_span(uint64_t num);
 
     /* for NAL */
     uint64_t read_ue();
@@ -65,93 +72,168 @@ public:
     int64_t bits_left();
 
     /* io functions */
-    uint64_t pos() { return (uint64_t)_stream.tellg(); }
-    void seek(uint64_t pos) { _stream.seekg(pos); _bit_pos = 0; }
-    bool eof() { return _stream.eof() || (pos() == size() && !_bit_pos); }
+    uint64_t pos() { return _data ? _pos : (uint64_t)_stream->tellg(); }
+    void seek(uint64_t pos) {
+        if (_data) _pos = pos; else _stream->seekg(pos);
+        _bit_pos = 0;
+    }
+    bool eof() {
+        if (_data) return _pos >= _size;
+        return _stream->eof() || (pos() == size() && !_bit_pos);
+    }
     uint64_t size();
     void set_little_endian(bool endian) { _little_endian = endian; }
     bool little_endian() { return _little_endian; }
     void switch_stream(std::istream &stream)
-    { _stream.rdbuf(stream.rdbuf()); seek(0); }
+    { _stream->rdbuf(stream.rdbuf()); seek(0); }
 
     std::string print_bit_pos(uint64_t offset = 0);
     ~BinaryReader() = default;
 
 private:
-    std::istream & _stream;
+    std::istream * _stream = nullptr;
+    const char * _data = nullptr;
+    uint64_t _pos = 0; /* only used by memory-backed readers */
     bool _little_endian = true;
     uint8_t _bit_pos = 0;
     uint8_t _last_byte = 0;
 
     uint64_t _size = 0; // avoid seeking on disk
 
+    void read_raw_bytes(char * dst, uint64_t num);
+
     template<typename T> T read_raw(bool switch_endian) {
-        size_t size = sizeof(T);
-        std::string data = read_bytes(size);
-        auto * value = reinterpret_cast<const T *>(data.c_str());
+        constexpr size_t size = sizeof(T);
+        char data[size];
+        read_raw_bytes(data, size);
+        T result;
+        auto * dst = reinterpret_cast<char *>(&result);
         if (switch_endian) {
-            T result;
-            auto * dst = reinterpret_cast<char *>(&result);
-            memset(dst, 0, sizeof(T));
-            auto * src = reinterpret_cast<const char *>(value);
             for (uint32_t i = 0; i < size; i++) {
-                dst[size - i - 1] = src[i];
+                dst[size - i - 1] = data[i];
             }
-            return result;
         } else {
-            return *value;
+            memcpy(dst, data, size);
         }
-
+        return result;
     }
 };
 
+/* read-only memory mapping of a whole file. offsets are 64-bit so that
+ * recordings larger than 4 GB can be addressed directly.
+ * a file that is still being written can be followed: reserve bytes of
+ * address space are mapped up front, so that refresh() takes in what was
+ * appended without moving the data, and earlier views stay valid. the file
+ * must not be truncated while it is mapped.
+ */
+class MappedFile {
+public:
+    explicit MappedFile(const std::string &filename, uint64_t reserve = 0);
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    ~MappedFile();
+
+    const char * data() const { return data_; }
+    uint64_t size() const { return size_.load(std::memory_order_acquire); }
+    /* zero-copy view into the file */
+    std::string_view span(uint64_t position, uint64_t size) const;
+    /* picks up the bytes appended since, up to the reserved size. returns
+     * whether the file grew. safe to call while others read the data */
+    bool refresh();
+
+private:
+    const char * data_ = nullptr;
+    std::atomic<uint64_t> size_ {0};
+    /* length of the mapping */
+    uint64_t mapped_ = 0;
+    /* kept open to follow the file, -1 otherwise */
+    int fd_ = -1;
+    std::string filename_;
+};
+
+/* removes emulation prevention bytes. out is overwritten and can be reused
+ * across calls to avoid reallocating */
+void unescape_rbsp(const char * data, uint64_t size, std::string & out);
+/* size of the payload after unescape_rbsp, without copying it */
+uint64_t unescaped_size(const char * data, uint64_t size);
+
+/* bit reader used by the slice parser. bits are served from a 64-bit cached
+ * word that is refilled from the byte buffer on demand, so peeking and
+ * skipping are O(1) and Exp-Golomb codes are decoded with a single
+ * count-leading-zeros instead of a bit-by-bit loop.
+ *
+ * when escaped is set the buffer still contains emulation prevention bytes,
+ * which are dropped while refilling. all positions and sizes are then in
+ * RBSP bytes. seeking backwards in this mode restarts from the beginning.
+ * the reader does not own the data, which has to outlive it.
+ */
 class BitReader {
 public:
-    explicit BitReader(std::string data) : data_(std::move(data)) {}
-    inline uint64_t pos() { return pos_; }
-    inline uint8_t bit_pos() { return bit_pos_; }
-    inline uint64_t size() { return data_.size(); }
-    inline void seek(uint64_t pos) { pos_ = pos; bit_pos_ = 0; }
-    inline void set_bit_pos(uint8_t bit_pos) { bit_pos_ = bit_pos; }
+    explicit BitReader(std::string_view data, bool escaped = false)
+            : data_(data), size_(data_.size()), escaped_(escaped)
+    { refill(); }
+    inline uint64_t pos() { return index_ >> 3; }
+    inline uint8_t bit_pos() { return (uint8_t)(index_ & 7); }
+    inline uint64_t size() {
+        if (escaped_ && !rbsp_size_)
+            rbsp_size_ = unescaped_size(data_.data(), data_.size());
+        return escaped_ ? rbsp_size_ : size_;
+    }
+    inline void seek(uint64_t pos) { index_ = pos << 3; }
+    inline void set_bit_pos(uint8_t bit_pos)
+    { index_ = (index_ & ~(uint64_t)7) | (bit_pos & 7); }
     bool read_bit_as_bool() { return static_cast<bool>(read_bit()); }
-    inline uint8_t read_uint8() { return (uint8_t)data_[pos_++]; }
-    /* TODO: escape RBSP */
-    inline uint8_t read_bit()
-    {
-        auto tmp = (uint8_t)data_[pos_];
-        tmp = (uint8_t)((tmp >> (7 - bit_pos_)) & 1);
-        ++bit_pos_;
-        if (bit_pos_ == 8) { bit_pos_ = 0; ++pos_; }
+    inline uint8_t read_uint8() {
+        /* reads the whole byte regardless of the bit position */
+        uint64_t index = index_ & ~(uint64_t)7;
+        index_ = index;
+        auto tmp = (uint8_t)peek(8);
+        index_ = index + 8;
+        return tmp;
+    }
+    inline uint8_t read_bit() {
+        auto tmp = (uint8_t)peek(1);
+        ++index_;
         return tmp;
     }
 
     inline uint64_t read_ue() {
-        uint8_t num_zero = 0;
-        uint64_t result;
-        while(!read_bit())
-            num_zero++;
-        result = 1 << num_zero | read_bits(num_zero);
-        return result - 1;
+        /* 32 bits are enough for any code shorter than 32 bits, which is
+         * every code that fits in the syntax elements we parse */
+        uint32_t word = (uint32_t)peek(32);
+        if (word) {
+            auto num_zero = (uint32_t)__builtin_clz(word);
+            if (num_zero < 16) {
+                uint32_t length = 2 * num_zero + 1;
+                index_ += length;
+                return (word >> (32 - length)) - 1;
+            }
+            index_ += num_zero + 1;
+            return ((uint64_t)1 << num_zero | read_bits(num_zero)) - 1;
+        }
+        throw std::runtime_error("invalid exp-golomb code");
     }
 
     inline uint64_t read_bits(uint64_t bits) {
-        uint64_t result = 0;
-        for (int i = bits - 1; i >= 0; i--) {
-            uint8_t  bit = read_bit();
-            result |= bit << i;
-        }
+        uint64_t result = next_bits(bits);
+        index_ += bits;
         return result;
     }
 
     inline uint64_t next_bits(uint64_t bits) {
-        uint64_t curr_pos = pos_;
-        uint8_t bit_pos = bit_pos_;
-        uint64_t result = read_bits(bits);
-        pos_ = curr_pos;
-        bit_pos_ = bit_pos;
-        return result;
+        if (bits <= 32)
+            return peek((uint32_t)bits);
+        /* split long reads so that the cached word always covers them */
+        uint64_t index = index_;
+        uint64_t hi = peek(32);
+        index_ += 32;
+        uint64_t lo = peek((uint32_t)(bits - 32));
+        index_ = index;
+        return hi << (bits - 32) | lo;
     }
 
+    inline void skip_bits(uint64_t bits) { index_ += bits; }
+
     inline uint64_t read_te(uint64_t range) {
         if (range > 1) {
             return read_ue();
@@ -160,14 +242,69 @@ public:
         }
     }
 
-    int64_t read_se();
+    inline int64_t read_se() {
+        uint64_t value = read_ue();
+        auto result = static_cast<int64_t>((value + 1) >> 1);
+        return value & 1 ? result : -result;
+    }
 
-    inline int64_t bits_left() { return (data_.size() - pos_) * 8 - bit_pos_; }
+    inline int64_t bits_left() { return size() * 8 - index_; }
 
 private:
-    std::string data_;
-    uint64_t pos_ = 0;
-    uint8_t bit_pos_ = 0;
+    std::string_view data_;
+    uint64_t size_;
+    bool escaped_;
+    uint64_t rbsp_size_ = 0;
+    /* escaped mode: next raw byte to be loaded into the cache, and the number
+     * of zero bytes right before it */
+    uint64_t raw_pos_ = 0;
+    uint32_t zero_count_ = 0;
+    /* escaped mode: RBSP offset of the byte at raw_pos_ */
+    uint64_t rbsp_pos_ = 0;
+    /* absolute bit position */
+    uint64_t index_ = 0;
+    /* cache_ holds the 64 bits starting at bit cache_start_ */
+    uint64_t cache_ = 0;
+    uint64_t cache_start_ = 0;
+
+    /* returns the next bits <= 32 bits without consuming them */
+    inline uint64_t peek(uint32_t bits) {
+        /* unsigned wrap-around turns seeks before cache_start_ into a
+         * large offset */
+        uint64_t offset = index_ - cache_start_;
+        if (offset > 63 || offset + bits > 64) {
+            refill();
+            offset = index_ - cache_start_;
+        }
+        /* split shift so that bits == 0 is well defined */
+        return ((cache_ << offset) >> 1) >> (63 - bits);
+    }
+
+    void refill() {
+        if (escaped_) {
+            refill_escaped();
+            return;
+        }
+        cache_start_ = index_ & ~(uint64_t)7;
+        uint64_t byte_pos = cache_start_ >> 3;
+        const auto *src = reinterpret_cast<const uint8_t *>(data_.data());
+        if (byte_pos + 8 <= size_) {
+            uint64_t word;
+            memcpy(&word, src + byte_pos, sizeof(word));
+            cache_ = __builtin_bswap64(word);
+        } else {
+            /* zero-fill past the end of the buffer */
+            cache_ = 0;
+            for (uint64_t i = 0; i < 8; i++) {
+                cache_ <<= 8;
+                if (byte_pos + i < size_)
+                    cache_ |= src[byte_pos + i];
+            }
+        }
+    }
+
+    void refill_escaped();
+    uint64_t load_escaped(uint32_t num_bytes);
 };
 
 class BinaryWriter {
@@ -179,7 +316,12 @@ private:
     std::ostream & stream_;
 };
 
-void unescape_rbsp(BinaryReader &br, BinaryWriter &bw, uint64_t size = 0);
 bool search_nal(BinaryReader &br, bool skip_tag, uint32_t &tag_size);
+/* returns the offset of the first 0x000001 start code at or after pos, or
+ * size if there is none. uses SSE2/AVX2 when available */
+uint64_t find_start_code(const char * data, uint64_t size, uint64_t pos);
+/* same as find_start_code, but for the 0x000003 emulation prevention pattern */
+uint64_t find_emulation_prevention(const char * data, uint64_t size,
+                                   uint64_t pos);
 
 #endif //H264FLOW_IO_HH
@@ -18,7 +18,6 @@
 #include <map>
 #include "mp4.hh"
 #include "util.hh"
-#include "../util/filesystem.hh"
 
 using std::string;
 
@@ -32,13 +31,22 @@ Box::Box(BinaryReader &br, bool read_data) : data_(), size_(), type_(),
                                              children_() {
     size_ = br.read_uint32(true);
     type_ = br.read_bytes(4);
+    uint64_t header_size = 8;
+    if (size_ == 1) {
+        /* 64-bit largesize, used by mdat in large recordings */
+        size_ = br.read_uint64(true);
+        header_size = 16;
+    } else if (size_ == 0) {
+        /* box extends to the end of the file */
+        size_ = br.size() - br.pos() + header_size;
+    }
 
-    parse_box(br, read_data);
+    parse_box(br, read_data, header_size);
 }
 
-Box::Box(uint32_t size, std::string type, BinaryReader &br, bool read_data)
+Box::Box(uint64_t size, std::string type, BinaryReader &br, bool read_data)
         : data_(), size_(size), type_(type), children_() {
-    parse_box(br, read_data);
+    parse_box(br, read_data, 8);
 }
 
 Box::Box(const Box & box) : data_(box.data_), size_(box.size_),
@@ -46,19 +54,19 @@ Box::Box(const Box & box) : data_(box.data_), size_(box.size_),
 
 Box::Box(std::shared_ptr<Box> box) : Box(*box.get()) {}
 
-void Box::parse_box(BinaryReader &br, bool read_data) {
+void Box::parse_box(BinaryReader &br, bool read_data, uint64_t header_size) {
     data_offset_ = br.pos(); /* used to get data from mp4 stream */
 
     if (mp4_container_boxes.find(type_) != mp4_container_boxes.end()) {
-        uint64_t end_pos = br.pos() + size_ - 8;
+        uint64_t end_pos = br.pos() + size_ - header_size;
         while (br.pos() < end_pos) {
             add_child(br);
         }
-    } else if (size_ > 8 && read_data && type_ != "mdat") {
-        data_ = br.read_bytes(size_ - 8);
+    } else if (size_ > header_size && read_data && type_ != "mdat") {
+        data_ = br.read_bytes(size_ - header_size);
     } else {
         /* skip data */
-        uint64_t dst_pos = br.pos() + size_ - 8;
+        uint64_t dst_pos = br.pos() + size_ - header_size;
         br.seek(dst_pos);
     }
 }
@@ -79,8 +87,8 @@ void Box::print(const uint32_t indent) {
             box->print(indent + 2);
 }
 
-BinaryReader Box::get_br(std::istream & stream) {
-    BinaryReader br(stream);
+BinaryReader Box::get_br() {
+    BinaryReader br{std::string_view(data_)};
     br.seek(data_start_);
     return br;
 }
@@ -107,46 +115,42 @@ std::set<std::shared_ptr<Box>> Box::find_all(std::string type) {
     return result;
 }
 
-MP4File::MP4File(std::string filename): root_(std::make_shared<Box>()),
-                                        stream_() {
-    if (!file_exists(filename))
-        throw std::runtime_error(filename + " not found");
-    stream_.open(filename, std::ifstream::binary);
-    BinaryReader br(stream_);
+MP4File::MP4File(std::string filename): root_(nullptr), file_(filename) {}
+
+Box & MP4File::root() {
+    if (root_)
+        return *root_;
+    root_ = std::make_shared<Box>();
+    BinaryReader br(file_.span(0, file_.size()));
     uint64_t end = br.size() - 1;
     while (br.pos() < end) {
         auto box = std::make_shared<Box>(br);
         root_->add_child(box);
     }
-}
-
-MP4File::~MP4File() {
-    stream_.close();
+    return *root_;
 }
 
 void MP4File::print() {
-    for (auto const & box : root_->children()) {
+    for (auto const & box : root().children()) {
         box->print();
     }
 }
 
-std::string MP4File::extract_stream(uint64_t position, uint64_t size) {
-    BinaryReader br(stream_);
-    br.seek(position);
-    return br.read_bytes(size);
+std::string MP4File::extract_stream(uint64_t position,
+                                   uint64_t size) const {
+    return std::string(file_.span(position, size));
 }
 
 std::shared_ptr<Box> MP4File::find_first(const std::string & type) {
-    return root_->find_first(type);
+    return root().find_first(type);
 }
 
 std::set<std::shared_ptr<Box>> MP4File::find_all(const std::string & type) {
-    return root_->find_all(type);
+    return root().find_all(type);
 }
 
 void MdatBox::parse(std::vector<uint64_t> offsets) {
-    std::istringstream stream(data_);
-    BinaryReader br = get_br(stream);
+    BinaryReader br = get_br();
     for (uint64_t offset : offsets) {
         br.seek(offset);
         if (LENGTH_SIZE_MINUS_ONE == 3) {
@@ -160,8 +164,7 @@ void MdatBox::parse(std::vector<uint64_t> offsets) {
 }
 
 FullBox::FullBox(const Box & box) : Box(box), version_(), flags_() {
-    std::istringstream stream(data_);
-    BinaryReader br = get_br(stream);
+    BinaryReader br = get_br();
 
     uint32_t tmp = br.read_uint32();
     version_ = static_cast<uint8_t >((tmp >> 24) & 0xFF);
@@ -171,8 +174,7 @@ FullBox::FullBox(const Box & box) : Box(box), version_(), flags_() {
 }
 
 StsdBox::StsdBox(const Box & box) : FullBox(box) {
-    std::istringstream stream(data_);
-    BinaryReader br = get_br(stream);
+    BinaryReader br = get_br();
 
     uint32_t num_sample_entries = br.read_uint32();
 
@@ -184,8 +186,7 @@ StsdBox::StsdBox(const Box & box) : FullBox(box) {
 
 
 TkhdBox::TkhdBox(Box &box) : FullBox(box) {
-    std::istringstream stream(data_);
-    BinaryReader br = get_br(stream);
+    BinaryReader br = get_br();
 
     if (version() == 1) {
         creation_time_ = br.read_uint64();
@@ -218,22 +219,34 @@ TkhdBox::TkhdBox(Box &box) : FullBox(box) {
     height_ = br.read_uint32() / 65536;
 }
 
+/* sample tables can hold millions of entries, so they are taken out of the
+ * box in one go instead of value by value */
+template <typename T, typename U>
+static void read_table(BinaryReader &br, uint64_t count,
+                       std::vector<U> &entries) {
+    std::string_view data = br.read_span(count * sizeof(T));
+    entries.resize(count);
+    for (uint64_t i = 0; i < count; i++) {
+        T value;
+        memcpy(&value, data.data() + i * sizeof(T), sizeof(T));
+        if (br.little_endian())
+            value = sizeof(T) == 8 ? (T)__builtin_bswap64(value)
+                                   : (T)__builtin_bswap32((uint32_t)value);
+        entries[i] = value;
+    }
+}
+
 StcoBox::StcoBox(const Box &box, bool read_large) : FullBox(box), entries_() {
-    std::istringstream stream(data_);
-    BinaryReader br = get_br(stream);
+    BinaryReader br = get_br();
     uint32_t entry_count = br.read_uint32();
-    entries_ = std::vector<uint64_t>(entry_count);
-    for (uint32_t i = 0 ; i < entry_count; i++) {
-        if (read_large)
-            entries_[i] = br.read_uint64();
-        else
-            entries_[i] = br.read_uint32();
-    }
+    if (read_large)
+        read_table<uint64_t>(br, entry_count, entries_);
+    else
+        read_table<uint32_t>(br, entry_count, entries_);
 }
 
 StscBox::StscBox(std::shared_ptr<Box> box) : FullBox(*box.get()), entries_() {
-    std::istringstream stream(data_);
-    BinaryReader br = get_br(stream);
+    BinaryReader br = get_br();
     uint32_t entry_count = br.read_uint32();
     entries_ = std::vector<StscBox::SampleToChunk>(entry_count);
     for (uint32_t i = 0; i < entry_count; i++) {
@@ -248,22 +261,111 @@ StscBox::StscBox(std::shared_ptr<Box> box) : FullBox(*box.get()), entries_() {
     }
 }
 
+std::vector<uint64_t> StscBox::sample_offsets(const StszBox &stsz,
+                                              const StcoBox &stco) const {
+    const auto & sizes = stsz.entries();
+    const auto & chunks = stco.chunk_offsets();
+    std::vector<uint64_t> offsets(sizes.size());
+    uint64_t sample = 0;
+    for (uint64_t i = 0; i < entries_.size() && sample < sizes.size(); i++) {
+        /* chunks are numbered from 1. the last entry goes on to the last
+         * chunk */
+        uint64_t first_chunk = entries_[i].first_chunk;
+        uint64_t end_chunk = i + 1 < entries_.size()
+                             ? entries_[i + 1].first_chunk
+                             : chunks.size() + 1;
+        if (first_chunk == 0 || first_chunk > end_chunk
+            || end_chunk > chunks.size() + 1)
+            throw std::runtime_error("invalid stsc entry");
+        uint32_t samples_per_chunk = entries_[i].samples_per_chunk;
+        for (uint64_t chunk = first_chunk;
+             chunk < end_chunk && sample < sizes.size(); chunk++) {
+            uint64_t offset = chunks[chunk - 1];
+            for (uint32_t j = 0;
+                 j < samples_per_chunk && sample < sizes.size(); j++) {
+                offsets[sample] = offset;
+                offset += sizes[sample];
+                sample++;
+            }
+        }
+    }
+    if (sample != sizes.size())
+        throw std::runtime_error("samples missing from the chunks");
+    return offsets;
+}
+
 StszBox::StszBox(std::shared_ptr<Box> box) : FullBox(*box.get()), entries_() {
-    std::istringstream stream(data_);
-    BinaryReader br = get_br(stream);
+    BinaryReader br = get_br();
     uint32_t sample_size = br.read_uint32();
     uint32_t sample_count = br.read_uint32();
     if (sample_size == 0) {
-        entries_ = std::vector<uint32_t>(sample_count);
-        for (uint32_t i = 0; i < sample_count; i++) {
-            entries_[i] = br.read_uint32();
+        read_table<uint32_t>(br, sample_count, entries_);
+    } else {
+        entries_ = std::vector<uint32_t>(sample_count, sample_size);
+    }
+}
+
+MdhdBox::MdhdBox(std::shared_ptr<Box> box) : FullBox(*box.get()) {
+    BinaryReader br = get_br();
+    if (version() == 1) {
+        br.read_bytes(16); /* creation and modification time */
+        timescale_ = br.read_uint32();
+        duration_ = br.read_uint64();
+    } else {
+        br.read_bytes(8);
+        timescale_ = br.read_uint32();
+        duration_ = br.read_uint32();
+    }
+}
+
+SttsBox::SttsBox(std::shared_ptr<Box> box) : FullBox(*box.get()), entries_() {
+    BinaryReader br = get_br();
+    uint32_t entry_count = br.read_uint32();
+    std::vector<uint32_t> table;
+    read_table<uint32_t>(br, uint64_t(entry_count) * 2, table);
+    entries_.resize(entry_count);
+    for (uint32_t i = 0; i < entry_count; i++)
+        entries_[i] = TimeToSample {table[i * 2], table[i * 2 + 1]};
+}
+
+CttsBox::CttsBox(std::shared_ptr<Box> box) : FullBox(*box.get()), entries_() {
+    BinaryReader br = get_br();
+    uint32_t entry_count = br.read_uint32();
+    std::vector<uint32_t> table;
+    read_table<uint32_t>(br, uint64_t(entry_count) * 2, table);
+    entries_.resize(entry_count);
+    for (uint32_t i = 0; i < entry_count; i++) {
+        entries_[i] = CompositionOffset {
+                table[i * 2], static_cast<int32_t>(table[i * 2 + 1])
+        };
+    }
+}
+
+StssBox::StssBox(std::shared_ptr<Box> box) : FullBox(*box.get()), entries_() {
+    BinaryReader br = get_br();
+    uint32_t entry_count = br.read_uint32();
+    read_table<uint32_t>(br, entry_count, entries_);
+}
+
+ElstBox::ElstBox(std::shared_ptr<Box> box) : FullBox(*box.get()), entries_() {
+    BinaryReader br = get_br();
+    uint32_t entry_count = br.read_uint32();
+    for (uint32_t i = 0; i < entry_count; i++) {
+        Edit edit {};
+        if (version() == 1) {
+            edit.segment_duration = br.read_uint64();
+            edit.media_time = br.read_int64();
+        } else {
+            edit.segment_duration = br.read_uint32();
+            edit.media_time = br.read_int32();
         }
+        br.read_bytes(4); /* media rate */
+        entries_.emplace_back(edit);
     }
 }
 
 SampleEntry::SampleEntry(const Box & box) : Box(box), data_reference_index_() {
-    std::istringstream stream(data_);
-    BinaryReader br = get_br(stream);
+    BinaryReader br = get_br();
 
     br.read_bytes(6); /* reserved */
     data_reference_index_ = br.read_uint16();
@@ -274,8 +376,7 @@ SampleEntry::SampleEntry(const Box & box) : Box(box), data_reference_index_() {
 VisualSampleEntry::VisualSampleEntry(const Box & box) : SampleEntry(box),
                                                         width_(), height_(),
                                                         compressorname_() {
-    std::istringstream stream(data_);
-    BinaryReader br = get_br(stream);
+    BinaryReader br = get_br();
     br.read_bytes(2); /* pre-defined */
     br.read_bytes(2); /* reserved */
     br.read_bytes(12); /* pre-defined */
@@ -305,8 +406,7 @@ VisualSampleEntry::VisualSampleEntry(const Box & box) : SampleEntry(box),
 }
 
 Avc1::Avc1(const Box & box) : VisualSampleEntry(box), avcc_size_(), avcC_() {
-    std::istringstream stream(data_);
-    BinaryReader br = get_br(stream);
+    BinaryReader br = get_br();
     std::string box_type = "";
     for (int i = 0; i < 2; i++) {
         /* two optional boxes */
@@ -326,9 +426,9 @@ Avc1::Avc1(const Box & box) : VisualSampleEntry(box), avcc_size_(), avcC_() {
 }
 
 AvcC::AvcC(Box &box) : Box(box), avc_profile_(), avc_profile_compatibility_(),
-                       avc_level_(), sps_units_(), pps_units_() {
-    std::istringstream stream(data_);
-    BinaryReader br = get_br(stream);
+                       avc_level_(), sps_units_(), pps_units_(), sps_data_(),
+                       pps_data_() {
+    BinaryReader br = get_br();
     configuration_version_ = br.read_uint8();
     avc_profile_ = br.read_uint8();
     avc_profile_compatibility_ = br.read_uint8();
@@ -342,16 +442,19 @@ AvcC::AvcC(Box &box) : Box(box), avc_profile_(), avc_profile_compatibility_(),
     uint8_t num_sps = (uint8_t)(tmp & 0x1F);
     for (uint8_t i = 0 ; i < num_sps; i++) {
         uint16_t length = br.read_uint16();
-        auto unit = std::make_shared<SPS_NALUnit>(br.read_bytes(length));
-        sps_units_.emplace_back(unit);
+        sps_data_.emplace_back(br.read_bytes(length));
+        sps_units_.emplace_back(std::make_shared<SPS_NALUnit>(
+                sps_data_.back()));
     }
     uint8_t num_pps = br.read_uint8();
     for (uint8_t i = 0; i < num_pps; i++) {
         uint16_t  length = br.read_uint16();
-        auto unit = std::make_shared<PPS_NALUnit>(br.read_bytes(length));
-        pps_units_.emplace_back(unit);
+        pps_data_.emplace_back(br.read_bytes(length));
+        pps_units_.emplace_back(std::make_shared<PPS_NALUnit>(
+                pps_data_.back()));
     }
 }
 
 AvcC::AvcC() : Box(), avc_profile_(), avc_profile_compatibility_(),
-               avc_level_(), sps_units_(), pps_units_()  {}
+               avc_level_(), sps_units_(), pps_units_(), sps_data_(),
+               pps_data_() {}
@@ -37,13 +37,13 @@ static const std::set<std::string> mp4_container_boxes{
 class Box {
 public:
     explicit Box(BinaryReader & br) : Box(br, true) {}
-    Box(uint32_t size, std::string type, BinaryReader &br, bool read_data);
+    Box(uint64_t size, std::string type, BinaryReader &br, bool read_data);
     Box(BinaryReader & br, bool read_data);
     explicit Box() : data_(), size_(), type_(), children_() {}
     Box(const Box & box);
     explicit Box(std::shared_ptr<Box> box);
 
-    uint32_t size() const { return size_; }
+    uint64_t size() const { return size_; }
     std::string type() const { return type_; }
     std::string data() { return data_; }
     uint64_t data_offset() { return data_offset_; }
@@ -62,16 +62,16 @@ public:
 
 protected:
     std::string data_;
-    uint32_t size_;
+    uint64_t size_;
     std::string type_;
     std::vector<std::shared_ptr<Box>> children_;
     uint64_t data_start_ = 0;
 
-    BinaryReader get_br(std::istream & stream);
+    BinaryReader get_br();
 
 private:
     uint64_t data_offset_ = 0;
-    void parse_box(BinaryReader &br, bool read_data);
+    void parse_box(BinaryReader &br, bool read_data, uint64_t header_size);
 };
 
 
@@ -141,7 +141,7 @@ public:
     explicit StcoBox(const Box & box) : StcoBox(box, box.type() == "co64") {}
     explicit StcoBox(const Box & box, bool read_large);
 
-    std::vector<uint64_t> chunk_offsets() { return entries_; }
+    const std::vector<uint64_t> & chunk_offsets() const { return entries_; }
 
 private:
     std::vector<uint64_t> entries_;
@@ -199,6 +199,9 @@ public:
     uint8_t length_size_minus_one() { return length_size_minus_one_; }
     std::vector<std::shared_ptr<SPS_NALUnit>> sps_units() { return sps_units_; }
     std::vector<std::shared_ptr<PPS_NALUnit>> pps_units() { return pps_units_; }
+    /* the parameter sets as stored in the box */
+    const std::vector<std::string> & sps_data() const { return sps_data_; }
+    const std::vector<std::string> & pps_data() const { return pps_data_; }
 private:
 
     uint8_t configuration_version_ = 1;
@@ -209,6 +212,8 @@ private:
 
     std::vector<std::shared_ptr<SPS_NALUnit>> sps_units_;
     std::vector<std::shared_ptr<PPS_NALUnit>> pps_units_;
+    std::vector<std::string> sps_data_;
+    std::vector<std::string> pps_data_;
 };
 
 class Avc1 : public VisualSampleEntry {
@@ -223,6 +228,8 @@ private:
     AvcC avcC_;
 };
 
+class StszBox;
+
 class StscBox : public FullBox {
 public:
     explicit StscBox(std::shared_ptr<Box> box);
@@ -233,7 +240,13 @@ public:
         uint32_t sample_description_index;
     };
 
-    std::vector<StscBox::SampleToChunk> entries() { return entries_; }
+    const std::vector<StscBox::SampleToChunk> & entries() const
+    { return entries_; }
+    /* file offset of every sample of the track, in one pass: the samples of
+     * a chunk are stored back to back from its offset, and each entry gives
+     * the number of samples of the chunks up to the next entry */
+    std::vector<uint64_t> sample_offsets(const StszBox &stsz,
+                                         const StcoBox &stco) const;
 private:
     std::vector<StscBox::SampleToChunk> entries_;
 };
@@ -241,25 +254,103 @@ private:
 class StszBox : public FullBox {
 public:
     explicit StszBox(std::shared_ptr<Box> box);
-    std::vector<uint32_t> entries() { return entries_; }
+    /* the size of every sample, also when they all have the same */
+    const std::vector<uint32_t> & entries() const { return entries_; }
 private:
     std::vector<uint32_t> entries_;
 };
 
+class MdhdBox : public FullBox {
+public:
+    explicit MdhdBox(std::shared_ptr<Box> box);
+    /* units per second of the times of the track */
+    uint32_t timescale() const { return timescale_; }
+    uint64_t duration() const { return duration_; }
+private:
+    uint32_t timescale_ = 0;
+    uint64_t duration_ = 0;
+};
+
+/* decoding time to sample: runs of samples that last as long */
+class SttsBox : public FullBox {
+public:
+    explicit SttsBox(std::shared_ptr<Box> box);
+
+    struct TimeToSample {
+        uint32_t sample_count;
+        uint32_t sample_delta;
+    };
+
+    const std::vector<TimeToSample> & entries() const { return entries_; }
+private:
+    std::vector<TimeToSample> entries_;
+};
+
+/* composition time to sample: runs of samples that are presented as long
+ * after they are decoded. version 0 offsets are read as signed too, which
+ * is what writers mean by them */
+class CttsBox : public FullBox {
+public:
+    explicit CttsBox(std::shared_ptr<Box> box);
+
+    struct CompositionOffset {
+        uint32_t sample_count;
+        int32_t sample_offset;
+    };
+
+    const std::vector<CompositionOffset> & entries() const
+    { return entries_; }
+private:
+    std::vector<CompositionOffset> entries_;
+};
+
+/* sync samples, numbered from 1. a track without the box has sync samples
+ * only */
+class StssBox : public FullBox {
+public:
+    explicit StssBox(std::shared_ptr<Box> box);
+    const std::vector<uint32_t> & entries() const { return entries_; }
+private:
+    std::vector<uint32_t> entries_;
+};
+
+/* edit list, in the movie timescale for durations and the track timescale
+ * for media times. a media time of -1 is an empty edit */
+class ElstBox : public FullBox {
+public:
+    explicit ElstBox(std::shared_ptr<Box> box);
+
+    struct Edit {
+        uint64_t segment_duration;
+        int64_t media_time;
+    };
+
+    const std::vector<Edit> & entries() const { return entries_; }
+private:
+    std::vector<Edit> entries_;
+};
+
+/* the box tree is parsed on first use, so opening a file only maps it */
 class MP4File {
 public:
     MP4File(std::string filename);
-    ~MP4File();
 
     void print();
     std::shared_ptr<Box> find_first(const std::string & type);
     std::set<std::shared_ptr<Box>> find_all(const std::string & type);
 
-    /* used internally */
-    std::string extract_stream(uint64_t position, uint64_t size);
+    /* used internally. both extract calls only read the mapped file, so
+     * they are safe to call from several threads */
+    std::string extract_stream(uint64_t position, uint64_t size) const;
+    /* zero-copy view into the mapped file. valid as long as the MP4File */
+    std::string_view extract_span(uint64_t position, uint64_t size) const
+    { return file_.span(position, size); }
+    const MappedFile & file() const { return file_; }
 
 private:
     std::shared_ptr<Box> root_;
-    std::ifstream stream_;
+    MappedFile file_;
+
+    Box & root();
 };
 #endif //H264FLOW_MP4_HH
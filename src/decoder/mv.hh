@@ -0,0 +1,89 @@
+/*  This file is part of h264flow.
+
+    h264flow is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    h264flow is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with h264flow.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef H264FLOW_MV_HH
+#define H264FLOW_MV_HH
+
+#include <algorithm>
+#include <cstdint>
+
+/* luma motion vector prediction of section 8.4.1, specialised on the
+ * partition shape. the decoder loads the neighbours out of the macroblocks,
+ * these only pick from them, so they can be checked on their own.
+ */
+
+/* motion vectors and reference indices of the neighbouring partitions A, B
+ * and C, section 8.4.1.3.2. a neighbour that is not available or not
+ * predicted from the list keeps the zero vector and -1 */
+struct MvNeighbours {
+    int mvLA[2] = {0, 0};
+    int mvLB[2] = {0, 0};
+    int mvLC[2] = {0, 0};
+    int refIdxLA = -1;
+    int refIdxLB = -1;
+    int refIdxLC = -1;
+};
+
+inline int median(int a, int b, int c) {
+    /* min/max compile to conditional moves */
+    return std::max(std::min(a, b), std::min(std::max(a, b), c));
+}
+
+/* 8.4.1.3.1. if exactly one neighbour has a reference index, its motion
+ * vector is taken as is, otherwise the median */
+inline void median_luma_mv(const MvNeighbours &n, int (&mvL)[2]) {
+    const int median_mv[2] = {median(n.mvLA[0], n.mvLB[0], n.mvLC[0]),
+                              median(n.mvLA[1], n.mvLB[1], n.mvLC[1])};
+    const unsigned available = (n.refIdxLA != -1)
+                               | (n.refIdxLB != -1) << 1
+                               | (n.refIdxLC != -1) << 2;
+    const int * const candidates[8] = {median_mv, n.mvLA, n.mvLB, median_mv,
+                                       n.mvLC, median_mv, median_mv,
+                                       median_mv};
+    const int * mv = candidates[available];
+    mvL[0] = mv[0];
+    mvL[1] = mv[1];
+}
+
+/* 8.4.1.3. 16x8 and 8x16 partitions take the directional predictor,
+ * everything else the median */
+template <uint32_t part_width, uint32_t part_height>
+inline void predict_luma_mv(uint32_t mbPartIdx, const MvNeighbours &n,
+                            int (&mvL)[2]) {
+    if constexpr (part_width == 16 && part_height == 8) {
+        const int * mv = mbPartIdx == 0 ? n.mvLB : n.mvLA;
+        mvL[0] = mv[0]; mvL[1] = mv[1];
+    } else if constexpr (part_width == 8 && part_height == 16) {
+        const int * mv = mbPartIdx == 0 ? n.mvLA : n.mvLC;
+        mvL[0] = mv[0]; mvL[1] = mv[1];
+    } else {
+        median_luma_mv(n, mvL);
+    }
+}
+
+/* 8.4.1.1. a skipped block has a zero motion vector if A or B is outside
+ * the picture or the slice, or is a zero vector into reference 0 */
+inline void predict_skip_mv(bool available_a, bool available_b,
+                            const MvNeighbours &n, int (&mvL)[2]) {
+    mvL[0] = 0;
+    mvL[1] = 0;
+    if (available_a && available_b
+        && !(n.refIdxLA == 0 && n.mvLA[0] == 0 && n.mvLA[1] == 0)
+        && !(n.refIdxLB == 0 && n.mvLB[0] == 0 && n.mvLB[1] == 0))
+        predict_luma_mv<16, 16>(0, n, mvL);
+}
+
+#endif //H264FLOW_MV_HH
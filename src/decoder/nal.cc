@@ -26,47 +26,67 @@ using std::shared_ptr;
 using std::make_shared;
 
 
-NALUnit::NALUnit(BinaryReader & br, uint32_t size, bool unescape)
-        : _nal_ref_idc(), _nal_unit_type(), _data() {
-    decode_header(br);
-    if (unescape) {
-        /* TODO: re-enable unescape in BitReader */
-        // std::ostringstream stream;
-        // BinaryWriter bw(stream);
-        // unescape_rbsp(br, bw, size - 1);
-        _data = br.read_bytes(size - 1);
-    } else {
-        _data = br.read_bytes(size - 1);
-    }
+NALUnit::NALUnit(std::string data, bool unescape): _nal_ref_idc(),
+                                                   _nal_unit_type(), _data(),
+                                                   _buffer(std::move(data)) {
+    _owned = true;
+    set_payload(_buffer, unescape);
 }
 
-NALUnit::NALUnit(std::string data, bool unescape): _nal_ref_idc(),
-                                                   _nal_unit_type(), _data() {
-    std::istringstream stream(data);
-    BinaryReader br(stream);
-    decode_header(br);
-    if (unescape) {
-        std::ostringstream s;
-        BinaryWriter bw(s);
-        unescape_rbsp(br, bw, data.length() - 1);
-        _data = s.str();
-    } else {
-        _data = br.read_bytes(data.length() - 1);
-    }
+NALUnit::NALUnit(std::string_view data, bool unescape): _nal_ref_idc(),
+                                                        _nal_unit_type(),
+                                                        _data(), _buffer() {
+    set_payload(data, unescape);
 }
 
+NALUnit::NALUnit(const NALUnit & unit): _nal_ref_idc(unit._nal_ref_idc),
+                                        _nal_unit_type(unit._nal_unit_type),
+                                        _data(unit._data),
+                                        _escaped(unit._escaped),
+                                        _buffer(unit._buffer),
+                                        _owned(unit._owned) {
+    /* point to our own copy */
+    if (_owned)
+        _data = std::string_view(_buffer).substr(_buffer.size() -
+                                                 _data.size());
+}
 
-void NALUnit::decode_header(BinaryReader & br) {
-    uint8_t tmp = br.read_uint8();
-    if (tmp & 0x80)
+void NALUnit::assign(std::string_view data, bool unescape) {
+    _owned = false;
+    _escaped = false;
+    set_payload(data, unescape);
+}
+
+void NALUnit::set_payload(std::string_view data, bool unescape) {
+    if (data.empty())
+        throw std::runtime_error("stream eof");
+    decode_header(static_cast<uint8_t>(data[0]));
+    _data = data.substr(1);
+    if (!unescape) {
+        /* emulation prevention bytes are skipped by BitReader instead */
+        _escaped = true;
+    } else if (find_emulation_prevention(_data.data(), _data.size(), 0) !=
+               _data.size()) {
+        std::string rbsp;
+        unescape_rbsp(_data.data(), _data.size(), rbsp);
+        _buffer = std::move(rbsp);
+        _data = _buffer;
+        _owned = true;
+    }
+}
+
+void NALUnit::decode_header(uint8_t header) {
+    if (header & 0x80)
         throw std::runtime_error("forbidden 0 bit is set");
-    _nal_ref_idc = tmp >> 5;
-    _nal_unit_type = static_cast<uint8_t >(tmp & 0x1F);
+    _nal_ref_idc = header >> 5;
+    _nal_unit_type = static_cast<uint8_t >(header & 0x1F);
 }
 
 void SPS_NALUnit::parse() {
-    std::stringstream stream(_data);
-    BinaryReader br(stream);
+    std::string rbsp;
+    if (_escaped)
+        unescape_rbsp(_data.data(), _data.size(), rbsp);
+    BinaryReader br{_escaped ? std::string_view(rbsp) : _data};
 
     profile_idc_ = br.read_uint8();
     flags_ = br.read_uint8();
@@ -147,7 +167,7 @@ PPS_NALUnit::PPS_NALUnit(NALUnit &unit) : NALUnit(unit) , run_length_minus1_(),
 }
 
 void PPS_NALUnit::parse() {
-    BitReader br(_data);
+    BitReader br(_data, _escaped);
 
     pps_id_ = br.read_ue();
     sps_id_ = br.read_ue();
@@ -193,59 +213,118 @@ void PPS_NALUnit::parse() {
     /* the rest is not parsed */
 }
 
-Slice_NALUnit::Slice_NALUnit(std::string data) : NALUnit(std::move(data)) {
-    _header = std::make_shared<SliceHeader>(*this, _data);
+Slice_NALUnit::Slice_NALUnit(std::string data, bool unescape)
+        : NALUnit(std::move(data), unescape) {
+    _header = std::make_shared<SliceHeader>(*this);
+    _slice_data = std::make_shared<SliceData>(*this);
+}
+
+Slice_NALUnit::Slice_NALUnit(std::string_view data, bool unescape)
+        : NALUnit(data, unescape) {
+    _header = std::make_shared<SliceHeader>(*this);
     _slice_data = std::make_shared<SliceData>(*this);
 }
 
 Slice_NALUnit::Slice_NALUnit(NALUnit &unit) : NALUnit(unit) {
-    _header = std::make_shared<SliceHeader>(*this, _data);
+    _header = std::make_shared<SliceHeader>(*this);
     _slice_data = std::make_shared<SliceData>(*this);
 }
 
-void Slice_NALUnit::parse(ParserContext & ctx) {;
-    BitReader br(_data);
-    _header->parse(ctx, br);
+Slice_NALUnit::Slice_NALUnit() : NALUnit() {
+    _header = std::make_shared<SliceHeader>(*this);
+    _slice_data = std::make_shared<SliceData>(*this);
+}
+
+void Slice_NALUnit::reset(std::string_view data, bool unescape) {
+    assign(data, unescape);
+    _header->clear();
+    _slice_data->clear();
+}
+
+void Slice_NALUnit::parse(ParserContext & ctx) {
+    parse_header(ctx);
+    if (ctx.depth != ParseDepth::Header)
+        parse_data(ctx);
+}
+
+void Slice_NALUnit::parse_header(ParserContext & ctx) {
+    _reader = BitReader(_data, _escaped);
+    _header->parse(ctx, _reader);
     ctx.set_header(_header);
-    _slice_data->parse(ctx, br);
+}
+
+void Slice_NALUnit::parse_data(ParserContext & ctx) {
+    _slice_data->parse(ctx, _reader);
+}
+
+void SliceHeader::clear() {
+    _header_size[0] = _header_size[1] = 0;
+    first_mb_in_slice = 0;
+    slice_type = 0;
+    pps_id = 0;
+    colour_plane_id = 0;
+    frame_num = 0;
+    field_pic_flag = false;
+    bottom_field_flag = false;
+    idr_pic_id = 0;
+    pic_order_cnt_lsb = 0;
+    delta_pic_order_cnt_bottom = 0;
+    delta_pic_order_cnt[0] = delta_pic_order_cnt[1] = 0;
+    redundant_pic_cnt = 0;
+    direct_spatial_mv_pred_flag = false;
+    num_ref_idx_active_override_flag = false;
+    num_ref_idx_l0_active_minus1 = 0;
+    num_ref_idx_l1_active_minus1 = 0;
+    cabac_init_idc = 0;
+    slice_qp_delta = 0;
+    sp_for_switch_flag = false;
+    slice_qs_delta = 0;
+    disable_deblocking_filter_idc = 0;
+    slice_alpha_c0_offset_div2 = 0;
+    slice_beta_offset_div2 = 0;
+    slice_group_change_cycle = 0;
+
+    rplm.clear();
+    pwt.clear();
+    drpm.clear();
 }
 
 void SliceHeader::parse(ParserContext &ctx, BitReader &br) {
-    std::shared_ptr<SPS_NALUnit> sps = ctx.sps;
-    std::shared_ptr<PPS_NALUnit> pps = ctx.pps;
+    const SPS_NALUnit & sps = ctx.sps;
+    const PPS_NALUnit & pps = ctx.pps;
 
     /* assign default value */
-    num_ref_idx_l0_active_minus1 = pps->num_ref_idx_l0_default_active_minus1();
-    num_ref_idx_l1_active_minus1 = pps->num_ref_idx_l1_default_active_minus1();
+    num_ref_idx_l0_active_minus1 = pps.num_ref_idx_l0_default_active_minus1();
+    num_ref_idx_l1_active_minus1 = pps.num_ref_idx_l1_default_active_minus1();
 
     first_mb_in_slice = br.read_ue();
     slice_type = br.read_ue();
     pps_id = br.read_ue();
-    if (pps_id != pps->pps_id())
+    if (pps_id != pps.pps_id())
         throw std::runtime_error("pps id does not match");
-    if (sps->separate_colour_plane_flag())
+    if (sps.separate_colour_plane_flag())
         colour_plane_id = static_cast<uint8_t >(br.read_bits(2));
-    frame_num = br.read_bits(sps->log2_max_frame_num_minus4() + 4);
-    if (!sps->frame_mbs_only_flag()) {
+    frame_num = br.read_bits(sps.log2_max_frame_num_minus4() + 4);
+    if (!sps.frame_mbs_only_flag()) {
         field_pic_flag = br.read_bit_as_bool();
         if (field_pic_flag)
             bottom_field_flag = br.read_bit_as_bool();
     }
     if (_nal.idr_pic_flag())
         idr_pic_id = br.read_ue();
-    if (sps->pic_order_cnt_type() == 0)
+    if (sps.pic_order_cnt_type() == 0)
         pic_order_cnt_lsb = br.read_bits(
-                sps->log2_max_pic_order_cnt_lsb_minus4() + 4);
-    if (pps->bottom_field_pic_order_in_frame_present_flag() && !field_pic_flag )
+                sps.log2_max_pic_order_cnt_lsb_minus4() + 4);
+    if (pps.bottom_field_pic_order_in_frame_present_flag() && !field_pic_flag )
         delta_pic_order_cnt_bottom = br.read_se();
-    if (sps->pic_order_cnt_type() == 1 &&
-            !sps->delta_pic_order_always_zero_flag()) {
+    if (sps.pic_order_cnt_type() == 1 &&
+            !sps.delta_pic_order_always_zero_flag()) {
         delta_pic_order_cnt[0] = br.read_se();
-        if (pps->bottom_field_pic_order_in_frame_present_flag() &&
+        if (pps.bottom_field_pic_order_in_frame_present_flag() &&
                 !field_pic_flag )
             delta_pic_order_cnt[1] = br.read_se();
     }
-    if (pps->redundant_pic_cnt_present_flag())
+    if (pps.redundant_pic_cnt_present_flag())
         redundant_pic_cnt = br.read_ue();
     if (slice_type == SliceType::TYPE_B)
         direct_spatial_mv_pred_flag = br.read_bit_as_bool();
@@ -262,16 +341,16 @@ void SliceHeader::parse(ParserContext &ctx, BitReader &br) {
     if (_nal.nal_unit_type() == 20)
         throw NotImplemented("ref_pic_list_mvc_modification");
 
-    rplm = RefPicListModification(slice_type, br);
-    if ((pps->weighted_pred_flag() && (slice_type == SliceType::TYPE_P ||
+    rplm.parse(slice_type, br);
+    if ((pps.weighted_pred_flag() && (slice_type == SliceType::TYPE_P ||
             slice_type == SliceType::TYPE_SP)) ||
-            (pps->weighted_bipred_idc() == 1
+            (pps.weighted_bipred_idc() == 1
              && (slice_type == SliceType::TYPE_B))) {
-        pwt = PredWeightTable(sps, pps, slice_type, br);
+        pwt.parse(sps, pps, slice_type, br);
     }
     if (_nal.nal_ref_idc())
-        drpm = DecRefPicMarking(_nal, br);
-    if (pps->entropy_coding_mode_flag() && slice_type != SliceType::TYPE_I &&
+        drpm.parse(_nal, br);
+    if (pps.entropy_coding_mode_flag() && slice_type != SliceType::TYPE_I &&
             slice_type != SliceType::TYPE_SI)
         cabac_init_idc = br.read_ue();
     slice_qp_delta = br.read_se();
@@ -281,7 +360,7 @@ void SliceHeader::parse(ParserContext &ctx, BitReader &br) {
         slice_qs_delta = br.read_se();
     }
 
-    if (pps->deblocking_filter_control_present_flag()) {
+    if (pps.deblocking_filter_control_present_flag()) {
         disable_deblocking_filter_idc = br.read_ue();
         if (disable_deblocking_filter_idc != 1) {
             slice_alpha_c0_offset_div2 = br.read_se();
@@ -289,12 +368,12 @@ void SliceHeader::parse(ParserContext &ctx, BitReader &br) {
         }
     }
 
-    if (pps->num_slice_groups_minus1() > 0 && pps->slice_group_map_type() >= 3
-        && pps->slice_group_map_type() <= 5) {
-        uint64_t pic_size_in_map_units = pps->pic_size_in_map_units_minus1()
+    if (pps.num_slice_groups_minus1() > 0 && pps.slice_group_map_type() >= 3
+        && pps.slice_group_map_type() <= 5) {
+        uint64_t pic_size_in_map_units = pps.pic_size_in_map_units_minus1()
                                          + 1;
         uint64_t slice_group_change_rate =
-                pps->slice_group_change_rate_minus1() + 1;
+                pps.slice_group_change_rate_minus1() + 1;
         uint64_t bits = intlog2(pic_size_in_map_units /
                                         slice_group_change_rate + 1);
         slice_group_change_cycle = br.read_bits(bits);
@@ -308,6 +387,20 @@ RefPicListModification::RefPicListModification()
 RefPicListModification::RefPicListModification(uint64_t slice_type,
                                                BitReader &br)
         :RefPicListModification() {
+    parse(slice_type, br);
+}
+
+void RefPicListModification::clear() {
+    ref_pic_list_modification_flag_l0 = false;
+    ref_pic_list_modification_flag_l1 = false;
+    modification_of_pic_nums_idc.clear();
+    abs_diff_pic_num_minus1.clear();
+    long_term_pic_num.clear();
+    abs_diff_view_idx_minus1.clear();
+}
+
+void RefPicListModification::parse(uint64_t slice_type, BitReader &br) {
+    clear();
     if (slice_type % 5 != 2 && slice_type % 5 != 4) {
         ref_pic_list_modification_flag_l0 = br.read_bit_as_bool();
         if (ref_pic_list_modification_flag_l0) {
@@ -347,30 +440,49 @@ PredWeightTable::PredWeightTable() : luma_weight_l0(), luma_offset_l0(),
                                      chroma_weight_l0(), chroma_offset_l0(),
                                      chroma_weight_l1(), chroma_offset_l1() {}
 
-PredWeightTable::PredWeightTable(std::shared_ptr<SPS_NALUnit> sps,
-                                 std::shared_ptr<PPS_NALUnit> pps,
+PredWeightTable::PredWeightTable(const SPS_NALUnit & sps,
+                                 const PPS_NALUnit & pps,
                                  uint64_t slice_type,
                                  BitReader &br) : PredWeightTable() {
+    parse(sps, pps, slice_type, br);
+}
+
+void PredWeightTable::clear() {
+    luma_log2_weight_denom = 0;
+    chroma_log2_weight_denom = 0;
+    luma_weight_l0.clear();
+    luma_offset_l0.clear();
+    luma_weight_l1.clear();
+    luma_offset_l1.clear();
+    chroma_weight_l0.clear();
+    chroma_offset_l0.clear();
+    chroma_weight_l1.clear();
+    chroma_offset_l1.clear();
+}
+
+void PredWeightTable::parse(const SPS_NALUnit & sps, const PPS_NALUnit & pps,
+                            uint64_t slice_type, BitReader &br) {
     luma_log2_weight_denom = br.read_ue();
-    if (sps->chroma_array_type())
+    chroma_log2_weight_denom = 0;
+    if (sps.chroma_array_type())
         chroma_log2_weight_denom = br.read_ue();
-    uint64_t num_ref_idx_l0 = pps->num_ref_idx_l0_default_active_minus1() + 1;
-    uint64_t num_ref_idx_l1 = pps->num_ref_idx_l1_default_active_minus1() + 1;
-    luma_weight_l0 = std::vector<int64_t>(num_ref_idx_l0);
-    luma_offset_l0 = std::vector<int64_t>(num_ref_idx_l0);
-    luma_weight_l1 = std::vector<int64_t>(num_ref_idx_l1);
-    luma_offset_l1 = std::vector<int64_t>(num_ref_idx_l1);
-    chroma_weight_l0 = std::vector<std::array<int64_t, 2>>(num_ref_idx_l0);
-    chroma_offset_l0 = std::vector<std::array<int64_t, 2>>(num_ref_idx_l0);
-    chroma_weight_l1 = std::vector<std::array<int64_t, 2>>(num_ref_idx_l1);
-    chroma_offset_l1 = std::vector<std::array<int64_t, 2>>(num_ref_idx_l1);
+    uint64_t num_ref_idx_l0 = pps.num_ref_idx_l0_default_active_minus1() + 1;
+    uint64_t num_ref_idx_l1 = pps.num_ref_idx_l1_default_active_minus1() + 1;
+    luma_weight_l0.assign(num_ref_idx_l0, 0);
+    luma_offset_l0.assign(num_ref_idx_l0, 0);
+    luma_weight_l1.assign(num_ref_idx_l1, 0);
+    luma_offset_l1.assign(num_ref_idx_l1, 0);
+    chroma_weight_l0.assign(num_ref_idx_l0, {});
+    chroma_offset_l0.assign(num_ref_idx_l0, {});
+    chroma_weight_l1.assign(num_ref_idx_l1, {});
+    chroma_offset_l1.assign(num_ref_idx_l1, {});
     for (uint32_t i = 0; i < num_ref_idx_l0; i++) {
         bool luma_weight_l0_flag = br.read_bit_as_bool();
         if (luma_weight_l0_flag) {
             luma_weight_l0[i] = br.read_se();
             luma_offset_l0[i] = br.read_se();
         }
-        if (sps->chroma_array_type()) {
+        if (sps.chroma_array_type()) {
             bool chroma_weight_l0_flag = br.read_bit_as_bool();
             if (chroma_weight_l0_flag) {
                 for (int j = 0; j < 2; j++) {
@@ -388,7 +500,7 @@ PredWeightTable::PredWeightTable(std::shared_ptr<SPS_NALUnit> sps,
                 luma_weight_l1[i] = br.read_se();
                 luma_offset_l1[i] = br.read_se();
             }
-            if (sps->chroma_array_type()) {
+            if (sps.chroma_array_type()) {
                 bool chroma_weight_l1_flag = br.read_bit_as_bool();
                 if (chroma_weight_l1_flag) {
                     for (int j = 0; j < 2; j++) {
@@ -409,6 +521,22 @@ DecRefPicMarking::DecRefPicMarking() :memory_management_control_operation(),
 
 DecRefPicMarking::DecRefPicMarking(const NALUnit &unit, BitReader &br)
         : DecRefPicMarking() {
+    parse(unit, br);
+}
+
+void DecRefPicMarking::clear() {
+    no_output_of_prior_pics_flag = false;
+    long_term_reference_flag = false;
+    adaptive_ref_pic_marking_mode_flag = false;
+    memory_management_control_operation.clear();
+    difference_of_pic_nums_minus1.clear();
+    long_term_pic_num.clear();
+    long_term_frame_idx.clear();
+    max_long_term_frame_idx_plus1.clear();
+}
+
+void DecRefPicMarking::parse(const NALUnit &unit, BitReader &br) {
+    clear();
     if (unit.idr_pic_flag()) {
         no_output_of_prior_pics_flag = br.read_bit_as_bool();
         long_term_reference_flag = br.read_bit_as_bool();
@@ -432,16 +560,18 @@ DecRefPicMarking::DecRefPicMarking(const NALUnit &unit, BitReader &br)
     }
 }
 
-void SliceData::find_trailing_bit() {
-    BitReader br(_nal.data());
-    uint64_t pos = br.size() - 1;
+void SliceData::find_trailing_bit(BitReader &br) {
+    std::string_view data = _nal.data();
+    /* nothing but zeros follows the stop bit, so when the payload is still
+     * escaped the bit only moves by the number of bytes removed before it */
+    uint64_t removed = data.size() - br.size();
+    uint64_t pos = data.size() - 1;
     /* search from the back */
     while (true) {
-        br.seek(pos);
-        uint8_t  tmp = br.read_uint8();
+        auto tmp = static_cast<uint8_t>(data[pos]);
         for (int i = 0; i < 8; i++) {
             if (tmp & (1 << i)) {
-                _trailing_bit = pos * 8 + (7 - i);
+                _trailing_bit = (pos - removed) * 8 + (7 - i);
                 return;
             }
         }
@@ -451,18 +581,18 @@ void SliceData::find_trailing_bit() {
 
 bool SliceData::more_rbsp_data(BitReader &br) {
     if (!_trailing_bit)
-        find_trailing_bit();
+        find_trailing_bit(br);
     return (br.pos() * 8 + br.bit_pos()) < _trailing_bit;
 }
 
 void SliceData::parse(ParserContext & ctx, BitReader &br) {
-    std::shared_ptr<SPS_NALUnit> sps = ctx.sps;
-    std::shared_ptr<PPS_NALUnit> pps = ctx.pps;
-    std::shared_ptr<SliceHeader> header = ctx.header();
-    if (pps->entropy_coding_mode_flag())
+    const SPS_NALUnit & sps = ctx.sps;
+    const PPS_NALUnit & pps = ctx.pps;
+    const SliceHeader * header = ctx.header();
+    if (pps.entropy_coding_mode_flag())
         throw NotImplemented("entropy_coding_mode_flag");
-    bool mbaff_frame_flag = this->mbaff_frame_flag(sps, header);
-    uint64_t curr_mb_addr = header->first_mb_in_slice * (1 + mbaff_frame_flag);
+    bool mbaff_frame_flag = this->mbaff_frame_flag(sps, *header);
+    uint64_t curr_mb_addr = ctx.first_mb_addr;
     bool more_data_flag = true;
     bool prev_mb_skipped = false;
     do {
@@ -470,15 +600,21 @@ void SliceData::parse(ParserContext & ctx, BitReader &br) {
         uint64_t mb_skip_run;
         if (header->slice_type != SliceType::TYPE_I
             && header->slice_type != SliceType::TYPE_SI) {
-            if (!pps->entropy_coding_mode_flag()) {
+            if (!pps.entropy_coding_mode_flag()) {
                 mb_skip_run = br.read_ue();
                 prev_mb_skipped = mb_skip_run > 0;
+                if (curr_mb_addr + mb_skip_run > ctx.limit_mb_addr)
+                    throw std::runtime_error("mb_skip_run out of range");
                 for (uint64_t i = 0; i < mb_skip_run; i++) {
-                    std::shared_ptr<MacroBlock> block = make_shared<MacroBlock>
-                            (ctx, false, curr_mb_addr);
-                    ctx.mb_array[curr_mb_addr++] = block;
+                    ctx.mb_array[curr_mb_addr].reset(ctx, false, curr_mb_addr);
+                    curr_mb_addr++;
                     // curr_mb_addr = next_mb_addr(curr_mb_addr, ctx);
                 }
+                /* handed over as a whole, so that the listener can take
+                 * shortcuts over the run */
+                if (mb_skip_run > 0 && ctx.listener)
+                    ctx.listener->on_skip_run(ctx, curr_mb_addr - mb_skip_run,
+                                              mb_skip_run);
                 if (mb_skip_run > 0)
                     more_data_flag = more_rbsp_data(br);
             } else {
@@ -492,28 +628,32 @@ void SliceData::parse(ParserContext & ctx, BitReader &br) {
                                      || (curr_mb_addr % 2 == 1
                                          && prev_mb_skipped)))
                 mb_field_decoding_flag = br.read_bit_as_bool();
-            std::shared_ptr<MacroBlock> block = make_shared<MacroBlock>
-                    (ctx, mb_field_decoding_flag, curr_mb_addr);
-            ctx.mb = block;
-            ctx.mb_array[curr_mb_addr++] = block;
+            if (curr_mb_addr >= ctx.limit_mb_addr)
+                throw std::runtime_error("mb_addr out of range");
+            MacroBlock & block = ctx.mb_array[curr_mb_addr];
+            block.reset(ctx, mb_field_decoding_flag, curr_mb_addr);
+            ctx.mb = &block;
+            curr_mb_addr++;
             ctx.mb->parse(ctx, br);
+            if (ctx.listener)
+                ctx.listener->on_macroblock(ctx, block);
         }
-        if (!pps->entropy_coding_mode_flag()) {
+        if (!pps.entropy_coding_mode_flag()) {
             more_data_flag = more_rbsp_data(br);
         } else {
             throw NotImplemented("entropy_coding_mode_flag");
         }
         // curr_mb_addr = next_mb_addr(curr_mb_addr,ctx);
     } while (more_data_flag);
-    /* sanity check */
-    if (curr_mb_addr != ctx.PicSizeInMbs())
-        throw std::runtime_error("slice data parsing unfinished");
+    /* whether the slices cover the picture is up to the caller, which sees
+     * all of them */
+    ctx.end_mb_addr = curr_mb_addr;
 }
 
 uint64_t SliceData::next_mb_addr(uint64_t n, ParserContext &) {
-    // std::shared_ptr<SPS_NALUnit> sps = ctx.sps;
-    // std::shared_ptr<PPS_NALUnit> pps = ctx.pps;
-    // std::shared_ptr<SliceHeader> header = ctx.header();
+    // const SPS_NALUnit & sps = ctx.sps;
+    // const PPS_NALUnit & pps = ctx.pps;
+    // const SliceHeader * header = ctx.header();
     /* Based on eqn 7-24 -> 7-28 and 8-16 */
     // uint64_t i = n + 1;
     // std::vector<uint64_t> MbToSliceGroupMap = slice_group_map(sps, pps);
@@ -526,43 +666,43 @@ uint64_t SliceData::next_mb_addr(uint64_t n, ParserContext &) {
 
 
 std::vector<uint64_t> SliceData::slice_group_map(
-        std::shared_ptr<SPS_NALUnit> sps, std::shared_ptr<PPS_NALUnit> pps) {
-    uint64_t PicHeightInMapUnits = sps->pic_height_in_map_units_minus1() + 1;
-    uint64_t PicWidthInMbs = sps->pic_width_in_mbs_minus1() + 1;
+        const SPS_NALUnit & sps, const PPS_NALUnit & pps) {
+    uint64_t PicHeightInMapUnits = sps.pic_height_in_map_units_minus1() + 1;
+    uint64_t PicWidthInMbs = sps.pic_width_in_mbs_minus1() + 1;
     uint64_t PicSizeInMapUnits = PicWidthInMbs * PicHeightInMapUnits;
     uint64_t i = 0;
     std::vector<uint64_t> mapUnitToSliceGroupMap(PicSizeInMapUnits);
 
-    uint64_t num_slice_groups = pps->num_slice_groups_minus1() + 1;
+    uint64_t num_slice_groups = pps.num_slice_groups_minus1() + 1;
     if (num_slice_groups == 1) {
         for (i = 0; i < PicSizeInMapUnits; i++)
             mapUnitToSliceGroupMap[i] = 0;
         return mapUnitToSliceGroupMap;
     }
-    if (pps->slice_group_map_type() == 0) {
+    if (pps.slice_group_map_type() == 0) {
         do {
             for (uint64_t iGroup = 0; iGroup <= num_slice_groups
                                       && i < PicSizeInMapUnits;
-                 i += pps->run_length_minus1()[iGroup++] + 1) {
-                for (uint64_t j = 0; j <= pps->run_length_minus1()[iGroup]
+                 i += pps.run_length_minus1()[iGroup++] + 1) {
+                for (uint64_t j = 0; j <= pps.run_length_minus1()[iGroup]
                                      && i + j < PicSizeInMapUnits; j++)
                     mapUnitToSliceGroupMap[i + j] = iGroup;
             }
         } while (i < PicSizeInMapUnits);
-    } else if (pps->slice_group_map_type() == 1) {
+    } else if (pps.slice_group_map_type() == 1) {
         for (i = 0; i < PicSizeInMapUnits; i++ )
             mapUnitToSliceGroupMap[i] = ((i % PicWidthInMbs) +
                     (((i / PicWidthInMbs) * num_slice_groups) / 2))
                                         % num_slice_groups;
-    } else if (pps->slice_group_map_type() == 2) {
+    } else if (pps.slice_group_map_type() == 2) {
         for (i = 0; i < PicSizeInMapUnits; i++)
             mapUnitToSliceGroupMap[i] = num_slice_groups - 1;
         for (int iGroup = static_cast<int>(num_slice_groups) - 2;
              iGroup >= 0; iGroup--) {
-            uint64_t yTopLeft = pps->top_left()[iGroup] / PicWidthInMbs;
-            uint64_t xTopLeft = pps->top_left()[iGroup] % PicWidthInMbs;
-            uint64_t yBottomRight = pps->bottom_right()[iGroup] / PicWidthInMbs;
-            uint64_t xBottomRight = pps->bottom_right()[iGroup] % PicWidthInMbs;
+            uint64_t yTopLeft = pps.top_left()[iGroup] / PicWidthInMbs;
+            uint64_t xTopLeft = pps.top_left()[iGroup] % PicWidthInMbs;
+            uint64_t yBottomRight = pps.bottom_right()[iGroup] / PicWidthInMbs;
+            uint64_t xBottomRight = pps.bottom_right()[iGroup] % PicWidthInMbs;
             for (uint64_t y = yTopLeft; y <= yBottomRight; y++)
                 for (uint64_t x = xTopLeft; x <= xBottomRight; x++)
                     mapUnitToSliceGroupMap[y * PicWidthInMbs + x] =
@@ -573,46 +713,67 @@ std::vector<uint64_t> SliceData::slice_group_map(
 }
 
 MacroBlock::MacroBlock(bool mb_field_decoding_flag, uint64_t curr_mb_addr)
-        : mb_pred(), sub_mb_preds(),
-          mb_field_decoding_flag(mb_field_decoding_flag),
-          mb_addr(curr_mb_addr) {
-    memset(TotalCoeffs_luma, 0, sizeof(int) * 16);
-    memset(TotalCoeffs_chroma, 0, sizeof(int) * 8); /* 4 * 2 */
-    memset(LumaLevel4x4, 0, sizeof(int) * 256); /* 16 * 16 */
-    memset(LumaLevel8x8, 0, sizeof(int) * 256); /* 4 * 64 */
-    memset(Intra16x16DCLevel, 0, sizeof(int) * 16);
-    memset(Intra16x16ACLevel, 0, sizeof(int) * 240); /* 16 * 15 */
-    memset(ChromaDCLevel, 0, sizeof(int) * 8);
-    memset(ChromaACLevel, 0, sizeof(int) * 120); /* 2 * 4 * 15 */
-
-    memset(mvL, 0, sizeof(int) * 64);  /* 2 * 4 * 4 * 2 */
-    memset(predFlagL, 0, sizeof(int) * 8);  /* 2 * 4 */
-    memset(refIdxL, 0, sizeof(int) * 8);  /* 2 * 4 */
+        : mb_pred(), sub_mb_preds() {
+    clear(mb_field_decoding_flag, curr_mb_addr);
 }
 
 MacroBlock::MacroBlock(ParserContext &ctx, bool mb_field_decoding_flag,
-                       uint64_t curr_mb_addr) :
-        MacroBlock(mb_field_decoding_flag, curr_mb_addr) {
+                       uint64_t curr_mb_addr) : mb_pred(), sub_mb_preds() {
+    reset(ctx, mb_field_decoding_flag, curr_mb_addr);
+}
+
+void MacroBlock::reset(ParserContext &ctx, bool mb_field_decoding_flag,
+                       uint64_t curr_mb_addr) {
+    clear(mb_field_decoding_flag, curr_mb_addr);
+    coefficients = ctx.mb_array.coefficients(curr_mb_addr);
+    if (coefficients)
+        memset(coefficients, 0, sizeof(MacroBlockCoefficients));
     /* compute neighbours */
     compute_mb_neighbours(ctx);
-    assign_pos(ctx);
+}
+
+void MacroBlock::clear(bool mb_field_decoding_flag, uint64_t curr_mb_addr) {
+    mb_type = P_Skip;
+    transform_size_8x8_flag = false;
+    sub_mb_preds.clear();
+    /* keeps the capacity around for the next picture */
+    residual.residual_blocks.clear();
+    this->mb_field_decoding_flag = mb_field_decoding_flag;
+    mb_qp_delta = 0;
+    mb_addr = curr_mb_addr;
+    mbAddrA = mbAddrB = mbAddrC = mbAddrD = -1;
+    mbPartIdxA = mbPartIdxB = mbPartIdxC = mbPartIdxD = -1;
+    CodedBlockPatternLuma = 0;
+    CodedBlockPatternChroma = 0;
+    slice_type = 0;
+    _pos_x = _pos_y = 0;
+
+    memset(TotalCoeffs_luma, 0, sizeof(TotalCoeffs_luma));
+    memset(TotalCoeffs_chroma, 0, sizeof(TotalCoeffs_chroma));
+    coefficients = nullptr;
+
+    memset(mvL, 0, sizeof(mvL));
+    memset(predFlagL, 0, sizeof(predFlagL));
+    memset(refIdxL, 0, sizeof(refIdxL));
+    memset(mbPartIdxTable, 0, sizeof(mbPartIdxTable));
 }
 
 void MacroBlock::parse(ParserContext & ctx, BitReader &br) {
-    std::shared_ptr<SPS_NALUnit> sps = ctx.sps;
-    std::shared_ptr<PPS_NALUnit> pps = ctx.pps;
-    std::shared_ptr<SliceHeader> header = ctx.header();
+    const SPS_NALUnit & sps = ctx.sps;
+    const PPS_NALUnit & pps = ctx.pps;
+    const SliceHeader * header = ctx.header();
     slice_type = header->slice_type;
+    mb_pred = MbPred();
 
     mb_type = br.read_ue();
     if (mb_type == I_PCM) {
         br.set_bit_pos(0);
-        uint64_t bit_depth_luma = 8 + sps->bit_depth_luma_minus8();
+        uint64_t bit_depth_luma = 8 + sps.bit_depth_luma_minus8();
         /* PCM luma */
         for (int i = 0; i < 256; i++) {
             br.read_bits(bit_depth_luma);
         }
-        uint64_t bit_depth_chroma = 8 + sps->bit_depth_chroma_minus8();
+        uint64_t bit_depth_chroma = 8 + sps.bit_depth_chroma_minus8();
         /* PCM chroma */
         for (uint32_t i = 0; i < 2 * ctx.MbWidthC() * ctx.MbHeightC(); i++)
             br.read_bits(bit_depth_chroma);
@@ -626,19 +787,18 @@ void MacroBlock::parse(ParserContext & ctx, BitReader &br) {
             for (int mbPartIdx = 0; mbPartIdx < 4; mbPartIdx++) {
                 if (sub_mb_pred.sub_mb_type[mbPartIdx] != B_Direct_8x8)
                     noSubMbPartSizeLessThan8x8Flag = false;
-                else if (!sps->direct_8x8_inference_flag())
+                else if (!sps.direct_8x8_inference_flag())
                     noSubMbPartSizeLessThan8x8Flag = false;
             }
         } else {
-            if (pps->transform_8x8_mode_flag() && mb_type == I_NxN) {
+            if (pps.transform_8x8_mode_flag() && mb_type == I_NxN) {
                 /* Note: this is only true for !entropy */
-                if (pps->entropy_coding_mode_flag())
+                if (pps.entropy_coding_mode_flag())
                     throw NotImplemented("entropy_coding_mode not implemented");
                 transform_size_8x8_flag = br.read_bit_as_bool();
             }
             // mb_pred
-            mb_pred = std::make_unique<MbPred>();
-            mb_pred->parse(ctx, br);
+            mb_pred.parse(ctx, br);
         }
 
         if (MbPartPredMode(mb_type, 0, header->slice_type) != Intra_16x16) {
@@ -654,10 +814,10 @@ void MacroBlock::parse(ParserContext & ctx, BitReader &br) {
             CodedBlockPatternChroma = coded_block_pattern / 16;
 
             if (CodedBlockPatternLuma > 0 &&
-                pps->transform_8x8_mode_flag() && mb_type != I_NxN &&
+                pps.transform_8x8_mode_flag() && mb_type != I_NxN &&
                 noSubMbPartSizeLessThan8x8Flag &&
                 (mb_type != B_Direct_16x16
-                 || sps->direct_8x8_inference_flag())) {
+                 || sps.direct_8x8_inference_flag())) {
                 transform_size_8x8_flag = br.read_bit_as_bool();
             }
         } else if (header->slice_type == SliceType::TYPE_I && mb_type > 4) {
@@ -682,65 +842,98 @@ void MacroBlock::parse(ParserContext & ctx, BitReader &br) {
                 is_intra) {
             mb_qp_delta = br.read_se();
             /* residual here */
-            residual = std::make_unique<Residual>(0, 15);
-            residual->parse(ctx, br);
+            residual.parse(ctx, br);
         }
     }
     /* based on mb_type */
     compute_mb_index(ctx);
 }
 
-void MacroBlock::compute_mb_neighbours(ParserContext &ctx) {
-    std::shared_ptr<SPS_NALUnit> sps = ctx.sps;
-    uint64_t PicWidthInMbs = sps->pic_width_in_mbs_minus1() + 1;
-    if (mb_addr % PicWidthInMbs != 0)
-        mbAddrA = mb_addr - 1;
-    else
-        mbAddrA = -1;
+void MacroBlockListener::on_skip_run(ParserContext &ctx,
+                                     uint64_t first_mb_addr,
+                                     uint64_t mb_skip_run) {
+    for (uint64_t i = 0; i < mb_skip_run; i++)
+        on_macroblock(ctx, ctx.mb_array[first_mb_addr + i]);
+}
 
-    if (mb_addr >= PicWidthInMbs)
-        mbAddrB = mb_addr - PicWidthInMbs;
-    else
-        mbAddrB = -1;
-    if (mb_addr >= PicWidthInMbs &&
-        (mb_addr + 1) % PicWidthInMbs != 0) {
-        mbAddrC = mb_addr - PicWidthInMbs + 1;
-    } else {
-        mbAddrC = -1;
+void MbNeighbourTable::resize(uint64_t pic_width_in_mbs, uint64_t num_mbs) {
+    if (width_ == pic_width_in_mbs && entries_.size() == num_mbs)
+        return;
+    width_ = pic_width_in_mbs;
+    entries_.resize(num_mbs);
+    for (uint64_t mb_addr = 0; mb_addr < num_mbs; mb_addr++) {
+        MbNeighbours & n = entries_[mb_addr];
+        uint64_t x = mb_addr % pic_width_in_mbs;
+        uint64_t y = mb_addr / pic_width_in_mbs;
+        auto addr = static_cast<int64_t>(mb_addr);
+        auto width = static_cast<int64_t>(pic_width_in_mbs);
+        n.mbAddrA = x > 0 ? addr - 1 : -1;
+        n.mbAddrB = y > 0 ? addr - width : -1;
+        n.mbAddrC = y > 0 && x + 1 < pic_width_in_mbs ? addr - width + 1 : -1;
+        n.mbAddrD = y > 0 && x > 0 ? addr - width - 1 : -1;
+        n.pos_x = static_cast<uint32_t>(x);
+        n.pos_y = static_cast<uint32_t>(y);
     }
-    if (mb_addr > PicWidthInMbs &&
-        mb_addr % PicWidthInMbs != 0) {
-        mbAddrD = mb_addr - PicWidthInMbs - 1;
-    } else {
-        mbAddrD = -1;
+}
+
+/* mbPartIdx of every 4x4 luma block, indexed by x and y, for each mb_type.
+ * blocks not covered by a partition, which is the case for intra types,
+ * keep mbPartIdx 0. note that all four 8x8 partitions of P_8x8 are written
+ * to the top left corner, so it ends up as 3 there.
+ */
+struct MbPartIdxTables {
+    uint8_t entries[32][4][4];
+};
+
+static constexpr MbPartIdxTables build_mb_part_idx_tables() {
+    MbPartIdxTables tables {};
+    for (uint32_t mb_type = 0; mb_type < 32; mb_type++) {
+        uint32_t numMbPart = P_and_SP_macroblock_modes[mb_type][2];
+        uint32_t width = P_and_SP_macroblock_modes[mb_type][5];
+        uint32_t height = P_and_SP_macroblock_modes[mb_type][6];
+        for (uint32_t mbPartIdx = 0; mbPartIdx < numMbPart; mbPartIdx++) {
+            uint32_t x = 0, y = 0;
+            if (numMbPart == 2) {
+                if (width == 8)
+                    x = 8 * mbPartIdx;
+                else
+                    y = 8 * mbPartIdx;
+            }
+            /* minimum is 4 x 4 pixel block */
+            for (uint32_t j = 0; j < height / 4; j++) {
+                for (uint32_t i = 0; i < width / 4; i++) {
+                    tables.entries[mb_type][x / 4 + i][y / 4 + j] =
+                            static_cast<uint8_t>(mbPartIdx);
+                }
+            }
+        }
     }
+    return tables;
+}
+
+static constexpr MbPartIdxTables mb_part_idx_tables =
+        build_mb_part_idx_tables();
+
+void MacroBlock::compute_mb_neighbours(ParserContext &ctx) {
+    if (mb_addr >= ctx.mb_neighbours.size())
+        throw std::runtime_error("mb_addr out of range");
+    const MbNeighbours & n = ctx.mb_neighbours[mb_addr];
+    /* a neighbour in an earlier slice is not available, 6.4.8. -1 stays -1 */
+    const auto first_mb_addr = static_cast<int64_t>(ctx.first_mb_addr);
+    mbAddrA = n.mbAddrA >= first_mb_addr ? n.mbAddrA : -1;
+    mbAddrB = n.mbAddrB >= first_mb_addr ? n.mbAddrB : -1;
+    mbAddrC = n.mbAddrC >= first_mb_addr ? n.mbAddrC : -1;
+    mbAddrD = n.mbAddrD >= first_mb_addr ? n.mbAddrD : -1;
+    _pos_x = n.pos_x;
+    _pos_y = n.pos_y;
     /* will be overridden for non-skipped mb */
     compute_mb_index(ctx);
 }
 
 void MacroBlock::compute_mb_index(ParserContext &ctx) {
     /* compute MbPartIdx table */
-    uint64_t numMbPart = NumMbPart(mb_type);
-    // if (numMbPart == 4)
-    //     throw NotImplemented("numMbPart == 4");
-    for (uint32_t mbPartIdx = 0; mbPartIdx < numMbPart; mbPartIdx++) {
-        int x = 0; int y = 0;
-        if (numMbPart == 2) {
-            if (MbPartWidth(mb_type) == 8) {
-                x = 8; y = 0;
-            } else {
-                x = 0; y = 8;
-            }
-        }
-        x /= 4;
-        y /= 4;
-        /* minimum is 4 x 4 pixel block */
-        for (uint32_t j = 0; j < MbPartHeight(mb_type) / 4; j++) {
-            for (uint32_t i = 0; i < MbPartWidth(mb_type) / 4; i++) {
-                mbPartIdxTable[x + i][y + j] = mbPartIdx;
-            }
-        }
-    }
+    memcpy(mbPartIdxTable, mb_part_idx_tables.entries[mb_type],
+           sizeof(mbPartIdxTable));
 
     int64_t addrs[4] = {mbAddrA, mbAddrB, mbAddrC, mbAddrD};
     int64_t * addr_index[4] =
@@ -748,12 +941,10 @@ void MacroBlock::compute_mb_index(ParserContext &ctx) {
     for (int i = 0; i < 4; i++) {
         int64_t mb_addr = addrs[i];
         if (mb_addr == -1) continue;
-        auto mb = ctx.mb_array[mb_addr];
-        uint64_t x = (mb->_pos_x + 16) % 16;
-        uint64_t y = (mb->_pos_y + 16) % 16;
-        x /= 4;
-        y /= 4;
-        *addr_index[i] = mb->mbPartIdxTable[x][y];
+        MacroBlock & mb = ctx.mb_array[mb_addr];
+        uint64_t x = (mb._pos_x % 16) / 4;
+        uint64_t y = (mb._pos_y % 16) / 4;
+        *addr_index[i] = mb.mbPartIdxTable[x][y];
     }
 
     if ((mb_type == Intra_16x16 || mb_type == Intra_4x4) && mbAddrC == -1) {
@@ -761,29 +952,22 @@ void MacroBlock::compute_mb_index(ParserContext &ctx) {
     }
 }
 
-void MacroBlock::assign_pos(ParserContext & ctx) {
-    uint64_t PicWidthInMbs = ctx.PicWidthInMbs();
-    uint64_t FrameHeightInMbs = ctx.FrameHeightInMbs();
-    if (mb_addr <= (PicWidthInMbs * FrameHeightInMbs)) {
-        _pos_x = mb_addr % PicWidthInMbs;
-        _pos_y = mb_addr / PicWidthInMbs;
-    } else {
-        throw std::runtime_error("mb_addr out of range");
-    }
-}
-
 MbPred::MbPred() {
     for (int i = 0; i < 16; i++) {
         prev_intra4x4_pred_mode_flag[i] = false;
         rem_intra4x4_pred_mode[i] = 0;
     }
+    /* ref_idx is inferred to be 0 when it is not present */
+    memset(ref_idx_l0, 0, sizeof(ref_idx_l0));
+    memset(ref_idx_l1, 0, sizeof(ref_idx_l1));
+    memset(mvd_l0, 0, sizeof(mvd_l0));
+    memset(mvd_l1, 0, sizeof(mvd_l1));
 }
 
 void MbPred::parse(ParserContext &ctx, BitReader &br) {
-    std::shared_ptr<SPS_NALUnit> sps = ctx.sps;
-    std::shared_ptr<PPS_NALUnit> pps = ctx.pps;
-    std::shared_ptr<SliceHeader> header = ctx.header();
-    std::shared_ptr<MacroBlock> mb = ctx.mb;
+    const SPS_NALUnit & sps = ctx.sps;
+    const SliceHeader * header = ctx.header();
+    MacroBlock * mb = ctx.mb;
     auto type = (uint32_t) MbPartPredMode(mb->mb_type, 0, header->slice_type);
 
     /* TODO: Intra_8x8 is not implemented */
@@ -798,7 +982,7 @@ void MbPred::parse(ParserContext &ctx, BitReader &br) {
                 }
             }
         }
-        if (sps->chroma_array_type() == 1 || sps->chroma_array_type() == 2)
+        if (sps.chroma_array_type() == 1 || sps.chroma_array_type() == 2)
             intra_chroma_pred_mode = br.read_ue();
     } else if (MbPartPredMode(mb->mb_type, 0, header->slice_type) != Direct) {
         uint64_t num_mb_part = NumMbPart(mb->mb_type);
@@ -841,10 +1025,8 @@ void MbPred::parse(ParserContext &ctx, BitReader &br) {
 
 
 void SubMbPred::parse(ParserContext &ctx, BitReader &br) {
-    std::shared_ptr<SPS_NALUnit> sps = ctx.sps;
-    std::shared_ptr<PPS_NALUnit> pps = ctx.pps;
-    std::shared_ptr<SliceHeader> header = ctx.header();
-    std::shared_ptr<MacroBlock> mb = ctx.mb;
+    const SliceHeader * header = ctx.header();
+    MacroBlock * mb = ctx.mb;
     uint64_t te0 = header->num_ref_idx_l0_active_minus1 + 1;
     uint64_t te1 = header->num_ref_idx_l1_active_minus1 + 1;
     for (int mbPartIdx = 0; mbPartIdx < 4; mbPartIdx++)
@@ -898,10 +1080,6 @@ void SubMbPred::parse(ParserContext &ctx, BitReader &br) {
 }
 
 void Residual::parse(ParserContext &ctx, BitReader &br) {
-    std::shared_ptr<SPS_NALUnit> sps = ctx.sps;
-    std::shared_ptr<PPS_NALUnit> pps = ctx.pps;
-    std::shared_ptr<SliceHeader> header = ctx.header();
-    std::shared_ptr<MacroBlock> mb = ctx.mb;
     // residual_block_cavlc
     residual_luma(ctx, 0, 15, br);
     residual_chroma(ctx, 0, 15, br);
@@ -909,17 +1087,18 @@ void Residual::parse(ParserContext &ctx, BitReader &br) {
 
 void Residual::residual_luma(ParserContext &ctx, const int startIdx,
                              const int endIdx, BitReader &br) {
-    std::shared_ptr<MacroBlock> mb = ctx.mb;
-    std::shared_ptr<SliceHeader> header = ctx.header();
+    MacroBlock * mb = ctx.mb;
+    /* levels are only stored if the arena keeps coefficients. they start out
+     * zeroed, so blocks that are not coded need no work */
+    MacroBlockCoefficients * c = mb->coefficients;
+    const SliceHeader * header = ctx.header();
     if (startIdx == 0 && MbPartPredMode(mb->mb_type, 0, header->slice_type)
                          == Intra_16x16) {
-        if (ctx.pps->entropy_coding_mode_flag()) {
+        if (ctx.pps.entropy_coding_mode_flag()) {
             throw NotImplemented("entropy_coding_mode_flag");
         } else {
-            auto block = std::make_shared<ResidualBlock>(
-                    0, 15, 16, BlockType::blk_LUMA_16x16_DC, 0);
-            block->parse(ctx,  mb->Intra16x16DCLevel, br);
-            residual_blocks.emplace_back(block);
+            parse_block(ctx, c ? c->Intra16x16DCLevel : nullptr, br, 0, 15,
+                        16, BlockType::blk_LUMA_16x16_DC, 0);
         }
     }
 
@@ -935,70 +1114,51 @@ void Residual::residual_luma(ParserContext &ctx, const int startIdx,
     int blkIdx = 0;
     for (int i8x8 = 0; i8x8 < 4; i8x8++) {
         if (!mb->transform_size_8x8_flag
-            || !ctx.pps->entropy_coding_mode_flag()) {
+            || !ctx.pps.entropy_coding_mode_flag()) {
             for (int i4x4 = 0; i4x4 < 4; i4x4++) {
                 blkIdx = i8x8 * 4 + i4x4;
 
                 if (mb->CodedBlockPatternLuma & (1 << i8x8)) {
                     if (MbPartPredMode(mb->mb_type, 0, header->slice_type)
                         == Intra_16x16) {
-                        if (ctx.pps->entropy_coding_mode_flag()) {
+                        if (ctx.pps.entropy_coding_mode_flag()) {
                             throw NotImplemented("entropy_coding_mode_flag");
                         } else {
-                            auto block = std::make_shared<ResidualBlock>(
-                                    std::max(0, startIdx - 1), endIdx - 1, 15,
-                                    BlockType::blk_LUMA_16x16_AC, blkIdx);
-                            block->parse(ctx, mb->Intra16x16ACLevel[blkIdx],
-                                         br);
-                            residual_blocks.emplace_back(block);
+                            parse_block(ctx, c ? c->Intra16x16ACLevel[blkIdx]
+                                               : nullptr,
+                                        br, std::max(0, startIdx - 1),
+                                        endIdx - 1, 15,
+                                        BlockType::blk_LUMA_16x16_AC, blkIdx);
                         }
                     } else {
-                        if (ctx.pps->entropy_coding_mode_flag()) {
+                        if (ctx.pps.entropy_coding_mode_flag()) {
                             throw NotImplemented("entropy_coding_mode_flag");
                         } else {
-                            auto block = std::make_shared<ResidualBlock>(
-                                    startIdx, endIdx, 16,
-                                    BlockType::blk_LUMA_4x4, blkIdx);
-                            block->parse(ctx, mb->LumaLevel4x4[blkIdx],
-                                         br);
-                            residual_blocks.emplace_back(block);
+                            parse_block(ctx, c ? c->LumaLevel4x4[blkIdx]
+                                               : nullptr,
+                                        br, startIdx, endIdx, 16,
+                                        BlockType::blk_LUMA_4x4, blkIdx);
                         }
                     }
-                } else if (MbPartPredMode(mb->mb_type, 0, header->slice_type)
-                           == 1) {
-                    for (int i = 0; i < 15; i++) {
-                        mb->Intra16x16ACLevel[blkIdx][i] = 0;
-                        mb->TotalCoeffs_luma[blkIdx] = 0;
-                    }
                 } else {
-                    for (int i = 0; i < 16; i++) {
-                        mb->LumaLevel4x4[blkIdx][i] = 0;
-                        mb->TotalCoeffs_luma[blkIdx] = 0;
-                    }
+                    mb->TotalCoeffs_luma[blkIdx] = 0;
                 }
 
-                if (!ctx.pps->entropy_coding_mode_flag() &&
+                if (c && !ctx.pps.entropy_coding_mode_flag() &&
                     mb->transform_size_8x8_flag) {
                     for (int i = 0; i < 16; i++) {
-                        mb->LumaLevel8x8[i8x8][4 * i + i4x4] =
-                                mb->LumaLevel4x4[blkIdx][i];
+                        c->LumaLevel8x8[i8x8][4 * i + i4x4] =
+                                c->LumaLevel4x4[blkIdx][i];
                     }
                 }
             }
         } else if (mb->CodedBlockPatternLuma & (1 << i8x8)) {
-            if (ctx.pps->entropy_coding_mode_flag()) {
+            if (ctx.pps.entropy_coding_mode_flag()) {
                 throw NotImplemented("entropy_coding_mode_flag");
             } else {
-                auto block = std::make_shared<ResidualBlock>(
-                        4 * startIdx, 4 * endIdx + 3, 64,
-                        BlockType::blk_LUMA_8x8, i8x8);
-                block->parse(ctx, mb->LumaLevel8x8[i8x8],
-                             br);
-                residual_blocks.emplace_back(block);
-            }
-        } else {
-            for (int i = 0; i < 64; i++) {
-                mb->LumaLevel8x8[i8x8][i] = 0;
+                parse_block(ctx, c ? c->LumaLevel8x8[i8x8] : nullptr, br,
+                            4 * startIdx, 4 * endIdx + 3, 64,
+                            BlockType::blk_LUMA_8x8, i8x8);
             }
         }
     }
@@ -1006,9 +1166,9 @@ void Residual::residual_luma(ParserContext &ctx, const int startIdx,
 
 void Residual::residual_chroma(ParserContext &ctx, const int startIdx,
                                const int endIdx, BitReader &br) {
-    std::shared_ptr<SPS_NALUnit> sps = ctx.sps;
-    std::shared_ptr<MacroBlock> mb = ctx.mb;
-    std::shared_ptr<SliceHeader> header = ctx.header();
+    const SPS_NALUnit & sps = ctx.sps;
+    MacroBlock * mb = ctx.mb;
+    MacroBlockCoefficients * c = mb->coefficients;
 
     /* FIXME: this is a hack to make it the same with JM reference player */
     bool intra_dc = false;
@@ -1020,25 +1180,18 @@ void Residual::residual_chroma(ParserContext &ctx, const int startIdx,
         intra_dc = true;
     }
 
-    uint64_t chroma_array_type = sps->chroma_array_type();
+    uint64_t chroma_array_type = sps.chroma_array_type();
     if (chroma_array_type == 1 || chroma_array_type == 2) {
         int NumC8x8 = 4 / (ctx.SubWidthC() * ctx.SubHeightC());
         for (int iCbCr = 0; iCbCr < 2; iCbCr++) {
             if ((mb->CodedBlockPatternChroma & 3 || intra_dc) &&
                     (startIdx == 0)) {
-                if (ctx.pps->entropy_coding_mode_flag()) {
+                if (ctx.pps.entropy_coding_mode_flag()) {
                     throw NotImplemented("entropy_coding_mode_flag");
                 } else {
-                    auto block = std::make_shared<ResidualBlock>(
-                            0, 4 * NumC8x8 - 1, 4 * NumC8x8,
-                            BlockType::blk_CHROMA_DC_Cb + iCbCr, 0);
-                    block->parse(ctx, mb->ChromaDCLevel[iCbCr],
-                                 br);
-                    residual_blocks.emplace_back(block);
-                }
-            } else {
-                for (int i = 0; i < (4 * NumC8x8); i++) {
-                    mb->ChromaDCLevel[iCbCr][i] = 0;
+                    parse_block(ctx, c ? c->ChromaDCLevel[iCbCr] : nullptr,
+                                br, 0, 4 * NumC8x8 - 1, 4 * NumC8x8,
+                                BlockType::blk_CHROMA_DC_Cb + iCbCr, 0);
                 }
             }
         }
@@ -1048,20 +1201,16 @@ void Residual::residual_chroma(ParserContext &ctx, const int startIdx,
                 for (int i4x4 = 0; i4x4 < 4; i4x4++) {
                     int blkIdx = i8x8*4 + i4x4;
                     if (mb->CodedBlockPatternChroma & 2 || intra_ac) {
-                        if (ctx.pps->entropy_coding_mode_flag()) {
+                        if (ctx.pps.entropy_coding_mode_flag()) {
                             throw NotImplemented("entropy_coding_mode_flag");
                         } else {
-                            auto block = std::make_shared<ResidualBlock>(
-                                    std::max(0, startIdx - 1), endIdx - 1, 15,
-                                    BlockType::blk_CHROMA_AC_Cb +
-                                            iCbCr, blkIdx);
-                            block->parse(ctx, mb->ChromaACLevel[iCbCr][blkIdx],
-                                         br);
-                            residual_blocks.emplace_back(block);
-                        }
-                    } else {
-                        for (int i = 0; i < 15; i++) {
-                            mb->ChromaACLevel[iCbCr][blkIdx][i] = 0;
+                            parse_block(ctx,
+                                        c ? c->ChromaACLevel[iCbCr][blkIdx]
+                                          : nullptr,
+                                        br, std::max(0, startIdx - 1),
+                                        endIdx - 1, 15,
+                                        BlockType::blk_CHROMA_AC_Cb + iCbCr,
+                                        blkIdx);
                         }
                     }
                 }
@@ -1070,13 +1219,29 @@ void Residual::residual_chroma(ParserContext &ctx, const int startIdx,
     }
 }
 
+void Residual::parse_block(ParserContext &ctx, int *coeffLevel,
+                           BitReader &br, uint32_t start_index,
+                           uint32_t end_index, uint32_t max_num_coeff,
+                           BlockType block_type, uint32_t block_index) {
+    if (ctx.depth == ParseDepth::Full) {
+        residual_blocks.emplace_back(start_index, end_index, max_num_coeff,
+                                     block_type, block_index);
+        residual_blocks.back().parse(ctx, coeffLevel, br);
+    } else {
+        /* the bits still have to be consumed, and TotalCoeff is kept for
+         * the nC prediction of the neighbouring blocks */
+        ResidualBlock block(start_index, end_index, max_num_coeff,
+                            block_type, block_index);
+        block.parse(ctx, nullptr, br);
+    }
+}
+
 // taken from https://github.com/emericg/MiniVideo/
 void ResidualBlock::parse(ParserContext &ctx, int *coeffLevel,
                           BitReader &br) {
-    std::shared_ptr<SPS_NALUnit> sps = ctx.sps;
-    std::shared_ptr<PPS_NALUnit> pps = ctx.pps;
-    std::shared_ptr<SliceHeader> header = ctx.header();
-    std::shared_ptr<MacroBlock> mb = ctx.mb;
+    const SPS_NALUnit & sps = ctx.sps;
+    const SliceHeader * header = ctx.header();
+    MacroBlock * mb = ctx.mb;
     int mbAddrA_temp = -1, mbAddrB_temp = -1;
     int blkA = 0, blkB = 0;
     int nA = 0, nB = 0, nC = 0;  // Number of coefficients (TotalCoeff) in
@@ -1086,7 +1251,7 @@ void ResidualBlock::parse(ParserContext &ctx, int *coeffLevel,
     // levels and trailing ones
     if (block_type == BlockType::blk_CHROMA_DC_Cb
         || block_type == BlockType::blk_CHROMA_DC_Cr) {
-        if (sps->chroma_array_type() == 1)
+        if (sps.chroma_array_type() == 1)
             nC = -1;
         else  // if (dc->ChromaArrayType == 2)
             nC = -2;
@@ -1105,21 +1270,21 @@ void ResidualBlock::parse(ParserContext &ctx, int *coeffLevel,
         }
         if (mbAddrA_temp != -1) {  // 5 6 - A
             if (((header->slice_type == 0 || header->slice_type == 5)
-                 && ctx.mb_array[mbAddrA_temp]->mb_type == P_Skip)
+                 && ctx.mb_array[mbAddrA_temp].mb_type == P_Skip)
                 || ((header->slice_type == 1 || header->slice_type == 6)
-                    && ctx.mb_array[mbAddrA_temp]->mb_type == B_Skip)) {
+                    && ctx.mb_array[mbAddrA_temp].mb_type == B_Skip)) {
                 nA = 0;
             } else if ((header->slice_type == 2 || header->slice_type == 7)
-                       && ctx.mb_array[mbAddrA_temp]->mb_type == I_PCM) {
+                       && ctx.mb_array[mbAddrA_temp].mb_type == I_PCM) {
                 nA = 16;
             } else {
                 if (static_cast<int>(block_type) < 4)
-                    nA = ctx.mb_array[mbAddrA_temp]->TotalCoeffs_luma[blkA];
+                    nA = ctx.mb_array[mbAddrA_temp].TotalCoeffs_luma[blkA];
                 else if (block_type == BlockType::blk_CHROMA_AC_Cb)
-                    nA = ctx.mb_array[mbAddrA_temp]->
+                    nA = ctx.mb_array[mbAddrA_temp].
                             TotalCoeffs_chroma[0][blkA];
                 else if (block_type == BlockType::blk_CHROMA_AC_Cr)
-                    nA = ctx.mb_array[mbAddrA_temp]->
+                    nA = ctx.mb_array[mbAddrA_temp].
                             TotalCoeffs_chroma[1][blkA];
                 else
                     throw NotImplemented("block_type > 5");
@@ -1127,21 +1292,21 @@ void ResidualBlock::parse(ParserContext &ctx, int *coeffLevel,
         }
         if (mbAddrB_temp != -1) {  // 5 6 - B
             if (((header->slice_type == 0 || header->slice_type == 5)
-                 && ctx.mb_array[mbAddrB_temp]->mb_type == P_Skip) ||
+                 && ctx.mb_array[mbAddrB_temp].mb_type == P_Skip) ||
                 ((header->slice_type == 1 || header->slice_type == 6)
-                 && ctx.mb_array[mbAddrB_temp]->mb_type == B_Skip)) {
+                 && ctx.mb_array[mbAddrB_temp].mb_type == B_Skip)) {
                 nB = 0;
             } else if ((header->slice_type == 2 || header->slice_type == 7)
-                     && ctx.mb_array[mbAddrB_temp]->mb_type == I_PCM) {
+                     && ctx.mb_array[mbAddrB_temp].mb_type == I_PCM) {
                 nB = 16;
             } else {
                 if (static_cast<int>(block_type) < 4)
-                    nB = ctx.mb_array[mbAddrB_temp]->TotalCoeffs_luma[blkB];
+                    nB = ctx.mb_array[mbAddrB_temp].TotalCoeffs_luma[blkB];
                 else if (block_type  == BlockType::blk_CHROMA_AC_Cb)
-                    nB = ctx.mb_array[mbAddrB_temp]->
+                    nB = ctx.mb_array[mbAddrB_temp].
                             TotalCoeffs_chroma[0][blkB];
                 else if (block_type  == BlockType::blk_CHROMA_AC_Cr)
-                    nB = ctx.mb_array[mbAddrB_temp]->
+                    nB = ctx.mb_array[mbAddrB_temp].
                             TotalCoeffs_chroma[1][blkB];
                 else
                     throw NotImplemented("block_type > 5");
@@ -1234,11 +1399,14 @@ void ResidualBlock::parse(ParserContext &ctx, int *coeffLevel,
             int vlcnum = TotalCoeffs - 1;
             int total_zeros = 0;
 
+            /* 4:2:2 chroma DC blocks have 8 coefficients and a table of
+             * their own */
             if (block_type != BlockType ::blk_CHROMA_DC_Cb
                 && block_type != BlockType::blk_CHROMA_DC_Cr)
                 total_zeros = read_ce_totalzeros(br, vlcnum, 0);
             else
-                total_zeros = read_ce_totalzeros(br, vlcnum, 1);
+                total_zeros = read_ce_totalzeros(
+                        br, vlcnum, static_cast<int>(sps.chroma_array_type()));
 
             zerosLeft = total_zeros;
         } else {
@@ -1258,6 +1426,8 @@ void ResidualBlock::parse(ParserContext &ctx, int *coeffLevel,
         }
 
         // Decoded coefficients :
+        if (!coeffLevel)
+            return;
         run[TotalCoeffs - 1] = zerosLeft;
         int coeffNum = -1;
         for (int i = TotalCoeffs - 1; i >= 0; i--) {
@@ -1267,77 +1437,84 @@ void ResidualBlock::parse(ParserContext &ctx, int *coeffLevel,
     }
 }
 
-void ResidualBlock::deriv_4x4lumablocks(ParserContext &ctx,
-                                        const int luma4x4BlkIdx,
-                                        int &mbAddrA, int &luma4x4BlkIdxA,
-                                        int &mbAddrB, int &luma4x4BlkIdxB) {
-    int x = 0, y = 0;
-    InverseLuma4x4BlkScan(luma4x4BlkIdx, x, y);
+/* neighbouring 4x4 blocks A (left) and B (above) of each 4x4 block, after
+ * 6.4.11.4 and 6.4.11.5. they lie either in the current macroblock or in
+ * mbAddrA / mbAddrB, and their index only depends on the block index and
+ * the block size of the component, so the tables are built at compile time.
+ */
+struct BlockNeighbour {
+    bool in_current;
+    uint8_t blk_idx;
+};
+
+struct BlockNeighbourTable {
+    BlockNeighbour a[16];
+    BlockNeighbour b[16];
+};
+
+static constexpr int luma4x4_index(const int xP, const int yP) {
+    return 8 * (yP / 8) + 4 * (xP / 8) + 2 * ((yP % 8) / 4) + ((xP % 8) / 4);
+}
 
-    int xA = x - 1;
-    int yA = y;
+/* this is not the same equation as in 6.4.12.2, but it is what the parser
+ * always used. the neighbour positions are never negative, so rounding is
+ * done in integers */
+static constexpr int chroma4x4_index(const int xP, const int yP) {
+    return 2 * ((yP + 4) / 8) + (xP + 4) / 8;
+}
 
-    int xB = x;
-    int yB = y - 1;
+static constexpr BlockNeighbourTable build_luma_neighbours() {
+    BlockNeighbourTable table {};
+    for (int idx = 0; idx < 16; idx++) {
+        int x = InverseRasterScan_x(idx / 4, 8, 8, 16)
+                + InverseRasterScan_x(idx % 4, 4, 4, 8);
+        int y = InverseRasterScan_y(idx / 4, 8, 8, 16)
+                + InverseRasterScan_y(idx % 4, 4, 4, 8);
+        table.a[idx] = {x > 0, static_cast<uint8_t>(
+                luma4x4_index((x + 15) % 16, y))};
+        table.b[idx] = {y > 0, static_cast<uint8_t>(
+                luma4x4_index(x, (y + 15) % 16))};
+    }
+    return table;
+}
 
-    int xW = 0, yW = 0;
+/* chroma blocks are 8 wide, and 8 (4:2:0) or 16 (4:2:2) high */
+static constexpr BlockNeighbourTable build_chroma_neighbours(int max_h) {
+    BlockNeighbourTable table {};
+    for (int idx = 0; idx < 2 * max_h / 4; idx++) {
+        int x = InverseRasterScan_x(idx, 4, 4, 8);
+        int y = InverseRasterScan_y(idx, 4, 4, 8);
+        table.a[idx] = {x > 0, static_cast<uint8_t>(
+                chroma4x4_index((x + 7) % 8, y))};
+        table.b[idx] = {y > 0, static_cast<uint8_t>(
+                chroma4x4_index(x, (y + max_h - 1) % max_h))};
+    }
+    return table;
+}
 
-    // luma4x4BlkIdxA derivation
-    deriv_neighbouringlocations(ctx, true, xA, yA, mbAddrA, xW, yW);
-    if (mbAddrA > -1)
-        luma4x4BlkIdxA = deriv_4x4lumablock_indices(xW, yW);
-    else
-        luma4x4BlkIdxA = -1;
+static constexpr BlockNeighbourTable luma_neighbours = build_luma_neighbours();
+static constexpr BlockNeighbourTable chroma_neighbours[2] = {
+        build_chroma_neighbours(8), build_chroma_neighbours(16)};
+
+static inline void lookup_block_neighbours(const BlockNeighbourTable &table,
+                                           const MacroBlock & mb,
+                                           const int blkIdx,
+                                           int &mbAddrA, int &blkIdxA,
+                                           int &mbAddrB, int &blkIdxB) {
+    const BlockNeighbour & a = table.a[blkIdx];
+    mbAddrA = static_cast<int>(a.in_current ? mb.mb_addr : mb.mbAddrA);
+    blkIdxA = mbAddrA > -1 ? a.blk_idx : -1;
+    const BlockNeighbour & b = table.b[blkIdx];
+    mbAddrB = static_cast<int>(b.in_current ? mb.mb_addr : mb.mbAddrB);
+    blkIdxB = mbAddrB > -1 ? b.blk_idx : -1;
+}
 
-    // luma4x4BlkIdxB derivation
-    deriv_neighbouringlocations(ctx, true, xB, yB, mbAddrB, xW, yW);
-    if (mbAddrB > -1)
-        luma4x4BlkIdxB = deriv_4x4lumablock_indices(xW, yW);
-    else
-        luma4x4BlkIdxB = -1;
-}
-
-inline void ResidualBlock::InverseLuma4x4BlkScan(const int luma4x4BlkIdx,
-                                                 int &x, int &y) {
-    x = InverseRasterScan_x(luma4x4BlkIdx / 4, 8, 8, 16)
-        + InverseRasterScan_x(luma4x4BlkIdx % 4, 4, 4, 8);
-    y = InverseRasterScan_y(luma4x4BlkIdx / 4, 8, 8, 16)
-        + InverseRasterScan_y(luma4x4BlkIdx % 4, 4, 4, 8);
-}
-
-void ResidualBlock::deriv_neighbouringlocations(ParserContext &ctx,
-                                                const bool lumaBlock,
-                                                const int xN, const int yN,
-                                                int &mbAddrN, int &xW,
-                                                int &yW) {
-    std::shared_ptr<MacroBlock> mb = ctx.mb;
-    int maxW = 16;
-    int maxH = 16;
-    if (!lumaBlock) {
-        maxW = ctx.MbWidthC();
-        maxH = ctx.MbHeightC();
-    }
-    // Checking neighbour's availability with neighbourmacroblock_availability()
-    // Now use info contained in each macroblock, to avoid useless computation
-
-    // Specification of mbAddrN (Table 6-3 with optimizations)
-    if (yN > -1) {
-        if (xN < 0)
-            mbAddrN = static_cast<int>(mb->mbAddrA);
-        else if (xN < maxW)
-            mbAddrN = static_cast<int>(mb->mb_addr);
-        else
-            return;
-    } else {
-        if (xN < 0)
-            mbAddrN = static_cast<int>(mb->mbAddrD);
-        else if (xN < maxW)
-            mbAddrN = static_cast<int>(mb->mbAddrB);
-        else
-            mbAddrN = static_cast<int>(mb->mbAddrC);
-    }
-    xW = (xN + maxW) % maxW;
-    yW = (yN + maxH) % maxH;
+void ResidualBlock::deriv_4x4lumablocks(ParserContext &ctx,
+                                        const int luma4x4BlkIdx,
+                                        int &mbAddrA, int &luma4x4BlkIdxA,
+                                        int &mbAddrB, int &luma4x4BlkIdxB) {
+    lookup_block_neighbours(luma_neighbours, *ctx.mb, luma4x4BlkIdx,
+                            mbAddrA, luma4x4BlkIdxA, mbAddrB, luma4x4BlkIdxB);
 }
 
 void ResidualBlock::deriv_4x4chromablocks(ParserContext &ctx,
@@ -1345,48 +1522,28 @@ void ResidualBlock::deriv_4x4chromablocks(ParserContext &ctx,
                                           int &mbAddrA, int &chroma4x4BlkIdxA,
                                           int &mbAddrB,
                                           int &chroma4x4BlkIdxB) {
-    int x = InverseRasterScan_x(chroma4x4BlkIdx, 4, 4, 8);
-    int y = InverseRasterScan_y(chroma4x4BlkIdx, 4, 4, 8);
-    int xA = x - 1;
-    int yA = y;
-
-    int xB = x;
-    int yB = y - 1;
-
-    int xW = 0, yW = 0;
-
-    // chroma4x4BlkIdxA derivation
-    deriv_neighbouringlocations(ctx, false, xA, yA, mbAddrA, xW, yW);
-    if (mbAddrA > -1)
-        chroma4x4BlkIdxA = deriv_4x4chromablock_indices(xW, yW);
-    else
-        chroma4x4BlkIdxA = -1;
-
-    // chroma4x4BlkIdxB derivation
-    deriv_neighbouringlocations(ctx, false, xB, yB, mbAddrB, xW, yW);
-    if (mbAddrB > -1)
-        chroma4x4BlkIdxB = deriv_4x4chromablock_indices(xW, yW);
-    else
-        chroma4x4BlkIdxB = -1;
+    lookup_block_neighbours(chroma_neighbours[ctx.MbHeightC() == 16],
+                            *ctx.mb, chroma4x4BlkIdx, mbAddrA,
+                            chroma4x4BlkIdxA, mbAddrB, chroma4x4BlkIdxB);
 }
 
-uint32_t ParserContext::SubHeightC() {
-    if (sps->chroma_format_idc() == 1)
+uint32_t ParserContext::SubHeightC() const {
+    if (sps.chroma_format_idc() == 1)
         return 2;
-    else if (sps->chroma_format_idc() == 2)
+    else if (sps.chroma_format_idc() == 2)
         return 1;
-    else if (sps->chroma_format_idc() == 3 &&
-             !sps->separate_colour_plane_flag())
+    else if (sps.chroma_format_idc() == 3 &&
+             !sps.separate_colour_plane_flag())
         return 1;
     else
         throw std::runtime_error("unsupported SubHeightC");
 }
 
-uint32_t ParserContext::SubWidthC() {
-    if (sps->chroma_format_idc() == 1 || sps->chroma_format_idc() == 2)
+uint32_t ParserContext::SubWidthC() const {
+    if (sps.chroma_format_idc() == 1 || sps.chroma_format_idc() == 2)
         return 2;
-    else if (sps->chroma_format_idc() == 3 &&
-             sps->separate_colour_plane_flag())
+    else if (sps.chroma_format_idc() == 3 &&
+             sps.separate_colour_plane_flag())
         return 1;
     else
         throw std::runtime_error("unsupported SubWidthC");
@@ -1394,17 +1551,23 @@ uint32_t ParserContext::SubWidthC() {
 
 void ParserContext::set_header(std::shared_ptr<SliceHeader> header) {
     _header = std::move(header);
-    mb_array = std::vector<std::shared_ptr<MacroBlock>>(PicSizeInMbs());
+    bool mbaff_frame_flag = sps.mb_adaptive_frame_field_flag()
+                            && !_header->field_pic_flag;
+    first_mb_addr = _header->first_mb_in_slice * (1 + mbaff_frame_flag);
+    end_mb_addr = first_mb_addr;
+    limit_mb_addr = PicSizeInMbs();
+    mb_array.resize(PicSizeInMbs(), depth == ParseDepth::Full);
+    mb_neighbours.resize(PicWidthInMbs(), PicSizeInMbs());
 }
 
-uint32_t ParserContext::Height() {
+uint32_t ParserContext::Height() const {
     return (uint32_t)((FrameHeightInMbs() * 16)
-                      - (sps->frame_crop_top_offset() * 2)
-                      - (sps->frame_crop_bottom_offset() * 2));
+                      - (sps.frame_crop_top_offset() * 2)
+                      - (sps.frame_crop_bottom_offset() * 2));
 }
 
-uint32_t ParserContext::Width() {
+uint32_t ParserContext::Width() const {
     return (uint32_t)((PicWidthInMbs() * 16)
-                      - sps->frame_crop_right_offset() * 2
-                      - sps->frame_crop_left_offset()*2);
+                      - sps.frame_crop_right_offset() * 2
+                      - sps.frame_crop_left_offset()*2);
 }
@@ -19,6 +19,7 @@
 
 
 #include <string>
+#include <string_view>
 #include <memory>
 #include <vector>
 #include <cmath>
@@ -50,34 +51,68 @@ inline BlockType operator+(BlockType block, int i) {
     return static_cast<BlockType>(result);
 }
 
+/* how much of a slice is parsed. every depth below Full still consumes the
+ * whole slice data, but skips the work its callers do not need:
+ *  - Header: the slice header only, no macroblocks
+ *  - MbType: macroblock layer without coefficient storage
+ *  - MotionVector: MbType plus motion vector prediction
+ *  - Full: everything, including residual blocks. coefficient levels are
+ *    stored if the MacroBlockArena keeps them
+ */
+enum class ParseDepth {
+    Header       = 0,
+    MbType       = 1,
+    MotionVector = 2,
+    Full         = 3
+};
+
 class NALUnit {
 public:
+    /* owns a copy of the unit */
     explicit NALUnit(std::string data, bool unescape = true);
+    /* non-owning: data has to outlive the unit. the payload is only copied
+     * when emulation prevention bytes have to be removed */
+    explicit NALUnit(std::string_view data, bool unescape = true);
     NALUnit(BinaryReader & br, uint32_t size) : NALUnit(br, size, true) {}
-    NALUnit(BinaryReader & br, uint32_t size, bool unescape);
-    NALUnit(NALUnit & unit): _nal_ref_idc(unit._nal_ref_idc),
-                                      _nal_unit_type(unit._nal_unit_type),
-                                      _data(unit._data) { parse(); }
+    NALUnit(BinaryReader & br, uint32_t size, bool unescape)
+            : NALUnit(br.read_bytes(size), unescape) {}
+    NALUnit(const NALUnit & unit);
+    NALUnit & operator=(const NALUnit &) = delete;
 
     uint8_t nal_ref_idc() const { return _nal_ref_idc; }
     uint8_t  nal_unit_type() const { return _nal_unit_type; }
     uint32_t size() { return static_cast<uint32_t>(_data.length() + 1); }
 
     bool idr_pic_flag() const { return _nal_unit_type == 5; }
-    /* TODO: fix this */
-    const std::string data() const { return _data; }
+    /* payload after the header. valid as long as the unit (and, for
+     * non-owning units, the underlying data) */
+    std::string_view data() const { return _data; }
+    /* true if data() still contains emulation prevention bytes */
+    bool escaped() const { return _escaped; }
 
     virtual ~NALUnit() = default;
 
 protected:
     uint8_t _nal_ref_idc;
     uint8_t _nal_unit_type;
-    std::string _data;
+    std::string_view _data;
+    bool _escaped = false;
+
+    /* empty until assign() is called */
+    NALUnit() : _nal_ref_idc(), _nal_unit_type(), _data(), _buffer() {}
+    /* points a non-owning unit at new data. the backing storage is reused */
+    void assign(std::string_view data, bool unescape);
 
     virtual void parse() {}
 
 private:
-    void decode_header(BinaryReader & br);
+    /* backing storage, only used by owning units and unescaped payloads.
+     * _data is always a suffix of it when _owned is set */
+    std::string _buffer;
+    bool _owned = false;
+
+    void set_payload(std::string_view data, bool unescape);
+    void decode_header(uint8_t header);
 
 };
 
@@ -107,12 +142,12 @@ public:
     { return log2_max_pic_order_cnt_lsb_minus4_; }
     bool delta_pic_order_always_zero_flag() const
     { return delta_pic_order_always_zero_flag_; }
-    int64_t offset_for_non_ref_pic() { return offset_for_non_ref_pic_; }
+    int64_t offset_for_non_ref_pic() const { return offset_for_non_ref_pic_; }
     int64_t offset_for_top_to_bottom_field() const
     { return offset_for_top_to_bottom_field_; }
     uint64_t num_ref_frames_in_pic_order_cnt_cycle() const
     { return num_ref_frames_in_pic_order_cnt_cycle_; }
-    std::vector<uint64_t> offset_for_ref_frame() const
+    const std::vector<uint64_t> & offset_for_ref_frame() const
     { return offset_for_ref_frame_; }
     uint64_t max_num_ref_frames() const { return max_num_ref_frames_; }
     bool gaps_in_frame_num_value_allowed_flag() const
@@ -193,17 +228,19 @@ public:
     uint64_t num_slice_groups_minus1() const
     { return num_slice_groups_minus1_; }
     uint64_t slice_group_map_type() const { return slice_group_map_type_; }
-    std::vector<uint64_t> run_length_minus1() const
+    const std::vector<uint64_t> & run_length_minus1() const
     { return run_length_minus1_; }
-    std::vector<uint64_t> top_left() const { return top_left_; }
-    std::vector<uint64_t> bottom_right() const { return bottom_right_; }
+    const std::vector<uint64_t> & top_left() const { return top_left_; }
+    const std::vector<uint64_t> & bottom_right() const
+    { return bottom_right_; }
     bool slice_group_change_direction_flag() const
     { return slice_group_change_direction_flag_; }
     uint64_t slice_group_change_rate_minus1() const
     { return slice_group_change_rate_minus1_; }
     uint64_t pic_size_in_map_units_minus1() const
     { return pic_size_in_map_units_minus1_; }
-    std::vector<uint64_t> slice_group_id() const { return slice_group_id_; }
+    const std::vector<uint64_t> & slice_group_id() const
+    { return slice_group_id_; }
     uint64_t num_ref_idx_l0_default_active_minus1() const
     { return num_ref_idx_l0_default_active_minus1_; }
     uint64_t num_ref_idx_l1_default_active_minus1() const
@@ -259,6 +296,10 @@ public:
     /* TODO: refactor this after decoding is finished */
     RefPicListModification();
     RefPicListModification(uint64_t slice_type, BitReader & br);
+    /* parse and clear keep the capacity of the vectors, so that a recycled
+     * header does not allocate */
+    void parse(uint64_t slice_type, BitReader & br);
+    void clear();
     bool ref_pic_list_modification_flag_l0 = false;
     bool ref_pic_list_modification_flag_l1 = false;
     std::vector<uint64_t> modification_of_pic_nums_idc;
@@ -271,10 +312,12 @@ class PredWeightTable {
 public:
     /* TODO: refactor this after decoding is finished */
     PredWeightTable();
-    PredWeightTable(std::shared_ptr<SPS_NALUnit> sps,
-                    std::shared_ptr<PPS_NALUnit> pps,
+    PredWeightTable(const SPS_NALUnit & sps, const PPS_NALUnit & pps,
                     uint64_t slice_type,
                     BitReader & br);
+    void parse(const SPS_NALUnit & sps, const PPS_NALUnit & pps,
+               uint64_t slice_type, BitReader & br);
+    void clear();
     uint64_t luma_log2_weight_denom = 0;
     uint64_t chroma_log2_weight_denom = 0;
     std::vector<int64_t> luma_weight_l0;
@@ -291,6 +334,8 @@ class DecRefPicMarking {
 public:
     DecRefPicMarking();
     DecRefPicMarking(const NALUnit &unit, BitReader &br);
+    void parse(const NALUnit &unit, BitReader &br);
+    void clear();
     bool no_output_of_prior_pics_flag = false;
     bool long_term_reference_flag = false;
     bool adaptive_ref_pic_marking_mode_flag = false;
@@ -304,18 +349,18 @@ public:
 class SliceHeader {
 public:
     // SliceHeader();
-    SliceHeader(const NALUnit & nal, std::string & data): _data(data),
-                                                          _nal(nal), rplm(),
-                                                          pwt(), drpm() {}
+    explicit SliceHeader(const NALUnit & nal): _nal(nal), rplm(), pwt(),
+                                               drpm() {}
 
     std::pair<uint64_t, uint8_t> header_size() const
     { return std::make_pair<uint64_t, uint8_t>(
                 (uint64_t)_header_size[0], (uint8_t)_header_size[1]); }
 
     void parse(ParserContext & ctx, BitReader &br);
+    /* restores the defaults before a recycled header is parsed again */
+    void clear();
 private:
     uint64_t _header_size[2] = {0, 0};
-    std::string _data;
     const NALUnit & _nal;
 
 public:
@@ -354,21 +399,22 @@ class SliceData {
 public:
     explicit SliceData(const Slice_NALUnit & nal) : _nal(nal) {}
     void parse(ParserContext & ctx, BitReader & br);
+    void clear() { _trailing_bit = 0; }
 private:
     const Slice_NALUnit & _nal;
 
-    bool mbaff_frame_flag(std::shared_ptr<SPS_NALUnit> sps,
-                          const std::shared_ptr<SliceHeader> header) {
-        return  sps->mb_adaptive_frame_field_flag() && !header->field_pic_flag;
+    bool mbaff_frame_flag(const SPS_NALUnit & sps,
+                          const SliceHeader & header) {
+        return  sps.mb_adaptive_frame_field_flag() && !header.field_pic_flag;
     }
 
     uint64_t next_mb_addr(uint64_t n, ParserContext & ctx);
 
-    std::vector<uint64_t> slice_group_map(std::shared_ptr<SPS_NALUnit> sps,
-                                          std::shared_ptr<PPS_NALUnit> pps);
+    std::vector<uint64_t> slice_group_map(const SPS_NALUnit & sps,
+                                          const PPS_NALUnit & pps);
 
     bool more_rbsp_data(BitReader & br);
-    void find_trailing_bit();
+    void find_trailing_bit(BitReader &br);
     uint64_t _trailing_bit = 0;
 };
 
@@ -409,6 +455,8 @@ public:
               max_num_coeff(max_num_coeff), block_type(block_type),
               block_index(block_index) {}
 
+    /* coeffLevel can be nullptr, in which case the levels are consumed
+     * but not stored */
     void parse(ParserContext &ctx, int * coeffLevel, BitReader &br);
 
     uint32_t start_index;
@@ -418,34 +466,15 @@ public:
     uint32_t block_index;
 private:
     /* taken from https://github.com/emericg/MiniVideo */
+    /* neighbour derivation goes through tables built at compile time */
     void deriv_4x4lumablocks(ParserContext &ctx,
                              const int luma4x4BlkIdx, int &mbAddrA,
                              int &luma4x4BlkIdxA, int &mbAddrB,
                              int &luma4x4BlkIdxB);
-    inline void InverseLuma4x4BlkScan(const int luma4x4BlkIdx, int &x, int &y);
-    void deriv_neighbouringlocations(ParserContext &ctx, const bool lumaBlock,
-                                     const int xN, const int yN, int &mbAddrN,
-                                     int &xW, int &yW);
-    inline int deriv_4x4lumablock_indices(const int xP, const int yP) {
-        return 8 * (yP / 8) + 4 * (xP / 8) +
-                2 * ((yP % 8) / 4) + ((xP % 8) / 4);
-    }
     void deriv_4x4chromablocks(ParserContext &ctx,
                                const int chroma4x4BlkIdx,
                                int &mbAddrA, int &chroma4x4BlkIdxA,
                                int &mbAddrB, int &chroma4x4BlkIdxB);
-
-    /* From 'ITU-T H.264' recommendation:
-     * 6.4.12.2 Derivation process for 4x4 chroma block indices.
-     *
-     * This subclause is only invoked when ChromaArrayType is equal to 1 or 2.
-     * Be carefull, the equation used in this function is not the same as the one
-     * described in the specification.
-     */
-    inline int deriv_4x4chromablock_indices(const int xP, const int yP) {
-        //FIXME why this is not the same equation as in the 'ITU-T H.264' recommendation?
-        return (int)(2.0 * floor((yP / 8.0) + 0.5) + floor((xP / 8.0) + 0.5));
-    }
 };
 
 class Residual {
@@ -463,24 +492,56 @@ public:
     uint32_t start_index;
     uint32_t end_index;
 
-    std::vector<std::shared_ptr<ResidualBlock>> residual_blocks;
+    /* only filled at ParseDepth::Full */
+    std::vector<ResidualBlock> residual_blocks;
+    /* luma DC, 16 luma blocks, 2 chroma DC and up to 16 chroma AC blocks */
+    static constexpr uint32_t max_residual_blocks = 35;
+
+private:
+    void parse_block(ParserContext &ctx, int * coeffLevel, BitReader &br,
+                     uint32_t start_index, uint32_t end_index,
+                     uint32_t max_num_coeff, BlockType block_type,
+                     uint32_t block_index);
+};
+
+/* coefficient levels of one macroblock. they take 4 KB per block and are only
+ * handed out by h264::get_raw_mb, so they live apart from MacroBlock and are
+ * only allocated by arenas that keep coefficients.
+ */
+struct MacroBlockCoefficients {
+    int LumaLevel4x4[16][16];               //!< An array of 16 blocks of (4x4) 16 coefficients
+    int LumaLevel8x8[4][64];                //!< An array of 4 blocks of (8x8) 64 coefficients
+    int Intra16x16DCLevel[16];              //!< An array of 16 luma DC coeff
+    int Intra16x16ACLevel[16][15];          //!< An array of 16 blocks of (4*4 - 1) 15 AC coefficients
+
+    int ChromaDCLevel[2][4];                //!< Store chroma DC coeff
+    int ChromaACLevel[2][4][15];            //!< Store chroma AC coeff
 };
 
 class MacroBlock {
 public:
+    MacroBlock() : MacroBlock(false, 0) {}
     MacroBlock(bool mb_field_decoding_flag, uint64_t curr_mb_addr);
     MacroBlock(ParserContext & ctx, bool mb_field_decoding_flag,
                uint64_t curr_mb_addr);
+    MacroBlock(const MacroBlock &) = delete;
+    MacroBlock &operator=(const MacroBlock &) = delete;
+    MacroBlock(MacroBlock &&) = default;
+    MacroBlock &operator=(MacroBlock &&) = default;
+    /* reinitializes a recycled block as if it was freshly constructed */
+    void reset(ParserContext & ctx, bool mb_field_decoding_flag,
+               uint64_t curr_mb_addr);
     void parse(ParserContext &ctx, BitReader &br);
+
+    /* fields read from the neighbours during motion vector prediction and
+     * nC derivation come first, so that they share as few cache lines as
+     * possible */
     uint64_t mb_type = P_Skip; /* default to skip */
-    bool transform_size_8x8_flag = false;
+    bool predFlagL[2][4];
+    int refIdxL[2][4];
+    int mvL[2][4][4][2];
+    uint8_t mbPartIdxTable [4][4];
 
-    std::unique_ptr<MbPred> mb_pred;
-    std::vector<std::unique_ptr<SubMbPred>> sub_mb_preds;
-    std::unique_ptr<Residual> residual = nullptr;
-    bool mb_field_decoding_flag;
-    int64_t mb_qp_delta = 0;
-    uint64_t mb_addr;
     int64_t mbAddrA = -1;
     int64_t mbAddrB = -1;
     int64_t mbAddrC = -1;
@@ -494,32 +555,32 @@ public:
     int TotalCoeffs_luma[16];
     int TotalCoeffs_chroma[2][4];
 
-    int LumaLevel4x4[16][16];               //!< An array of 16 blocks of (4x4) 16 coefficients
-    int LumaLevel8x8[4][64];                //!< An array of 4 blocks of (8x8) 64 coefficients
-    int Intra16x16DCLevel[16];              //!< An array of 16 luma DC coeff
-    int Intra16x16ACLevel[16][15];          //!< An array of 16 blocks of (4*4 - 1) 15 AC coefficients
-
-    int ChromaDCLevel[2][4];                //!< Store chroma DC coeff
-    int ChromaACLevel[2][4][15];            //!< Store chroma AC coeff
-
+    /* the remaining syntax of this block only */
+    bool transform_size_8x8_flag = false;
+    bool mb_field_decoding_flag = false;
+    int64_t mb_qp_delta = 0;
+    uint64_t mb_addr = 0;
     uint64_t CodedBlockPatternLuma = 0;
     uint64_t CodedBlockPatternChroma = 0;
 
     uint64_t slice_type = 0; /* will be assigned in parsing */
 
-    int mvL[2][4][4][2];
-    bool predFlagL[2][4];
-    int refIdxL[2][4];
-
-    uint64_t mbPartIdxTable [4][4];
+    /* only meaningful for non-skipped blocks that are not P_8x8. skipped
+     * blocks do not reset it */
+    MbPred mb_pred;
+    std::vector<std::unique_ptr<SubMbPred>> sub_mb_preds;
+    /* empty unless the block carries a residual */
+    Residual residual {0, 15};
+    /* nullptr unless the arena keeps coefficients */
+    MacroBlockCoefficients * coefficients = nullptr;
 
-    uint32_t pos_x() { return (uint32_t)_pos_x; }
-    uint32_t pos_y() { return (uint32_t)_pos_y; }
+    uint32_t pos_x() const { return (uint32_t)_pos_x; }
+    uint32_t pos_y() const { return (uint32_t)_pos_y; }
 
 private:
+    void clear(bool mb_field_decoding_flag, uint64_t curr_mb_addr);
     void compute_mb_neighbours(ParserContext &ctx);
     void compute_mb_index(ParserContext &ctx);
-    void assign_pos(ParserContext & ctx);
 
     uint64_t _pos_x = 0;
     uint64_t _pos_y = 0;
@@ -528,51 +589,174 @@ private:
 
 class Slice_NALUnit : public NALUnit {
 public:
-    explicit Slice_NALUnit(std::string data);
+    explicit Slice_NALUnit(std::string data, bool unescape = true);
+    /* non-owning, see NALUnit */
+    explicit Slice_NALUnit(std::string_view data, bool unescape = true);
     explicit Slice_NALUnit(NALUnit & unit);
     explicit Slice_NALUnit(std::shared_ptr<NALUnit> & unit) :
             Slice_NALUnit(*unit.get()) {}
-
+    /* empty unit to be recycled with reset() */
+    Slice_NALUnit();
+    Slice_NALUnit(const Slice_NALUnit &) = delete;
+    Slice_NALUnit & operator=(const Slice_NALUnit &) = delete;
+
+    /* non-owning, see NALUnit. the header and slice data are kept, so no
+     * memory is allocated once the unit has been used */
+    void reset(std::string_view data, bool unescape = true);
     void parse(ParserContext & ctx);
+    /* parse in two steps, for slices that share one MacroBlockArena: the
+     * header resizes the arena, so headers have to be parsed one at a time,
+     * while the slice data only touches the macroblocks of its slice */
+    void parse_header(ParserContext & ctx);
+    void parse_data(ParserContext & ctx);
 
     std::shared_ptr<SliceHeader> header() { return _header; }
 private:
     std::shared_ptr<SliceHeader> _header = nullptr;
     std::shared_ptr<SliceData> _slice_data = nullptr;
+    /* picks up the slice data where the header ends */
+    BitReader _reader {std::string_view()};
+};
+
+/* neighbouring macroblock addresses (-1 if not available) and position of
+ * one macroblock address. they only depend on the picture size.
+ */
+struct MbNeighbours {
+    int64_t mbAddrA;
+    int64_t mbAddrB;
+    int64_t mbAddrC;
+    int64_t mbAddrD;
+    uint32_t pos_x;
+    uint32_t pos_y;
+};
+
+/* MbNeighbours of every macroblock address of a picture. they are computed
+ * once per resolution rather than for every macroblock of every picture */
+class MbNeighbourTable {
+public:
+    MbNeighbourTable() : entries_() {}
+    /* does nothing unless the picture size changed */
+    void resize(uint64_t pic_width_in_mbs, uint64_t num_mbs);
+    uint64_t size() const { return entries_.size(); }
+    const MbNeighbours & operator[](uint64_t mb_addr) const
+    { return entries_[mb_addr]; }
+
+private:
+    std::vector<MbNeighbours> entries_;
+    uint64_t width_ = 0;
+};
+
+/* macroblock storage for one picture. the blocks are recycled from picture
+ * to picture, so once the arena has grown to the picture size, decoding does
+ * not allocate per macroblock. blocks refer to their neighbours by address.
+ *
+ * coefficient levels are kept in a separate array, which is only allocated
+ * when keep_coefficients is set.
+ */
+class MacroBlockArena {
+public:
+    explicit MacroBlockArena(bool keep_coefficients = false)
+            : blocks_(), coefficients_(),
+              keep_coefficients_(keep_coefficients) {}
+    /* storage only grows. blocks keep their old content until reset.
+     * with residuals set, every block gets room for all of its residual
+     * blocks up front, so that no picture has to grow them */
+    void resize(uint64_t num_mbs, bool residuals = false) {
+        if (blocks_.size() < num_mbs) {
+            blocks_.resize(num_mbs);
+            residuals_reserved_ = false;
+        }
+        if (keep_coefficients_ && coefficients_.size() < num_mbs)
+            coefficients_.resize(num_mbs);
+        if (residuals && !residuals_reserved_) {
+            for (auto & block : blocks_)
+                block.residual.residual_blocks.reserve(
+                        Residual::max_residual_blocks);
+            residuals_reserved_ = true;
+        }
+        size_ = num_mbs;
+    }
+    uint64_t size() const { return size_; }
+    bool keep_coefficients() const { return keep_coefficients_; }
+    MacroBlock & operator[](uint64_t mb_addr) { return blocks_[mb_addr]; }
+    MacroBlockCoefficients * coefficients(uint64_t mb_addr)
+    { return keep_coefficients_ ? &coefficients_[mb_addr] : nullptr; }
+    std::vector<MacroBlock>::iterator begin() { return blocks_.begin(); }
+    std::vector<MacroBlock>::iterator end()
+    { return blocks_.begin() + (int64_t)size_; }
+
+private:
+    std::vector<MacroBlock> blocks_;
+    std::vector<MacroBlockCoefficients> coefficients_;
+    bool keep_coefficients_;
+    bool residuals_reserved_ = false;
+    uint64_t size_ = 0;
+};
+
+/* receives every macroblock of a slice as soon as it is parsed, skipped ones
+ * included. its neighbours A to D are final by then */
+class MacroBlockListener {
+public:
+    virtual void on_macroblock(ParserContext &ctx, MacroBlock &mb) = 0;
+    /* a run of mb_skip_run skipped blocks, all reset already. defaults to
+     * on_macroblock for each of them */
+    virtual void on_skip_run(ParserContext &ctx, uint64_t first_mb_addr,
+                             uint64_t mb_skip_run);
+    virtual ~MacroBlockListener() = default;
 };
 
 class ParserContext {
 public:
-    ParserContext(std::shared_ptr<SPS_NALUnit> sps,
-                  std::shared_ptr<PPS_NALUnit> pps) : sps(sps), pps(pps),
-                                                      mb_array() {}
-    std::shared_ptr<SPS_NALUnit> sps;
-    std::shared_ptr<PPS_NALUnit> pps;
-    std::shared_ptr<MacroBlock> mb = nullptr;
-    std::vector<std::shared_ptr<MacroBlock>> mb_array;
-
-    inline uint64_t PicHeightInMapUnits()
-    { return sps->pic_height_in_map_units_minus1() + 1; }
-    inline uint64_t PicWidthInMbs()
-    { return sps->pic_width_in_mbs_minus1() + 1; }
-    inline uint64_t FrameHeightInMbs()
-    { return  (2 - sps->frame_mbs_only_flag()) * PicHeightInMapUnits(); }
-    inline uint64_t PicHeightInMbs()
+    /* sps, pps and the arena are owned by the caller, usually h264, and have
+     * to outlive the context. nothing on the parse path touches a refcount */
+    ParserContext(const SPS_NALUnit & sps, const PPS_NALUnit & pps,
+                  MacroBlockArena & arena)
+            : sps(sps), pps(pps), mb_array(arena), mb_neighbours() {}
+    ParserContext(const ParserContext &) = delete;
+    ParserContext &operator=(const ParserContext &) = delete;
+    const SPS_NALUnit & sps;
+    const PPS_NALUnit & pps;
+    MacroBlock * mb = nullptr;
+    MacroBlockArena & mb_array;
+    /* follows the picture size of the last header */
+    MbNeighbourTable mb_neighbours;
+    ParseDepth depth = ParseDepth::Full;
+    /* optional, not owned */
+    MacroBlockListener * listener = nullptr;
+    /* the macroblocks [first_mb_addr, end_mb_addr) of the current slice.
+     * first_mb_addr is set with the header, end_mb_addr once the slice data
+     * is parsed. neighbours before first_mb_addr are in another slice and
+     * count as not available */
+    uint64_t first_mb_addr = 0;
+    uint64_t end_mb_addr = 0;
+    /* the slice data must not go past it. the end of the picture, unless
+     * the caller knows where the next slice starts */
+    uint64_t limit_mb_addr = 0;
+
+    inline uint64_t PicHeightInMapUnits() const
+    { return sps.pic_height_in_map_units_minus1() + 1; }
+    inline uint64_t PicWidthInMbs() const
+    { return sps.pic_width_in_mbs_minus1() + 1; }
+    inline uint64_t FrameHeightInMbs() const
+    { return  (2 - sps.frame_mbs_only_flag()) * PicHeightInMapUnits(); }
+    inline uint64_t PicHeightInMbs() const
     { return _header ? FrameHeightInMbs() / (1 + _header->field_pic_flag) : 0; }
-    uint64_t PicSizeInMbs() { return PicWidthInMbs() * PicHeightInMbs(); }
+    uint64_t PicSizeInMbs() const { return PicWidthInMbs() * PicHeightInMbs(); }
 
-    uint32_t SubHeightC();
-    uint32_t SubWidthC();
-    inline uint32_t MbWidthC() { return 16 / SubWidthC(); }
-    inline uint32_t MbHeightC() { return 16 / SubHeightC(); }
+    uint32_t SubHeightC() const;
+    uint32_t SubWidthC() const;
+    inline uint32_t MbWidthC() const { return 16 / SubWidthC(); }
+    inline uint32_t MbHeightC() const { return 16 / SubHeightC(); }
 
-    uint32_t Height();
-    uint32_t Width();
+    uint32_t Height() const;
+    uint32_t Width() const;
 
-    std::shared_ptr<SliceHeader> header() { return _header; }
+    /* nullptr until the slice header is parsed */
+    const SliceHeader * header() const { return _header.get(); }
     void set_header(std::shared_ptr<SliceHeader> header);
 
 private:
+    /* keeps the header alive once the slice is gone. set once per slice */
     std::shared_ptr<SliceHeader> _header = nullptr;
 };
 
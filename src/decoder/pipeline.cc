@@ -0,0 +1,162 @@
+/*  This file is part of h264flow.
+
+    h264flow is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    h264flow is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with h264flow.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <chrono>
+#include "pipeline.hh"
+
+void Backoff::wait() {
+    if (count_ < 64) {
+        count_++;
+    } else if (count_ < 128) {
+        count_++;
+        std::this_thread::yield();
+    } else {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+}
+
+FramePipeline::FramePipeline(h264 &decoder)
+        : FramePipeline(decoder, 0, decoder.index_size()) {}
+
+FramePipeline::FramePipeline(h264 &decoder, uint64_t begin, uint64_t end,
+                             uint32_t num_workers, uint32_t queue_size)
+        : decoder_(decoder), end_(end), samples_(queue_size),
+          num_slots_(samples_.capacity()),
+          slots_(std::make_unique<Slot[]>(num_slots_)), next_frame_(begin),
+          delivered_(begin), threads_() {
+    /* also builds the index before the threads start */
+    if (begin > end || end > decoder.index_size())
+        throw std::runtime_error("frame range out of bounds");
+    if (num_workers == 0)
+        num_workers = std::max(1u, std::thread::hardware_concurrency());
+    try {
+        threads_.emplace_back(&FramePipeline::read, this, begin);
+        for (uint32_t i = 0; i < num_workers; i++)
+            threads_.emplace_back(&FramePipeline::work, this);
+    } catch (...) {
+        /* the destructor does not run for a failed constructor */
+        stop_ = true;
+        for (auto & thread : threads_)
+            thread.join();
+        throw;
+    }
+}
+
+FramePipeline::~FramePipeline() {
+    stop_ = true;
+    for (auto & thread : threads_)
+        thread.join();
+}
+
+/* reads one byte per page, so that the slices are faulted in here instead of
+ * stalling a worker */
+static void prefetch(const std::vector<std::string_view> &slices) {
+    volatile char touch;
+    for (const auto & slice : slices) {
+        for (uint64_t i = 0; i < slice.size(); i += 4096)
+            touch = slice[i];
+    }
+    (void)touch;
+}
+
+void FramePipeline::read(uint64_t begin) {
+    Backoff backoff;
+    for (uint64_t frame_num = begin; frame_num < end_; frame_num++) {
+        /* backpressure: the slot of frame_num has to be consumed first */
+        while (frame_num - delivered_.load(std::memory_order_acquire)
+               >= num_slots_) {
+            if (stop_)
+                return;
+            backoff.wait();
+        }
+        backoff.reset();
+
+        /* the slot is free, so it can be written from here */
+        Slot & slot = slots_[frame_num % num_slots_];
+        try {
+            decoder_.extract_slices(frame_num, slot.slices);
+            prefetch(slot.slices);
+        } catch (...) {
+            slot.error = std::current_exception();
+            slot.ready.store(true, std::memory_order_release);
+            continue;
+        }
+        while (!samples_.try_push(frame_num)) {
+            if (stop_)
+                return;
+            backoff.wait();
+        }
+        backoff.reset();
+    }
+    reader_done_.store(true, std::memory_order_release);
+}
+
+void FramePipeline::work() {
+    FrameDecoder frame_decoder(decoder_);
+    Backoff backoff;
+    uint64_t frame_num;
+    while (!stop_) {
+        /* seen before the pop fails, every sample has been pushed */
+        bool done = reader_done_.load(std::memory_order_acquire);
+        if (!samples_.try_pop(frame_num)) {
+            if (done)
+                return;
+            backoff.wait();
+            continue;
+        }
+        backoff.reset();
+        Slot & slot = slots_[frame_num % num_slots_];
+        try {
+            slot.p_frame = frame_decoder.decode_slices(slot.slices,
+                                                       slot.frame);
+        } catch (...) {
+            slot.error = std::current_exception();
+        }
+        slot.ready.store(true, std::memory_order_release);
+    }
+}
+
+bool FramePipeline::next(uint64_t &frame_num, MvFrame &frame, bool &p_frame) {
+    if (next_frame_ >= end_)
+        return false;
+    Slot & slot = slots_[next_frame_ % num_slots_];
+    Backoff backoff;
+    while (!slot.ready.load(std::memory_order_acquire))
+        backoff.wait();
+
+    frame_num = next_frame_;
+    std::exception_ptr error = slot.error;
+    slot.error = nullptr;
+    if (!error) {
+        std::swap(frame, slot.frame);
+        p_frame = slot.p_frame;
+    }
+    slot.ready.store(false, std::memory_order_relaxed);
+    /* hands the slot back to the reader */
+    next_frame_++;
+    delivered_.store(next_frame_, std::memory_order_release);
+    if (error)
+        std::rethrow_exception(error);
+    return true;
+}
+
+void FramePipeline::for_each(const h264::FrameVisitor &visitor) {
+    uint64_t frame_num;
+    MvFrame frame;
+    bool p_frame;
+    while (next(frame_num, frame, p_frame))
+        visitor(frame_num, frame, p_frame);
+}
@@ -0,0 +1,183 @@
+/*  This file is part of h264flow.
+
+    h264flow is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    h264flow is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with h264flow.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef H264FLOW_PIPELINE_HH
+#define H264FLOW_PIPELINE_HH
+
+#include <atomic>
+#include <thread>
+#include <exception>
+#include "h264.hh"
+
+/* waits in a polling loop: spins first, then yields, then sleeps, so that a
+ * stalled stage does not keep a core busy */
+class Backoff {
+public:
+    void wait();
+    void reset() { count_ = 0; }
+private:
+    uint32_t count_ = 0;
+};
+
+/* lock-free bounded multi-producer multi-consumer queue, after Dmitry
+ * Vyukov's design. every cell carries a sequence number that tells whether it
+ * is ready to be written or read for the current lap. the capacity is
+ * rounded up to a power of two. try_push fails when the queue is full and
+ * try_pop fails when it is empty.
+ */
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(uint32_t capacity)
+            : mask_(round_up(capacity) - 1),
+              cells_(std::make_unique<Cell[]>(mask_ + 1)) {
+        for (uint64_t i = 0; i <= mask_; i++)
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    BoundedQueue(const BoundedQueue &) = delete;
+    BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+    bool try_push(const T &value) {
+        uint64_t pos = head_.load(std::memory_order_relaxed);
+        Cell * cell;
+        while (true) {
+            cell = &cells_[pos & mask_];
+            uint64_t sequence = cell->sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<int64_t>(sequence - pos);
+            if (diff == 0) {
+                if (head_.compare_exchange_weak(pos, pos + 1,
+                                                std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value = value;
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool try_pop(T &value) {
+        uint64_t pos = tail_.load(std::memory_order_relaxed);
+        Cell * cell;
+        while (true) {
+            cell = &cells_[pos & mask_];
+            uint64_t sequence = cell->sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<int64_t>(sequence - (pos + 1));
+            if (diff == 0) {
+                if (tail_.compare_exchange_weak(pos, pos + 1,
+                                                std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail_.load(std::memory_order_relaxed);
+            }
+        }
+        value = std::move(cell->value);
+        cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+        return true;
+    }
+
+    uint64_t capacity() const { return mask_ + 1; }
+
+private:
+    struct Cell {
+        std::atomic<uint64_t> sequence {0};
+        T value {};
+    };
+
+    static uint64_t round_up(uint64_t n) {
+        uint64_t result = 1;
+        while (result < n)
+            result <<= 1;
+        return result;
+    }
+
+    const uint64_t mask_;
+    std::unique_ptr<Cell[]> cells_;
+    /* producers and consumers each get their own cache line */
+    alignas(64) std::atomic<uint64_t> head_ {0};
+    alignas(64) std::atomic<uint64_t> tail_ {0};
+};
+
+/* streams the frames [begin, end) of one h264 object through three stages:
+ *  - a reader thread takes the samples out of the file and faults them in
+ *  - num_workers threads parse them and predict the motion vectors
+ *  - the consumer gets the frames back in order from next() or for_each()
+ * at most queue_size frames are in flight. once they are all decoded and not
+ * yet consumed, the reader and the workers wait, so memory stays bounded no
+ * matter how slow the consumer is. the stages are connected through lock-free
+ * ring buffers: the reader hands samples to the workers through a
+ * BoundedQueue, and the workers put decoded frames into a ring of reorder
+ * slots indexed by frame number.
+ * the h264 object has to outlive the pipeline, which starts decoding as soon
+ * as it is constructed.
+ */
+class FramePipeline {
+public:
+    /* every frame, on every core */
+    explicit FramePipeline(h264 &decoder);
+    FramePipeline(h264 &decoder, uint64_t begin, uint64_t end,
+                  uint32_t num_workers = 0, uint32_t queue_size = 32);
+    FramePipeline(const FramePipeline &) = delete;
+    FramePipeline &operator=(const FramePipeline &) = delete;
+    /* stops the threads. frames not consumed yet are dropped */
+    ~FramePipeline();
+
+    /* waits for the next frame in order and swaps it into frame, so frame's
+     * storage is recycled by the pipeline. returns false once every frame
+     * has been delivered. a frame that failed to decode rethrows its error
+     * here with frame_num set, and the next call carries on with the frame
+     * after it */
+    bool next(uint64_t &frame_num, MvFrame &frame, bool &p_frame);
+    /* calls visitor with every remaining frame, in order, on the calling
+     * thread. stops at the first error */
+    void for_each(const h264::FrameVisitor &visitor);
+
+private:
+    /* the slices are filled in by the reader before the frame number is
+     * queued, and their storage is kept from lap to lap */
+    struct Slot {
+        std::atomic<bool> ready {false};
+        std::vector<std::string_view> slices {};
+        MvFrame frame {};
+        bool p_frame = false;
+        std::exception_ptr error = nullptr;
+    };
+
+    h264 & decoder_;
+    const uint64_t end_;
+    /* frame numbers whose slots hold the slices to decode */
+    BoundedQueue<uint64_t> samples_;
+    const uint64_t num_slots_;
+    std::unique_ptr<Slot[]> slots_;
+
+    /* next frame to be handed to the consumer */
+    uint64_t next_frame_;
+    /* frames before it are consumed and their slots free */
+    std::atomic<uint64_t> delivered_;
+    std::atomic<bool> reader_done_ {false};
+    std::atomic<bool> stop_ {false};
+    std::vector<std::thread> threads_;
+
+    void read(uint64_t begin);
+    void work();
+};
+
+#endif //H264FLOW_PIPELINE_HH
@@ -0,0 +1,203 @@
+/*  This file is part of h264flow.
+
+    h264flow is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    h264flow is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with h264flow.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+#include <unistd.h>
+#include "stream.hh"
+#include "util.hh"
+
+AnnexBReader::AnnexBReader(int fd, uint64_t buffer_size)
+        : fd_(fd), buffer_(std::max<uint64_t>(buffer_size, 64)) {}
+
+bool AnnexBReader::find(uint64_t &position, uint64_t &size) {
+    /* every NAL unit starts right after a 0x000001 start code and runs up
+     * to the next one */
+    uint64_t start;
+    while ((start = find_start_code(buffer_.data(), end_, search_pos_))
+           != end_) {
+        bool found = in_nal_;
+        position = nal_start_;
+        size = base_ + start - nal_start_;
+        in_nal_ = true;
+        nal_start_ = base_ + start + 3;
+        search_pos_ = start + 3;
+        if (found)
+            return true;
+    }
+    /* a start code may not be fully read yet */
+    if (end_ - search_pos_ > 2)
+        search_pos_ = end_ - 2;
+    if (eof_ && in_nal_) {
+        /* last one */
+        position = nal_start_;
+        size = base_ + end_ - nal_start_;
+        in_nal_ = false;
+        search_pos_ = end_;
+        return true;
+    }
+    return false;
+}
+
+bool AnnexBReader::fill() {
+    if (eof_)
+        return false;
+    if (end_ == buffer_.size()) {
+        /* what is released goes, but not the NAL unit being searched */
+        uint64_t keep = std::min(released_, in_nal_ ? nal_start_
+                                                    : base_ + search_pos_);
+        uint64_t drop = keep - base_;
+        if (drop >= buffer_.size() / 2) {
+            memmove(buffer_.data(), buffer_.data() + drop, end_ - drop);
+            base_ += drop;
+            end_ -= drop;
+            search_pos_ -= drop;
+        } else {
+            buffer_.resize(buffer_.size() * 2);
+        }
+    }
+    ssize_t result;
+    do {
+        result = read(fd_, buffer_.data() + end_, buffer_.size() - end_);
+    } while (result < 0 && errno == EINTR);
+    if (result < 0)
+        throw std::runtime_error("unable to read stream");
+    if (result == 0) {
+        eof_ = true;
+        return false;
+    }
+    end_ += static_cast<uint64_t>(result);
+    return true;
+}
+
+std::string_view AnnexBReader::pending() const {
+    if (!in_nal_)
+        return std::string_view();
+    return span(nal_start_, base_ + end_ - nal_start_);
+}
+
+std::string_view AnnexBReader::span(uint64_t position, uint64_t size) const {
+    if (position < base_ || position - base_ > end_
+        || size > end_ - (position - base_))
+        throw std::runtime_error("stream position not buffered");
+    return std::string_view(buffer_.data() + position - base_, size);
+}
+
+void AnnexBReader::release(uint64_t position) {
+    released_ = std::max(released_, position);
+}
+
+StreamDecoder::StreamDecoder(int fd)
+        : reader_(fd), sps_data_(), pps_data_(), next_sps_(), next_pps_(),
+          decoder_(), frame_decoder_(), picture_(), slices_() {}
+
+void StreamDecoder::set_parse_depth(ParseDepth depth) {
+    parse_depth_ = depth;
+    if (decoder_)
+        decoder_->set_parse_depth(depth);
+}
+
+bool StreamDecoder::add_nal_unit(uint64_t position, uint64_t size) {
+    std::string_view nal_unit = reader_.span(position, size);
+    if (!picture_.empty() && ends_picture(nal_unit))
+        return false;
+    uint64_t nal_unit_num = num_nal_units_++;
+    if (is_slice(nal_unit)) {
+        if (picture_.empty()) {
+            /* pictures before the parameter sets cannot be decoded, and
+             * neither can a picture whose first slice was missed */
+            if (next_sps_.empty() || next_pps_.empty()
+                || !ends_picture(nal_unit)) {
+                reader_.release(position + size);
+                return true;
+            }
+            picture_num_ = nal_unit_num;
+        }
+        picture_.emplace_back(position, size);
+        return true;
+    }
+    uint8_t nal_unit_type = nal_unit.empty()
+                            ? 0 : static_cast<uint8_t>(nal_unit[0]) & 0x1F;
+    if (nal_unit_type == 7)
+        next_sps_.assign(nal_unit);
+    else if (nal_unit_type == 8)
+        next_pps_.assign(nal_unit);
+    reader_.release(position + size);
+    return true;
+}
+
+void StreamDecoder::decode_picture(uint64_t &frame_num, MvFrame &frame,
+                                   bool &p_frame) {
+    frame_num = picture_num_;
+    slices_.clear();
+    for (const auto & slice : picture_)
+        slices_.emplace_back(reader_.span(slice.first, slice.second));
+    /* the views stay valid until the reader fills its buffer again */
+    reader_.release(picture_.back().first + picture_.back().second);
+    picture_.clear();
+    if (!frame_decoder_ || sps_data_ != next_sps_ || pps_data_ != next_pps_) {
+        frame_decoder_.reset();
+        sps_data_ = next_sps_;
+        pps_data_ = next_pps_;
+        decoder_ = std::make_unique<h264>(
+                std::make_shared<SPS_NALUnit>(sps_data_),
+                std::make_shared<PPS_NALUnit>(pps_data_));
+        decoder_->set_parse_depth(parse_depth_);
+        frame_decoder_ = std::make_unique<FrameDecoder>(*decoder_);
+    }
+    p_frame = frame_decoder_->decode_slices(slices_, frame);
+}
+
+bool StreamDecoder::next(uint64_t &frame_num, MvFrame &frame, bool &p_frame) {
+    uint64_t position, size;
+    while (true) {
+        if (has_next_) {
+            has_next_ = false;
+            position = next_position_;
+            size = next_size_;
+        } else if (!reader_.find(position, size)) {
+            /* the picture is complete once what follows it has begun */
+            if (!picture_.empty() && ends_picture(reader_.pending())) {
+                decode_picture(frame_num, frame, p_frame);
+                return true;
+            }
+            if (reader_.fill())
+                continue;
+            if (!reader_.find(position, size)) {
+                /* end of the stream */
+                if (picture_.empty())
+                    return false;
+                decode_picture(frame_num, frame, p_frame);
+                return true;
+            }
+        }
+        if (!add_nal_unit(position, size)) {
+            /* it starts the next picture, and is taken up on the next call */
+            has_next_ = true;
+            next_position_ = position;
+            next_size_ = size;
+            decode_picture(frame_num, frame, p_frame);
+            return true;
+        }
+    }
+}
+
+void StreamDecoder::for_each(const h264::FrameVisitor &visitor) {
+    uint64_t frame_num;
+    MvFrame frame;
+    bool p_frame;
+    while (next(frame_num, frame, p_frame))
+        visitor(frame_num, frame, p_frame);
+}
@@ -0,0 +1,121 @@
+/*  This file is part of h264flow.
+
+    h264flow is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    h264flow is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with h264flow.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef H264FLOW_STREAM_HH
+#define H264FLOW_STREAM_HH
+
+#include "h264.hh"
+
+/* forward-only reader of an Annex B byte stream from a pipe, a FIFO, a
+ * socket or any other descriptor that cannot seek. bytes are read in blocks
+ * into a buffer that slides along the stream: room is made by dropping the
+ * bytes before the position given to release(), and the buffer only grows
+ * when the bytes kept take up more than half of it. NAL units are found with
+ * the same start code search as BitStream, and one is handed out once the
+ * start code after it has been read, or the stream has ended. positions are
+ * counted from the start of the stream.
+ */
+class AnnexBReader {
+public:
+    /* fd is not closed by the reader */
+    explicit AnnexBReader(int fd, uint64_t buffer_size = 1 << 20);
+
+    /* the next NAL unit among the bytes read so far. does not block */
+    bool find(uint64_t &position, uint64_t &size);
+    /* blocks until more bytes are read. returns false at the end of the
+     * stream, after which find hands out the last NAL unit */
+    bool fill();
+    /* the bytes after the last start code found, which may be the beginning
+     * of a NAL unit still on its way */
+    std::string_view pending() const;
+    /* view of bytes that have been read and not released. valid until the
+     * next call to fill */
+    std::string_view span(uint64_t position, uint64_t size) const;
+    /* bytes before position are not needed any more */
+    void release(uint64_t position);
+
+private:
+    const int fd_;
+    std::vector<char> buffer_;
+    /* stream position of the first byte in the buffer */
+    uint64_t base_ = 0;
+    /* bytes in the buffer */
+    uint64_t end_ = 0;
+    /* where the search for the next start code goes on, in the buffer */
+    uint64_t search_pos_ = 0;
+    uint64_t released_ = 0;
+    /* the NAL unit after the last start code found, if any */
+    bool in_nal_ = false;
+    uint64_t nal_start_ = 0;
+    bool eof_ = false;
+};
+
+/* decodes the pictures of an Annex B stream as it is read, for live input
+ * such as the output of ffmpeg -f h264 - or a camera relay. a picture is
+ * decoded once the NAL unit after it has begun, so no more than a picture is
+ * buffered. the decoder is set up from the first SPS and PPS in the stream,
+ * and pictures before them are skipped, as when joining a live stream. it is
+ * set up again when the parameter sets change.
+ * frame numbers count the NAL units of the stream, as the samples of a raw
+ * bitstream file do, so a stream numbers its frames like the same bytes read
+ * from a file.
+ */
+class StreamDecoder {
+public:
+    /* fd is not closed by the decoder */
+    explicit StreamDecoder(int fd);
+    StreamDecoder(const StreamDecoder &) = delete;
+    StreamDecoder &operator=(const StreamDecoder &) = delete;
+
+    /* waits for the next picture and decodes it into frame, which returns
+     * false and an empty frame if it is not a P frame, as
+     * FrameDecoder::decode does. returns false at the end of the stream. a
+     * picture that failed to decode rethrows its error here with frame_num
+     * set, and the next call carries on with the picture after it */
+    bool next(uint64_t &frame_num, MvFrame &frame, bool &p_frame);
+    /* calls visitor with every remaining picture, in order. stops at the
+     * first error */
+    void for_each(const h264::FrameVisitor &visitor);
+
+    void set_parse_depth(ParseDepth depth);
+    ParseDepth parse_depth() const { return parse_depth_; }
+
+private:
+    AnnexBReader reader_;
+    ParseDepth parse_depth_ = ParseDepth::Full;
+    /* the parameter sets in use, and the latest ones seen */
+    std::string sps_data_;
+    std::string pps_data_;
+    std::string next_sps_;
+    std::string next_pps_;
+    std::unique_ptr<h264> decoder_;
+    std::unique_ptr<FrameDecoder> frame_decoder_;
+    /* NAL units seen so far */
+    uint64_t num_nal_units_ = 0;
+    /* positions and sizes of the slices of the picture being read */
+    std::vector<std::pair<uint64_t, uint64_t>> picture_;
+    uint64_t picture_num_ = 0;
+    std::vector<std::string_view> slices_;
+    /* a NAL unit that was found to start the next picture */
+    bool has_next_ = false;
+    uint64_t next_position_ = 0;
+    uint64_t next_size_ = 0;
+
+    bool add_nal_unit(uint64_t position, uint64_t size);
+    void decode_picture(uint64_t &frame_num, MvFrame &frame, bool &p_frame);
+};
+
+#endif //H264FLOW_STREAM_HH
@@ -28,6 +28,59 @@ uint64_t intlog2(uint64_t x)
     return log;
 }
 
+/* coeff_token lookup table, generated at compile time from coeff_token_length
+ * and coeff_token_code. every code is a run of leading zeros, a one and at
+ * most three more bits, so the table is indexed by the number of leading
+ * zeros (up to 16) and the three bits after the first one. each entry holds
+ * the code length in the high byte and the coeff_token in the low byte;
+ * length 0 marks an invalid code.
+ */
+static constexpr uint32_t COEFF_TOKEN_SUFFIX_BITS = 3;
+static constexpr uint32_t COEFF_TOKEN_TABLE_SIZE =
+        17 << COEFF_TOKEN_SUFFIX_BITS;
+
+struct CoeffTokenTable {
+    uint16_t entries[5][COEFF_TOKEN_TABLE_SIZE];
+};
+
+static constexpr CoeffTokenTable build_coeff_token_table() {
+    CoeffTokenTable table {};
+    for (uint32_t tab = 0; tab < 5; tab++) {
+        for (uint32_t trailing_ones = 0; trailing_ones < 4; trailing_ones++) {
+            for (uint32_t total_coeff = 0; total_coeff < 17; total_coeff++) {
+                uint32_t length =
+                        coeff_token_length[tab][trailing_ones][total_coeff];
+                uint32_t code =
+                        coeff_token_code[tab][trailing_ones][total_coeff];
+                if (!length)
+                    continue;
+                uint32_t code_bits = 0;
+                for (uint32_t c = code; c; c >>= 1)
+                    code_bits++;
+                uint32_t num_zero = length - code_bits;
+                auto value = static_cast<uint16_t>(
+                        length << 8 | total_coeff << 2 | trailing_ones);
+                /* an all-zero code matches any longer run of zeros */
+                uint32_t first = num_zero << COEFF_TOKEN_SUFFIX_BITS;
+                uint32_t last = COEFF_TOKEN_TABLE_SIZE;
+                if (code) {
+                    uint32_t suffix_bits = code_bits - 1;
+                    uint32_t unused = COEFF_TOKEN_SUFFIX_BITS - suffix_bits;
+                    uint32_t suffix = code & ((1u << suffix_bits) - 1);
+                    first |= suffix << unused;
+                    last = first + (1u << unused);
+                }
+                for (uint32_t i = first; i < last; i++)
+                    table.entries[tab][i] = value;
+            }
+        }
+    }
+    return table;
+}
+
+static constexpr CoeffTokenTable coeff_token_table =
+        build_coeff_token_table();
+
 uint8_t read_coeff_token(int nC, BitReader & br) {
     /* adapted from https://goo.gl/pWSEqT */
     if (nC >= 8) {
@@ -41,25 +94,25 @@ uint8_t read_coeff_token(int nC, BitReader & br) {
         return (uint8_t)((TotalCoeff << 2) | (TrailingOnes));
     }
 
-    int tab = (nC == -2) ? 4 : (nC == -1) ? 3 : (nC < 2) ? 0 : (nC < 4) ? 1 : (nC < 8) ? 2 : 5;
-
-    /* optimize next bits to save disk seek */
-    //uint64_t next_bytes = br.next_bits(16);
-    int64_t bits_left = br.bits_left();
-    for (int TrailingOnes = 0; TrailingOnes < 4; TrailingOnes++) {
-        for (int TotalCoeff = 0; TotalCoeff < 17; TotalCoeff++) {
-            uint32_t length = coeff_token_length[tab][TrailingOnes][TotalCoeff];
-            uint32_t code   = coeff_token_code[tab][TrailingOnes][TotalCoeff];
-            //uint64_t next_bits = next_bytes >> (16 - length);
-            if ((int)length > (bits_left - 1)) continue; /* 1 bit for stopping bit */
-            uint64_t next_bits = br.next_bits(length);
-            if (length > 0 && next_bits == code) {
-                br.read_bits(length);
-                return (uint8_t)((TotalCoeff << 2) | (TrailingOnes));
-            }
-        }
+    int tab = (nC == -2) ? 4 : (nC == -1) ? 3 : (nC < 2) ? 0 : (nC < 4) ? 1 : 2;
+
+    /* codes are at most 16 bits long */
+    auto word = static_cast<uint32_t>(br.next_bits(32));
+    uint32_t index;
+    if (word >> 16) {
+        auto num_zero = static_cast<uint32_t>(__builtin_clz(word));
+        index = (num_zero << COEFF_TOKEN_SUFFIX_BITS) |
+                ((word >> (28 - num_zero)) & 7);
+    } else {
+        index = 16 << COEFF_TOKEN_SUFFIX_BITS;
     }
-    throw std::runtime_error("coeff_token not found");
+    uint16_t entry = coeff_token_table.entries[tab][index];
+    uint32_t length = entry >> 8;
+    /* 1 bit for stopping bit */
+    if (!length || (int64_t)length > br.bits_left() - 1)
+        throw std::runtime_error("coeff_token not found");
+    br.skip_bits(length);
+    return static_cast<uint8_t>(entry);
 }
 
 uint8_t read_ce_levelprefix(BitReader &br) {
@@ -69,47 +122,102 @@ uint8_t read_ce_levelprefix(BitReader &br) {
     return static_cast<uint8_t>(leadingZeroBits);
 }
 
-int code_from_bitstream_2d(BitReader &br,
-                           const uint8_t *lentab, const uint8_t *codtab,
-                           const int tabwidth, const int tabheight) {
-    const uint8_t *len = &lentab[0];
-    const uint8_t *cod = &codtab[0];
-    int64_t bits_left = br.bits_left() - 1; /* 1 for stopping bit */
-    for (int j = 0; j < tabheight; j++) {
-        for (int i = 0; i < tabwidth; i++) {
-            if (*len > bits_left) continue;
-            uint64_t next_bits = br.next_bits(*len);
-            if ((*len == 0) || (next_bits != *cod)) {
-                ++len;
-                ++cod;
-            } else {
-                // Move bitstream pointer
-                br.read_bits(*len);
-
-                // The syntax element value
-                return i;
-            }
+/* direct-index tables for total_zeros and run_before, generated at compile
+ * time from the length/code tables. every vlcnum gets 2^bits entries, where
+ * bits is the length of its longest code, so a symbol decodes with a single
+ * peek. entries hold the code length in the high nibble and the value in the
+ * low one; length 0 marks an invalid code.
+ */
+struct VlcTable {
+    uint32_t bits;
+    uint32_t offset;
+};
+
+template <uint32_t NumTables, uint32_t Size>
+struct VlcTables {
+    VlcTable tables[NumTables];
+    uint8_t entries[Size];
+};
+
+template <uint32_t Width>
+static constexpr uint32_t max_code_length(const uint8_t (&lentab)[Width]) {
+    uint32_t result = 0;
+    for (uint32_t i = 0; i < Width; i++)
+        result = lentab[i] > result ? lentab[i] : result;
+    return result;
+}
+
+template <uint32_t NumTables, uint32_t Width>
+static constexpr uint32_t vlc_tables_size(const uint8_t (*lentab)[Width]) {
+    uint32_t size = 0;
+    for (uint32_t t = 0; t < NumTables; t++)
+        size += 1u << max_code_length(lentab[t]);
+    return size;
+}
+
+template <uint32_t NumTables, uint32_t Size, uint32_t Width>
+static constexpr VlcTables<NumTables, Size> build_vlc_tables(
+        const uint8_t (*lentab)[Width], const uint8_t (*codtab)[Width]) {
+    VlcTables<NumTables, Size> result {};
+    uint32_t offset = 0;
+    for (uint32_t t = 0; t < NumTables; t++) {
+        uint32_t bits = max_code_length(lentab[t]);
+        result.tables[t] = VlcTable {bits, offset};
+        for (uint32_t i = 0; i < Width; i++) {
+            uint32_t length = lentab[t][i];
+            if (!length)
+                continue;
+            /* every peek that starts with the code maps to it */
+            uint32_t first = (uint32_t)codtab[t][i] << (bits - length);
+            for (uint32_t j = 0; j < (1u << (bits - length)); j++)
+                result.entries[offset + first + j] =
+                        static_cast<uint8_t>(length << 4 | i);
         }
+        offset += 1u << bits;
     }
+    return result;
+}
+
+#define BUILD_VLC_TABLES(num, lentab, codtab) \
+    build_vlc_tables<num, vlc_tables_size<num>(lentab)>(lentab, codtab)
+
+static constexpr auto totalzeros_table =
+        BUILD_VLC_TABLES(TOTRUN_NUM, totalzeros_lentab, totalzeros_codtab);
+static constexpr auto totalzeros_chromadc420_table =
+        BUILD_VLC_TABLES(3, totalzeros_chromadc_lentab[0],
+                         totalzeros_chromadc_codtab[0]);
+static constexpr auto totalzeros_chromadc422_table =
+        BUILD_VLC_TABLES(7, totalzeros_chromadc_lentab[1],
+                         totalzeros_chromadc_codtab[1]);
+static constexpr auto runbefore_table =
+        BUILD_VLC_TABLES(RUNBEFORE_NUM, runbefore_lentab, runbefore_codtab);
 
-    throw std::runtime_error("unable to decode bit stream 2d");
+template <uint32_t NumTables, uint32_t Size>
+static int read_vlc(BitReader &br, const VlcTables<NumTables, Size> &table,
+                    const int vlcnum) {
+    const VlcTable &t = table.tables[vlcnum];
+    uint8_t entry = table.entries[t.offset + br.next_bits(t.bits)];
+    uint32_t length = entry >> 4;
+    /* 1 bit for stopping bit */
+    if (!length || (int64_t)length > br.bits_left() - 1)
+        throw std::runtime_error("unable to decode bit stream 2d");
+    br.skip_bits(length);
+    return entry & 0xF;
 }
 
+/* chromadc is the ChromaArrayType for chroma DC blocks, 0 otherwise */
 int read_ce_totalzeros(BitReader &br, const int vlcnum,
                        const int chromadc) {
     if (!chromadc)
-        return code_from_bitstream_2d(br, &totalzeros_lentab[vlcnum][0],
-                                      &totalzeros_codtab[vlcnum][0], 16, 1);
+        return read_vlc(br, totalzeros_table, vlcnum);
+    else if (chromadc == 1)
+        return read_vlc(br, totalzeros_chromadc420_table, vlcnum);
     else
-        return  code_from_bitstream_2d(br,
-                                       &totalzeros_chromadc_lentab[0][vlcnum][0],
-                                       &totalzeros_chromadc_codtab[0][vlcnum][0],
-                                       4, 1);
+        return read_vlc(br, totalzeros_chromadc422_table, vlcnum);
 }
 
 int read_ce_runbefore(BitReader &br, const int vlcnum) {
-    return code_from_bitstream_2d(br, &runbefore_lentab[vlcnum][0],
-                                  &runbefore_codtab[vlcnum][0], 16, 1);
+    return read_vlc(br, runbefore_table, vlcnum);
 }
 
 void read_rbsp_trailing_bits(BinaryReader &br) {
@@ -171,10 +279,42 @@ uint64_t MbPartHeight(uint64_t mb_type) {
     return P_and_SP_macroblock_modes[mb_type][6];
 }
 
-bool is_p_slice(uint8_t first_byte, uint8_t second_byte) {
+bool is_p_slice(std::string_view nal_unit) {
+    if (nal_unit.size() < 2)
+        return false;
+    auto first_byte = static_cast<uint8_t>(nal_unit[0]);
     if (first_byte & 0x80)
         throw std::runtime_error("forbidden 0 bit is set");
     int nal_unit_type = first_byte & 0x1F;
-    bool p_slice = (second_byte & 0xFC) == 0x98;
-    return nal_unit_type >= 1 && nal_unit_type <= 4 && p_slice;
-}
\ No newline at end of file
+    if (nal_unit_type < 1 || nal_unit_type > 4)
+        return false;
+    /* first_mb_in_slice, then slice_type */
+    BitReader br(nal_unit.substr(1), true);
+    br.read_ue();
+    return br.read_ue() % 5 == SliceType::TYPE_P;
+}
+
+uint64_t first_mb_in_slice(std::string_view nal_unit) {
+    if (nal_unit.size() < 2)
+        throw std::runtime_error("slice too short");
+    BitReader br(nal_unit.substr(1), true);
+    return br.read_ue();
+}
+
+bool is_slice(std::string_view nal_unit) {
+    /* the header byte and at least first_mb_in_slice */
+    if (nal_unit.size() < 2)
+        return false;
+    uint8_t nal_unit_type = static_cast<uint8_t>(nal_unit[0]) & 0x1F;
+    return nal_unit_type >= 1 && nal_unit_type <= 5;
+}
+
+bool ends_picture(std::string_view nal_unit) {
+    if (nal_unit.empty())
+        return false;
+    uint8_t nal_unit_type = static_cast<uint8_t>(nal_unit[0]) & 0x1F;
+    if (nal_unit_type < 1 || nal_unit_type > 5)
+        return true;
+    /* first_mb_in_slice is 0 if its first bit is set */
+    return nal_unit.size() >= 2 && (static_cast<uint8_t>(nal_unit[1]) & 0x80);
+}
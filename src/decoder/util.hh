@@ -32,10 +32,6 @@ uint8_t read_coeff_token(int nC, BitReader & br);
 
 uint8_t read_ce_levelprefix(BitReader &br);
 
-int code_from_bitstream_2d(BitReader &br,
-                                  const uint8_t *lentab, const uint8_t *codtab,
-                                  const int tabwidth, const int tabheight);
-
 int read_ce_totalzeros(BitReader &br, const int vlcnum,
                               const int chromadc);
 
@@ -43,13 +39,13 @@ int read_ce_runbefore(BitReader &br, const int vlcnum);
 
 void read_rbsp_trailing_bits(BitReader &br);
 
-inline int InverseRasterScan_x(const int a, const int b, const int,
-                               const int d) {
+constexpr int InverseRasterScan_x(const int a, const int b, const int,
+                                  const int d) {
     return (a % (d / b)) * b;
 }
 
-inline int InverseRasterScan_y(const int a, const int b, const int c,
-                               const int d) {
+constexpr int InverseRasterScan_y(const int a, const int b, const int c,
+                                  const int d) {
     return (a / (d / b)) * c;
 }
 
@@ -71,6 +67,14 @@ int MbPredLuma(uint64_t mb_type);
 
 int MbPredChroma(uint64_t mb_type);
 
-bool is_p_slice(uint8_t first_byte, uint8_t second_byte);
+/* peeks at the slice header of a slice NAL unit, which is still escaped */
+bool is_p_slice(std::string_view nal_unit);
+/* same for first_mb_in_slice. the unit has to be a slice */
+uint64_t first_mb_in_slice(std::string_view nal_unit);
+/* a slice NAL unit long enough to hold first_mb_in_slice */
+bool is_slice(std::string_view nal_unit);
+/* whether a NAL unit that starts with these bytes begins a new picture, so
+ * that the one before it is complete. the rest of it may not be there yet */
+bool ends_picture(std::string_view nal_unit);
 
 #endif //H264FLOW_UTIL_HH